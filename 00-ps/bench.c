@@ -0,0 +1,177 @@
+#include <solution.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+   Measures how many processes per second ps() scans. The callbacks only
+   count what they are given, so the numbers reflect /proc access and
+   parsing. The stdio-based scanner ps() used to be is kept here as the
+   baseline to compare against. The last line is the rate of refreshes of
+   a ps_snapshot on a system where (almost) nothing changes.
+
+   use: ./bench.out [rounds]
+ */
+
+static unsigned long nr_processes;
+static unsigned long nr_errors;
+static unsigned long nr_bytes;
+
+void report_process(pid_t pid, const char *exe, char **argv, char **envp)
+{
+	(void) pid;
+
+	nr_processes++;
+	nr_bytes += strlen(exe);
+	for (char **x = argv; *x != NULL; ++x)
+		nr_bytes += strlen(*x);
+	for (char **x = envp; *x != NULL; ++x)
+		nr_bytes += strlen(*x);
+}
+
+void report_error(const char *path, int errno_code)
+{
+	(void) path;
+	(void) errno_code;
+
+	nr_errors++;
+}
+
+static void ps_stdio(void)
+{
+	struct dirent *entry;
+	DIR *dp = opendir("/proc");
+
+	if (dp == NULL) {
+		report_error("/proc", errno);
+		return;
+	}
+
+	while ((entry = readdir(dp))) {
+		if (entry->d_type != DT_DIR || atoi(entry->d_name) <= 0)
+			continue;
+
+		pid_t pid = atoi(entry->d_name);
+		char path[512], exe[4096];
+		char cmd_buffer[4096], env_buffer[8192];
+		char *argv[256], *envp[256];
+		size_t argc = 0, envc = 0;
+		FILE *f;
+
+		snprintf(path, sizeof(path), "/proc/%s/exe", entry->d_name);
+		ssize_t exe_len = readlink(path, exe, sizeof(exe) - 1);
+		if (exe_len == -1) {
+			report_error(path, errno);
+			continue;
+		}
+		exe[exe_len] = '\0';
+
+		snprintf(path, sizeof(path), "/proc/%s/cmdline", entry->d_name);
+		if ((f = fopen(path, "r")) == NULL) {
+			report_error(path, errno);
+			continue;
+		}
+		size_t n = fread(cmd_buffer, 1, sizeof(cmd_buffer), f);
+		fclose(f);
+		for (char *s = cmd_buffer; argc < 255 && s < cmd_buffer + n; s += strlen(s) + 1)
+			argv[argc++] = strndup(s, cmd_buffer + n - s);
+		argv[argc] = NULL;
+
+		snprintf(path, sizeof(path), "/proc/%s/environ", entry->d_name);
+		if ((f = fopen(path, "r")) != NULL) {
+			n = fread(env_buffer, 1, sizeof(env_buffer), f);
+			fclose(f);
+			for (char *s = env_buffer; envc < 255 && s < env_buffer + n; s += strlen(s) + 1)
+				envp[envc++] = strndup(s, env_buffer + n - s);
+			envp[envc] = NULL;
+
+			report_process(pid, exe, argv, envp);
+		} else {
+			report_error(path, errno);
+		}
+
+		for (size_t j = 0; j < argc; j++)
+			free(argv[j]);
+		for (size_t j = 0; j < envc; j++)
+			free(envp[j]);
+	}
+
+	closedir(dp);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *name, void (*scan)(void), int rounds)
+{
+	nr_processes = nr_errors = nr_bytes = 0;
+
+	double start = now();
+	for (int i = 0; i < rounds; ++i)
+		scan();
+	double elapsed = now() - start;
+
+	printf("%-8s %8lu processes %6lu errors %10lu bytes  %10.0f processes/s\n",
+	       name, nr_processes / rounds, nr_errors / rounds, nr_bytes / rounds,
+	       nr_processes / elapsed);
+}
+
+static void ps_parallel_pid(void)
+{
+	ps_parallel(0, PS_ORDER_PID);
+}
+
+static void ps_parallel_any(void)
+{
+	ps_parallel(0, PS_ORDER_ANY);
+}
+
+static void count_event(void *arg, enum ps_event event, pid_t pid, const char *exe,
+			char **argv, char **envp)
+{
+	(void) arg;
+	(void) event;
+
+	report_process(pid, exe, argv, envp);
+}
+
+static void ps_snapshot_steady(int rounds)
+{
+	struct ps_snapshot *s = ps_snapshot_alloc();
+	ps_snapshot_refresh(s, count_event, NULL);
+
+	nr_processes = nr_errors = nr_bytes = 0;
+
+	double start = now();
+	for (int i = 0; i < rounds; ++i)
+		ps_snapshot_refresh(s, count_event, NULL);
+	double elapsed = now() - start;
+
+	printf("%-8s %8lu changes   %6lu errors %10lu bytes  %10.0f refreshes/s\n",
+	       "snapshot", nr_processes / rounds, nr_errors / rounds, nr_bytes / rounds,
+	       rounds / elapsed);
+
+	ps_snapshot_free(s);
+}
+
+int main(int argc, char **argv)
+{
+	int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	if (rounds <= 0)
+		rounds = 1;
+
+	run("stdio", ps_stdio, rounds);
+	run("ps", ps, rounds);
+	run("par-pid", ps_parallel_pid, rounds);
+	run("par-any", ps_parallel_any, rounds);
+	ps_snapshot_steady(rounds);
+	return 0;
+}
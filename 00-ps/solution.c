@@ -1,89 +1,598 @@
 #include <solution.h>
+#include <fs_malloc.h>
+#include <fs_mpsc.h>
+#include <fs_pool.h>
+#include <fs_proc.h>
+
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
-#include <stdlib.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
-void ps(void) {
-    struct dirent *entry;
-    DIR *dp = opendir("/proc");
+/* getdents64() buffer for /proc; large enough to drain tens of thousands of
+   PIDs in a handful of syscalls. */
+#define PS_DENTS_SIZE (64 * 1024)
+#define PS_ARENA_MIN (64 * 1024)
+#define PS_READ_CHUNK 4096
+/* PIDs handed to a ps_parallel() worker at a time. */
+#define PS_BATCH 32
+
+/*
+ * One arena per scan. It is reset for every process: exe, cmdline, environ
+ * and the argv/envp pointer arrays are all appended to it, so a process costs
+ * no allocations once the arena has grown to fit the largest one seen so far.
+ */
+struct ps_arena {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void arena_reserve(struct ps_arena *a, size_t extra) {
+    if (a->cap - a->len >= extra) { return; }
+
+    size_t cap = a->cap ? a->cap : PS_ARENA_MIN;
+    while (cap - a->len < extra) { cap *= 2; }
+    a->buf = fs_xrealloc(a->buf, cap);
+    a->cap = cap;
+}
+
+static void report_pid_error(pid_t pid, const char *file, int errno_code) {
+    char path[64];
+    if (file != NULL) {
+        snprintf(path, sizeof(path), "/proc/%ld/%s", (long) pid, file);
+    } else {
+        snprintf(path, sizeof(path), "/proc/%ld", (long) pid);
+    }
+    report_error(path, errno_code);
+}
+
+/* Append the whole content of @dirfd/@file to the arena. cmdline and environ
+   fill the buffer as far as the data goes, so a short read means EOF and saves
+   the extra read() that would only return 0. */
+static int read_file(struct ps_arena *a, int dirfd, const char *file) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return -errno; }
+
+    for (;;) {
+        arena_reserve(a, PS_READ_CHUNK);
+        size_t room = a->cap - a->len;
+        ssize_t n = read(fd, a->buf + a->len, room);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            int r = -errno;
+            close(fd);
+            return r;
+        }
+        a->len += n;
+        if ((size_t) n < room) { break; }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Append the target of the symlink @dirfd/@exe, NUL-terminated, to the arena. */
+static int read_exe(struct ps_arena *a, int dirfd, const char *exe) {
+    arena_reserve(a, PS_READ_CHUNK);
+    for (;;) {
+        size_t room = a->cap - a->len;
+        ssize_t n = readlinkat(dirfd, exe, a->buf + a->len, room);
+        if (n < 0) { return -errno; }
+        if ((size_t) n < room) {
+            a->buf[a->len + n] = '\0';
+            a->len += n + 1;
+            return 0;
+        }
+        arena_reserve(a, room * 2);
+    }
+}
+
+/* Make sure a block of NUL-separated strings ending at the arena tail is
+   terminated, and return the number of strings in it. */
+static size_t seal_strings(struct ps_arena *a, size_t start) {
+    if (a->len > start && a->buf[a->len - 1] != '\0') {
+        arena_reserve(a, 1);
+        a->buf[a->len++] = '\0';
+    }
+
+    size_t n = 0;
+    for (size_t i = start; i < a->len; ++i) {
+        if (a->buf[i] == '\0') { ++n; }
+    }
+    return n;
+}
+
+/*
+ * What scan_process() learned about a process. The strings sit at the start
+ * of the arena (exe at offset 0, then cmdline and environ) and are referred to
+ * by offset, so a record stays valid when the bytes are copied elsewhere.
+ */
+struct ps_record {
+    pid_t pid;
+    int err;               /* 0, or the errno that made the scan fail */
+    const char *failed;    /* the /proc/<pid> entry that failed, NULL for the directory */
+    size_t argv_off, argc;
+    size_t envp_off, envc;
+    size_t len;
+};
+
+/* Bytes needed to deliver @rec: the strings plus argv/envp pointer arrays,
+   wherever the buffer happens to be aligned. */
+static size_t record_size(const struct ps_record *rec) {
+    return rec->len + sizeof(char *) - 1 + (rec->argc + rec->envc + 2) * sizeof(char *);
+}
+
+static void fill_vector(char **v, char *s, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        v[i] = s;
+        s += strlen(s) + 1;
+    }
+    v[n] = NULL;
+}
+
+/* Lay out argv/envp of @rec after its strings at @buf, which has
+   record_size() bytes. */
+static char **build_vectors(char *buf, const struct ps_record *rec) {
+    uintptr_t vec = ((uintptr_t) (buf + rec->len) + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+    char **argv = (char **) vec;
+    fill_vector(argv, buf + rec->argv_off, rec->argc);
+    fill_vector(argv + rec->argc + 1, buf + rec->envp_off, rec->envc);
+    return argv;
+}
+
+/* Report @rec whose strings are at @buf, which has record_size() bytes. */
+static void deliver(char *buf, const struct ps_record *rec) {
+    if (rec->err) {
+        report_pid_error(rec->pid, rec->failed, rec->err);
+        return;
+    }
+
+    char **argv = build_vectors(buf, rec);
+    report_process(rec->pid, buf, argv, argv + rec->argc + 1);
+}
+
+static void scan_failed(struct ps_record *rec, const char *failed, int err) {
+    rec->failed = failed;
+    rec->err = err;
+}
+
+/* Read exe, cmdline and environ of @pid into @a, and describe them in @rec. */
+static void scan_process(struct ps_arena *a, int procfd, pid_t pid, struct ps_record *rec) {
+    char name[32];
+    int r;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->pid = pid;
+    a->len = 0;
+
+    /* Kernel threads have no exe, and there are plenty of them: find that
+       out before paying for the PID directory fd. */
+    snprintf(name, sizeof(name), "%ld/exe", (long) pid);
+    if ((r = read_exe(a, procfd, name)) < 0) {
+        scan_failed(rec, "exe", -r);
+        return;
+    }
+
+    snprintf(name, sizeof(name), "%ld", (long) pid);
+    int dirfd = openat(procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        scan_failed(rec, NULL, errno);
+        return;
+    }
+
+    rec->argv_off = a->len;
+    if ((r = read_file(a, dirfd, "cmdline")) < 0) {
+        scan_failed(rec, "cmdline", -r);
+        goto out;
+    }
+    rec->argc = seal_strings(a, rec->argv_off);
+
+    rec->envp_off = a->len;
+    if ((r = read_file(a, dirfd, "environ")) < 0) {
+        scan_failed(rec, "environ", -r);
+        goto out;
+    }
+    rec->envc = seal_strings(a, rec->envp_off);
+    rec->len = a->len;
+
+out:
+    close(dirfd);
+}
 
-    if (dp == NULL) {
+void ps(void) {
+    int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd < 0) {
         report_error("/proc", errno);
         return;
     }
 
-    while ((entry = readdir(dp))) {
-        if (entry->d_type == DT_DIR && atoi(entry->d_name) > 0) {
-            pid_t pid = atoi(entry->d_name);
-            FILE *cmdline_file, *environ_file;
-            char cmd_path[512], exe_path[512];
-            char *argv[256], *envp[256];
-            char env_path[512];
-            char cmd_buffer[4096], env_buffer[8192];
-            size_t arg_index = 0;
-            size_t envc = 0;
-
-            snprintf(exe_path, sizeof(exe_path), "/proc/%s/exe", entry->d_name);
-            ssize_t exe_len = readlink(exe_path, cmd_buffer, sizeof(cmd_buffer) - 1);
-            if (exe_len == -1) {
-                report_error(exe_path, errno);
-                continue;
-            }
-            cmd_buffer[exe_len] = '\0';
+    struct ps_arena arena = {0};
+    struct ps_record rec;
+    char *dents = fs_xmalloc(PS_DENTS_SIZE);
 
-            snprintf(cmd_path, sizeof(cmd_path), "/proc/%s/cmdline", entry->d_name);
-            cmdline_file = fopen(cmd_path, "r");
-            if (cmdline_file == NULL) {
-                report_error(cmd_path, errno);
-                continue;
-            }
+    for (;;) {
+        ssize_t n = getdents64(procfd, dents, PS_DENTS_SIZE);
+        if (n < 0) {
+            report_error("/proc", errno);
+            break;
+        }
+        if (n == 0) { break; }
 
-            size_t read_bytes = fread(cmd_buffer, sizeof(char), sizeof(cmd_buffer), cmdline_file);
-            fclose(cmdline_file);
-
-            if (read_bytes > 0) {
-                char *start = cmd_buffer;
-                while (arg_index < 255 && start < cmd_buffer + read_bytes) {
-                    argv[arg_index] = strdup(start);
-                    if (argv[arg_index] == NULL) { break; }
-                    start += strlen(start) + 1;
-                    arg_index++;
-                }
-            }
-            argv[arg_index] = NULL;
-
-            snprintf(env_path, sizeof(env_path), "/proc/%s/environ", entry->d_name);
-            environ_file = fopen(env_path, "r");
-            if (environ_file == NULL) { goto cleanup; }
-
-            read_bytes = fread(env_buffer, sizeof(char), sizeof(env_buffer), environ_file);
-            fclose(environ_file);
-
-            if (read_bytes > 0) {
-                char *start = env_buffer;
-                while (envc < 255 && start < env_buffer + read_bytes) {
-                    envp[envc] = strdup(start);
-                    if (envp[envc] == NULL) { break; }
-                    start += strlen(start) + 1;
-                    envc++;
-                }
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *) (dents + off);
+            off += d->d_reclen;
+
+            pid_t pid = fs_proc_parse_pid(d->d_name);
+            if (d->d_type != DT_DIR || pid <= 0) { continue; }
+
+            scan_process(&arena, procfd, pid, &rec);
+            if (!rec.err) {
+                /* Vectors go after the strings; nothing moves the arena
+                   once they point into it. */
+                arena_reserve(&arena, record_size(&rec) - arena.len);
             }
-            envp[envc] = NULL;
+            deliver(arena.buf, &rec);
+        }
+    }
+
+    fs_xfree(dents);
+    fs_xfree(arena.buf);
+    close(procfd);
+}
+
+/* A scanned process on its way from a worker to the reporting thread. */
+struct ps_msg {
+    struct fs_mpsc_node node;
+    size_t idx;
+    struct ps_record rec;
+    char data[];
+};
+
+struct ps_job {
+    int procfd;
+    const pid_t *pids;
+    struct ps_arena *arenas;
+    struct fs_mpsc queue;
+};
+
+static void scan_job(void *arg, unsigned int worker, size_t idx) {
+    struct ps_job *job = arg;
+    struct ps_arena *a = &job->arenas[worker];
+    struct ps_record rec;
+
+    scan_process(a, job->procfd, job->pids[idx], &rec);
+
+    struct ps_msg *m = fs_xmalloc(sizeof(*m) + (rec.err ? 0 : record_size(&rec)));
+    m->idx = idx;
+    m->rec = rec;
+    memcpy(m->data, a->buf, rec.len);
+    fs_mpsc_push(&job->queue, &m->node);
+}
+
+static void deliver_msg(struct ps_msg *m) {
+    deliver(m->data, &m->rec);
+    fs_xfree(m);
+}
+
+void ps_parallel(unsigned int nr_workers, enum ps_order order) {
+    int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd < 0) {
+        report_error("/proc", errno);
+        return;
+    }
+
+    pid_t *pids;
+    size_t n;
+    int r = fs_proc_list_pids(procfd, &pids, &n);
+    if (r < 0) {
+        report_error("/proc", -r);
+    }
+
+    if (nr_workers == 0) { nr_workers = fs_pool_default_workers(); }
+
+    struct ps_job job = {
+        .procfd = procfd,
+        .pids = pids,
+        .arenas = fs_xzalloc(nr_workers * sizeof(struct ps_arena)),
+    };
+    fs_mpsc_init(&job.queue);
+
+    struct fs_pool *pool = fs_pool_start(nr_workers, n, PS_BATCH, scan_job, &job);
+
+    /* Every PID yields exactly one message, a process or an error. In PID
+       order, messages that overtake an earlier one wait in @pending. */
+    struct ps_msg **pending = order == PS_ORDER_PID ? fs_xzalloc(n * sizeof(*pending)) : NULL;
+    size_t next = 0;
 
-            report_process(pid, cmd_buffer, argv, envp);
+    for (size_t done = 0; done < n; ++done) {
+        struct ps_msg *m = (struct ps_msg *) fs_mpsc_pop_wait(&job.queue);
 
-        cleanup:
-            for (size_t j = 0; j < arg_index; j++) {
-                free(argv[j]);
+        if (pending == NULL) {
+            deliver_msg(m);
+            continue;
+        }
+
+        pending[m->idx] = m;
+        for (; next < n && pending[next] != NULL; ++next) {
+            deliver_msg(pending[next]);
+        }
+    }
+
+    fs_pool_wait(pool);
+
+    for (unsigned int i = 0; i < nr_workers; ++i) {
+        fs_xfree(job.arenas[i].buf);
+    }
+    fs_xfree(job.arenas);
+    fs_xfree(pending);
+    fs_xfree(pids);
+    close(procfd);
+}
+
+/*
+ * A process as ps_snapshot_refresh() saw it last time. A process is identified
+ * by its PID and start time, so a recycled PID is a different process; @exec
+ * fingerprints the executable and memory layout, which change on execve().
+ */
+struct ps_entry {
+    struct ps_entry *next;
+    unsigned long long start_time;
+    uint64_t exec;
+    unsigned int generation;
+    struct ps_record rec;
+    char data[];
+};
+
+struct ps_snapshot {
+    struct ps_entry **buckets;
+    size_t nr_buckets;
+    size_t nr_entries;
+    unsigned int generation;
+
+    struct ps_arena arena;
+    char *dents;
+};
+
+#define PS_SNAPSHOT_BUCKETS 1024
+#define PS_STAT_SIZE 4096
+
+struct ps_snapshot *ps_snapshot_alloc(void) {
+    struct ps_snapshot *s = fs_xzalloc(sizeof(*s));
+    s->nr_buckets = PS_SNAPSHOT_BUCKETS;
+    s->buckets = fs_xzalloc(s->nr_buckets * sizeof(*s->buckets));
+    s->dents = fs_xmalloc(PS_DENTS_SIZE);
+    return s;
+}
+
+void ps_snapshot_free(struct ps_snapshot *s) {
+    if (s == NULL) { return; }
+
+    for (size_t i = 0; i < s->nr_buckets; ++i) {
+        for (struct ps_entry *e = s->buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            fs_xfree(e);
+        }
+    }
+    fs_xfree(s->buckets);
+    fs_xfree(s->arena.buf);
+    fs_xfree(s->dents);
+    fs_xfree(s);
+}
+
+static struct ps_entry **snapshot_slot(struct ps_snapshot *s, pid_t pid) {
+    struct ps_entry **slot = &s->buckets[(size_t) pid % s->nr_buckets];
+    while (*slot != NULL && (*slot)->rec.pid != pid) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void snapshot_grow(struct ps_snapshot *s) {
+    size_t nr_buckets = s->nr_buckets * 2;
+    struct ps_entry **buckets = fs_xzalloc(nr_buckets * sizeof(*buckets));
+
+    for (size_t i = 0; i < s->nr_buckets; ++i) {
+        for (struct ps_entry *e = s->buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            struct ps_entry **b = &buckets[(size_t) e->rec.pid % nr_buckets];
+            e->next = *b;
+            *b = e;
+        }
+    }
+
+    fs_xfree(s->buckets);
+    s->buckets = buckets;
+    s->nr_buckets = nr_buckets;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Read the start time of @pid, and fingerprint what execve() changes: the
+ * device and inode of the executable, and the code and stack addresses and
+ * where argv and environ live, which differ even between two runs of the same
+ * file. Both need ptrace access: for other processes the addresses read as 0
+ * and exe cannot be followed, so the fingerprint never changes. comm is left
+ * out, since prctl(PR_SET_NAME) changes it without an exec.
+ */
+static int read_stat(int procfd, pid_t pid, unsigned long long *start_time, uint64_t *exec) {
+    char name[32], buf[PS_STAT_SIZE];
+    struct stat st;
+
+    snprintf(name, sizeof(name), "%ld/stat", (long) pid);
+    int fd = openat(procfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return -errno; }
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    int r = n < 0 ? -errno : 0;
+    close(fd);
+    if (r < 0) { return r; }
+    buf[n] = '\0';
+
+    /* comm may contain anything, including spaces and parentheses */
+    char *comm = strchr(buf, '(');
+    char *fields = strrchr(buf, ')');
+    if (comm == NULL || fields == NULL || fields < comm) { return -EPROTO; }
+
+    uint64_t h = 14695981039346656037ULL;
+    *start_time = 0;
+
+    snprintf(name, sizeof(name), "%ld/exe", (long) pid);
+    if (fstatat(procfd, name, &st, 0) == 0) {
+        h = fnv1a(h, &st.st_dev, sizeof(st.st_dev));
+        h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+    }
+
+    /* fields[0] is the 3rd field of stat(5), "state" */
+    char *f = fields + 2;
+    for (int nr = 3; *f != '\0' && nr <= 51; ++nr) {
+        char *end = strchr(f, ' ');
+        size_t len = end ? (size_t) (end - f) : strlen(f);
+
+        if (nr == 22) {
+            *start_time = strtoull(f, NULL, 10);
+        } else if ((nr >= 26 && nr <= 28) || nr >= 48) {
+            h = fnv1a(h, f, len);
+        }
+
+        if (end == NULL) { break; }
+        f = end + 1;
+    }
+
+    *exec = h;
+    return 0;
+}
+
+static void report_entry(ps_event_fn fn, void *arg, enum ps_event event, struct ps_entry *e) {
+    char **argv = build_vectors(e->data, &e->rec);
+    fn(arg, event, e->rec.pid, e->data, argv, argv + e->rec.argc + 1);
+}
+
+/* Scan @pid into a new entry, replacing whatever *@slot held. */
+static struct ps_entry *snapshot_scan(struct ps_snapshot *s, int procfd, pid_t pid,
+                                      struct ps_entry **slot, unsigned long long start_time,
+                                      uint64_t exec) {
+    struct ps_record rec;
+    scan_process(&s->arena, procfd, pid, &rec);
+
+    struct ps_entry *e = fs_xmalloc(sizeof(*e) + (rec.err ? 0 : record_size(&rec)));
+    e->start_time = start_time;
+    e->exec = exec;
+    e->generation = s->generation;
+    e->rec = rec;
+    memcpy(e->data, s->arena.buf, rec.len);
+
+    if (*slot != NULL) {
+        e->next = (*slot)->next;
+        fs_xfree(*slot);
+    } else {
+        e->next = NULL;
+        s->nr_entries++;
+    }
+    *slot = e;
+
+    /* Processes ps() cannot read (kernel threads have no exe) are reported
+       once, and then stay in the snapshot so they are not retried. */
+    if (rec.err) {
+        report_pid_error(pid, rec.failed, rec.err);
+    }
+    return e;
+}
+
+static void snapshot_update(struct ps_snapshot *s, int procfd, pid_t pid,
+                            ps_event_fn fn, void *arg) {
+    unsigned long long start_time;
+    uint64_t exec;
+
+    int r = read_stat(procfd, pid, &start_time, &exec);
+    if (r == -ENOENT || r == -ESRCH) { return; }
+    if (r < 0) {
+        report_pid_error(pid, "stat", -r);
+        return;
+    }
+
+    struct ps_entry **slot = snapshot_slot(s, pid);
+    struct ps_entry *e = *slot;
+
+    if (e != NULL && e->start_time == start_time && e->exec == exec) {
+        e->generation = s->generation;
+        return;
+    }
+
+    enum ps_event event = PS_EVENT_ADDED;
+    if (e != NULL && e->start_time == start_time) {
+        event = e->rec.err ? PS_EVENT_ADDED : PS_EVENT_EXEC;
+    } else if (e != NULL && !e->rec.err) {
+        /* the PID was recycled */
+        report_entry(fn, arg, PS_EVENT_REMOVED, e);
+    }
+
+    e = snapshot_scan(s, procfd, pid, slot, start_time, exec);
+    if (!e->rec.err) {
+        report_entry(fn, arg, event, e);
+    }
+}
+
+void ps_snapshot_refresh(struct ps_snapshot *s, ps_event_fn fn, void *arg) {
+    int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd < 0) {
+        report_error("/proc", errno);
+        return;
+    }
+
+    s->generation++;
+
+    for (;;) {
+        ssize_t n = getdents64(procfd, s->dents, PS_DENTS_SIZE);
+        if (n < 0) {
+            /* We do not know who is gone, so do not report anyone. */
+            report_error("/proc", errno);
+            close(procfd);
+            return;
+        }
+        if (n == 0) { break; }
+
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *) (s->dents + off);
+            off += d->d_reclen;
+
+            pid_t pid = fs_proc_parse_pid(d->d_name);
+            if (d->d_type == DT_DIR && pid > 0) {
+                snapshot_update(s, procfd, pid, fn, arg);
+            }
+        }
+    }
+    close(procfd);
+
+    for (size_t i = 0; i < s->nr_buckets; ++i) {
+        for (struct ps_entry **slot = &s->buckets[i]; *slot != NULL;) {
+            struct ps_entry *e = *slot;
+            if (e->generation == s->generation) {
+                slot = &e->next;
+                continue;
             }
-            for (size_t j = 0; j < envc; j++) {
-                free(envp[j]);
+
+            if (!e->rec.err) {
+                report_entry(fn, arg, PS_EVENT_REMOVED, e);
             }
+            *slot = e->next;
+            fs_xfree(e);
+            s->nr_entries--;
         }
     }
 
-    closedir(dp);
+    if (s->nr_entries > s->nr_buckets) {
+        snapshot_grow(s);
+    }
 }
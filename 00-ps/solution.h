@@ -9,6 +9,74 @@
 */
 void ps(void);
 
+/**
+   The order in which ps_parallel() reports processes.
+
+   PS_ORDER_PID reports them sorted by PID, like ps() does.
+   PS_ORDER_ANY reports each process as soon as it has been read.
+ */
+enum ps_order
+{
+	PS_ORDER_PID,
+	PS_ORDER_ANY,
+};
+
+/**
+   A version of ps() that reads processes on @nr_workers threads
+   (0 means one per CPU), so that one slow process does not hold up
+   the others. report_process() and report_error() are still called
+   from the calling thread only, never concurrently.
+*/
+void ps_parallel(unsigned int nr_workers, enum ps_order order);
+
+/**
+   A snapshot of running processes that can be brought up to date
+   cheaply. A process is identified by its PID and its start time, and
+   its exe, argv and envp are kept in the snapshot, so a refresh only
+   reads /proc/<pid>/stat of processes it already knows about.
+ */
+struct ps_snapshot;
+
+/* Allocate an empty snapshot. */
+struct ps_snapshot* ps_snapshot_alloc(void);
+/* Release all memory allocated to @s. ps_snapshot_free(NULL) is a no-op. */
+void ps_snapshot_free(struct ps_snapshot *s);
+
+enum ps_event
+{
+	PS_EVENT_ADDED,
+	PS_EVENT_REMOVED,
+	PS_EVENT_EXEC,
+};
+
+/**
+   What ps_snapshot_refresh() calls for each change, with the @arg given to
+   it.
+
+   @event is PS_EVENT_ADDED for a new process, PS_EVENT_REMOVED for one
+   that exited (with the exe, argv and envp it was last seen with), and
+   PS_EVENT_EXEC for one that called execve() (with the new ones).
+   The other arguments are as in report_process().
+*/
+typedef void (*ps_event_fn)(void *arg, enum ps_event event, pid_t pid,
+			    const char *exe, char **argv, char **envp);
+
+/**
+   Rescan /proc and call @fn for every process that started, exited or
+   called execve() since the previous refresh. The first refresh of
+   a snapshot reports every process as added.
+
+   An exec is noticed by the executable and the memory layout of the
+   process changing, which can only be read for processes we may ptrace.
+   For the others, an exec goes unreported; the process is reported as
+   removed once it exits.
+
+   Like ps(), it calls report_error() if it cannot access a file or
+   a directory. An error on a process is reported once, and the process
+   is not retried until it execs or exits.
+ */
+void ps_snapshot_refresh(struct ps_snapshot *s, ps_event_fn fn, void *arg);
+
 /**
    ps() must call this function to report each running process.
 
@@ -17,6 +85,7 @@ void ps(void);
    @envp is a NULL-terminated array of environment variables of the process
 */
 void report_process(pid_t pid, const char *exe, char **argv, char **envp);
+
 /**
    ps() must call this function whenever it detects an error when accessing
    a file or a directory.
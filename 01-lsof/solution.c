@@ -1,6 +1,612 @@
 #include <solution.h>
+#include <fs_malloc.h>
+#include <fs_mpsc.h>
+#include <fs_pool.h>
+#include <fs_proc.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* getdents64() buffer for /proc and /proc/<pid>/fd. */
+#define LSOF_DENTS_SIZE (64 * 1024)
+#define LSOF_LOG_MIN (16 * 1024)
+#define LSOF_PATH_MIN 4096
+/* PIDs handed to an lsof_parallel() worker at a time. */
+#define LSOF_BATCH 32
+
+/*
+ * Everything found out about one process, in the order it should be reported.
+ * Each entry is a struct lsof_entry followed by a NUL-terminated path. Scratch
+ * buffers are reused from one process to the next, so a scan allocates only
+ * when a process beats the previous record.
+ */
+struct lsof_log
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+
+	char *dents;
+	/* /proc/<pid>/maps, for lsof_batch() */
+	char *maps;
+	size_t maps_cap;
+};
+
+struct lsof_entry
+{
+	int errno_code;		/* 0 for an open file */
+	int fd;			/* LSOF_FD_MAPPED for a mapped one */
+};
+
+static void log_reserve(struct lsof_log *l, size_t extra)
+{
+	if (l->cap - l->len >= extra)
+		return;
+
+	size_t cap = l->cap ? l->cap : LSOF_LOG_MIN;
+	while (cap - l->len < extra)
+		cap *= 2;
+	l->buf = fs_xrealloc(l->buf, cap);
+	l->cap = cap;
+}
+
+/* Log @len bytes of @path as file @fd of the process, or as an error. */
+static void log_path(struct lsof_log *l, int errno_code, int fd, const char *path, size_t len)
+{
+	struct lsof_entry e = {.errno_code = errno_code, .fd = fd};
+
+	log_reserve(l, sizeof(e) + len + 1);
+	memcpy(l->buf + l->len, &e, sizeof(e));
+	memcpy(l->buf + l->len + sizeof(e), path, len);
+	l->buf[l->len + sizeof(e) + len] = '\0';
+	l->len += sizeof(e) + len + 1;
+}
+
+static void log_error(struct lsof_log *l, int errno_code, const char *fmt, long pid, const char *fd)
+{
+	char path[320];
+	int n = snprintf(path, sizeof(path), fmt, pid, fd);
+
+	if (n < 0 || (size_t)n >= sizeof(path))
+		n = strlen(path);
+
+	log_path(l, errno_code, -1, path, n);
+}
+
+/* Log the target of the symlink @dirfd/@name as open file @fd. */
+static int log_link(struct lsof_log *l, int dirfd, const char *name, int fd)
+{
+	struct lsof_entry e = {.errno_code = 0, .fd = fd};
+
+	log_reserve(l, sizeof(e) + LSOF_PATH_MIN);
+	for (;;) {
+		char *path = l->buf + l->len + sizeof(e);
+		size_t room = l->cap - l->len - sizeof(e);
+		ssize_t n = readlinkat(dirfd, name, path, room);
+
+		if (n < 0)
+			return -errno;
+		if ((size_t)n < room) {
+			path[n] = '\0';
+			memcpy(l->buf + l->len, &e, sizeof(e));
+			l->len += sizeof(e) + n + 1;
+			return 0;
+		}
+		log_reserve(l, sizeof(e) + room * 2);
+	}
+}
+
+/* Walk the entries of a log: return the offset of the one after @off. */
+static size_t log_next(const char *buf, size_t off, struct lsof_entry *e, const char **path)
+{
+	memcpy(e, buf + off, sizeof(*e));
+	*path = buf + off + sizeof(*e);
+	return off + sizeof(*e) + strlen(*path) + 1;
+}
+
+static void replay(const char *buf, size_t len)
+{
+	for (size_t off = 0; off < len;) {
+		struct lsof_entry e;
+		const char *path;
+
+		off = log_next(buf, off, &e, &path);
+		if (e.errno_code)
+			report_error(path, e.errno_code);
+		else
+			report_file(path);
+	}
+}
+
+/* Log every open file of @pid, starting from an empty log. */
+static void scan_process(struct lsof_log *l, int procfd, pid_t pid)
+{
+	char name[32];
+
+	l->len = 0;
+	if (l->dents == NULL)
+		l->dents = fs_xmalloc(LSOF_DENTS_SIZE);
+
+	snprintf(name, sizeof(name), "%ld/fd", (long)pid);
+	int fdfd = openat(procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fdfd < 0) {
+		log_error(l, errno, "/proc/%ld/fd", pid, NULL);
+		return;
+	}
+
+	for (;;) {
+		ssize_t n = getdents64(fdfd, l->dents, LSOF_DENTS_SIZE);
+		if (n < 0) {
+			log_error(l, errno, "/proc/%ld/fd", pid, NULL);
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (ssize_t off = 0; off < n;) {
+			struct dirent64 *d = (struct dirent64 *)(l->dents + off);
+			off += d->d_reclen;
+
+			if (d->d_name[0] == '.')
+				continue;
+
+			int r = log_link(l, fdfd, d->d_name, atoi(d->d_name));
+			if (r < 0)
+				log_error(l, -r, "/proc/%ld/fd/%s", pid, d->d_name);
+		}
+	}
+
+	close(fdfd);
+}
+
+static void log_free(struct lsof_log *l)
+{
+	fs_xfree(l->buf);
+	fs_xfree(l->dents);
+	fs_xfree(l->maps);
+}
 
 void lsof(void)
 {
-	/* implement me */
+	int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (procfd < 0) {
+		report_error("/proc", errno);
+		return;
+	}
+
+	struct lsof_log log = {0};
+	char *dents = fs_xmalloc(LSOF_DENTS_SIZE);
+
+	for (;;) {
+		ssize_t n = getdents64(procfd, dents, LSOF_DENTS_SIZE);
+		if (n < 0) {
+			report_error("/proc", errno);
+			break;
+		}
+		if (n == 0)
+			break;
+
+		for (ssize_t off = 0; off < n;) {
+			struct dirent64 *d = (struct dirent64 *)(dents + off);
+			off += d->d_reclen;
+
+			pid_t pid = fs_proc_parse_pid(d->d_name);
+			if (d->d_type != DT_DIR || pid <= 0)
+				continue;
+
+			scan_process(&log, procfd, pid);
+			replay(log.buf, log.len);
+		}
+	}
+
+	fs_xfree(dents);
+	log_free(&log);
+	close(procfd);
+}
+
+/* The log of one process on its way from a worker to the reporting thread. */
+struct lsof_msg
+{
+	struct fs_mpsc_node node;
+	size_t idx;
+	size_t len;
+	char data[];
+};
+
+/* Takes the log of each process, on the thread that runs the job. */
+typedef void (*lsof_deliver_fn)(void *ctx, pid_t pid, const char *buf, size_t len);
+
+struct lsof_job
+{
+	int procfd;
+	const pid_t *pids;
+	unsigned int flags;
+	struct lsof_log *logs;
+	struct fs_mpsc queue;
+};
+
+static void log_maps(struct lsof_log *l, int procfd, pid_t pid);
+
+static void scan_job(void *arg, unsigned int worker, size_t idx)
+{
+	struct lsof_job *job = arg;
+	struct lsof_log *l = &job->logs[worker];
+
+	scan_process(l, job->procfd, job->pids[idx]);
+	if (job->flags & LSOF_BATCH_MAPS)
+		log_maps(l, job->procfd, job->pids[idx]);
+
+	struct lsof_msg *m = fs_xmalloc(sizeof(*m) + l->len);
+	m->idx = idx;
+	m->len = l->len;
+	if (l->len > 0)
+		memcpy(m->data, l->buf, l->len);
+	fs_mpsc_push(&job->queue, &m->node);
+}
+
+/*
+ * Scan every process in /proc on @nr_workers threads, each with a log of its
+ * own, and hand the logs to @deliver on the calling thread, in @order.
+ * LSOF_BATCH_MAPS in @flags adds the files mapped by each process.
+ */
+static void run_job(unsigned int nr_workers, unsigned int flags, enum lsof_order order,
+		    lsof_deliver_fn deliver, void *ctx)
+{
+	int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (procfd < 0) {
+		report_error("/proc", errno);
+		return;
+	}
+
+	pid_t *pids;
+	size_t n;
+	int r = fs_proc_list_pids(procfd, &pids, &n);
+	if (r < 0)
+		report_error("/proc", -r);
+
+	if (nr_workers == 0)
+		nr_workers = fs_pool_default_workers();
+
+	struct lsof_job job = {
+		.procfd = procfd,
+		.pids = pids,
+		.flags = flags,
+		.logs = fs_xzalloc(nr_workers * sizeof(struct lsof_log)),
+	};
+	fs_mpsc_init(&job.queue);
+
+	struct fs_pool *pool = fs_pool_start(nr_workers, n, LSOF_BATCH, scan_job, &job);
+
+	/* Every PID yields exactly one message. In PID order, messages that
+	   overtake an earlier one wait in @pending. */
+	struct lsof_msg **pending = order == LSOF_ORDER_PID ? fs_xzalloc(n * sizeof(*pending)) : NULL;
+	size_t next = 0;
+
+	for (size_t done = 0; done < n; ++done) {
+		struct lsof_msg *m = (struct lsof_msg *)fs_mpsc_pop_wait(&job.queue);
+
+		if (pending == NULL) {
+			deliver(ctx, pids[m->idx], m->data, m->len);
+			fs_xfree(m);
+			continue;
+		}
+
+		pending[m->idx] = m;
+		for (; next < n && pending[next] != NULL; ++next) {
+			deliver(ctx, pids[next], pending[next]->data, pending[next]->len);
+			fs_xfree(pending[next]);
+		}
+	}
+
+	fs_pool_wait(pool);
+
+	for (unsigned int i = 0; i < nr_workers; ++i)
+		log_free(&job.logs[i]);
+	fs_xfree(job.logs);
+	fs_xfree(pending);
+	fs_xfree(pids);
+	close(procfd);
+}
+
+static void replay_job(void *ctx, pid_t pid, const char *buf, size_t len)
+{
+	(void) ctx;
+	(void) pid;
+	replay(buf, len);
+}
+
+void lsof_parallel(unsigned int nr_workers, enum lsof_order order)
+{
+	run_job(nr_workers, 0, order, replay_job, NULL);
+}
+
+/*
+ * Interned paths of one lsof_batch() call. Strings live in chunks that never
+ * move, so ids and pointers handed out stay valid until the call returns.
+ * @slots is an open-addressing hash of path ids (+1, 0 means empty).
+ */
+struct lsof_strtab
+{
+	unsigned int *slots;
+	size_t nr_slots;
+
+	const char **paths;
+	uint64_t *hashes;
+	size_t nr_paths;
+	size_t cap_paths;
+
+	char **chunks;
+	size_t nr_chunks;
+	char *free;
+	size_t left;
+};
+
+#define LSOF_STRTAB_SLOTS 4096
+#define LSOF_STRTAB_CHUNK (64 * 1024)
+/* Entries collected before they are handed to report_files(). */
+#define LSOF_BATCH_ENTRIES 4096
+
+static uint64_t hash_path(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+	return h;
+}
+
+static void strtab_rehash(struct lsof_strtab *t, size_t nr_slots)
+{
+	fs_xfree(t->slots);
+	t->slots = fs_xzalloc(nr_slots * sizeof(*t->slots));
+	t->nr_slots = nr_slots;
+
+	for (size_t id = 0; id < t->nr_paths; ++id) {
+		size_t i = t->hashes[id] & (nr_slots - 1);
+		while (t->slots[i])
+			i = (i + 1) & (nr_slots - 1);
+		t->slots[i] = id + 1;
+	}
+}
+
+static const char* strtab_store(struct lsof_strtab *t, const char *s, size_t len)
+{
+	if (t->left < len + 1) {
+		size_t size = len + 1 > LSOF_STRTAB_CHUNK ? len + 1 : LSOF_STRTAB_CHUNK;
+		t->chunks = fs_xrealloc(t->chunks, (t->nr_chunks + 1) * sizeof(*t->chunks));
+		t->free = t->chunks[t->nr_chunks++] = fs_xmalloc(size);
+		t->left = size;
+	}
+
+	char *copy = t->free;
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	t->free += len + 1;
+	t->left -= len + 1;
+	return copy;
+}
+
+/* Return the id of @s (@len bytes, not necessarily NUL-terminated). */
+static unsigned int strtab_intern(struct lsof_strtab *t, const char *s, size_t len)
+{
+	uint64_t h = hash_path(s, len);
+	size_t mask = t->nr_slots - 1;
+
+	for (size_t i = h & mask; t->slots[i]; i = (i + 1) & mask) {
+		unsigned int id = t->slots[i] - 1;
+		if (t->hashes[id] == h && strncmp(t->paths[id], s, len) == 0 &&
+		    t->paths[id][len] == '\0')
+			return id;
+	}
+
+	if (t->nr_paths == t->cap_paths) {
+		t->cap_paths = t->cap_paths ? t->cap_paths * 2 : 1024;
+		t->paths = fs_xrealloc(t->paths, t->cap_paths * sizeof(*t->paths));
+		t->hashes = fs_xrealloc(t->hashes, t->cap_paths * sizeof(*t->hashes));
+	}
+
+	unsigned int id = t->nr_paths++;
+	t->paths[id] = strtab_store(t, s, len);
+	t->hashes[id] = h;
+
+	/* keep the table at most half full */
+	if (t->nr_paths * 2 > t->nr_slots) {
+		strtab_rehash(t, t->nr_slots * 2);
+	} else {
+		size_t i = h & mask;
+		while (t->slots[i])
+			i = (i + 1) & mask;
+		t->slots[i] = id + 1;
+	}
+	return id;
+}
+
+static void strtab_free(struct lsof_strtab *t)
+{
+	for (size_t i = 0; i < t->nr_chunks; ++i)
+		fs_xfree(t->chunks[i]);
+	fs_xfree(t->chunks);
+	fs_xfree(t->slots);
+	fs_xfree(t->paths);
+	fs_xfree(t->hashes);
+}
+
+#define LSOF_MAPS_DELETED " (deleted)"
+
+/*
+   Return the file mapped by the maps line [@line, @eol), and its length in
+   @len, or NULL if the mapping is not of a file. The line is "address perms
+   offset dev inode pathname": the pathname, which may hold spaces, is the
+   rest of the line past five fields, and only files have one that starts
+   with '/'. Anonymous mappings may be named anything, '/' included, but
+   in brackets.
+ */
+static const char* maps_path(const char *line, const char *eol, size_t *len)
+{
+	const char *p = line;
+
+	for (int field = 0; field < 5; ++field) {
+		while (p < eol && *p != ' ')
+			p++;
+		while (p < eol && *p == ' ')
+			p++;
+	}
+	if (p == eol || *p != '/')
+		return NULL;
+
+	*len = eol - p;
+	if (*len > strlen(LSOF_MAPS_DELETED) &&
+	    memcmp(eol - strlen(LSOF_MAPS_DELETED), LSOF_MAPS_DELETED, strlen(LSOF_MAPS_DELETED)) == 0)
+		*len -= strlen(LSOF_MAPS_DELETED);
+	return p;
+}
+
+/*
+ * Log every file mapped by @pid, after its open files. Mappings of one file
+ * are mostly next to each other, so only a path that differs from the one on
+ * the line before is logged; lsof_batch() drops the rest of the repeats.
+ */
+static void log_maps(struct lsof_log *l, int procfd, pid_t pid)
+{
+	char name[32];
+	size_t len = 0;
+
+	snprintf(name, sizeof(name), "%ld/maps", (long)pid);
+	int fd = openat(procfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error(l, errno, "/proc/%ld/maps", pid, NULL);
+		return;
+	}
+
+	/* maps is a seq_file: short reads do not mean EOF */
+	for (;;) {
+		if (l->maps_cap - len < LSOF_PATH_MIN) {
+			l->maps_cap = l->maps_cap ? l->maps_cap * 2 : LSOF_LOG_MIN;
+			l->maps = fs_xrealloc(l->maps, l->maps_cap);
+		}
+		ssize_t n = read(fd, l->maps + len, l->maps_cap - len);
+		if (n < 0) {
+			log_error(l, errno, "/proc/%ld/maps", pid, NULL);
+			close(fd);
+			return;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	close(fd);
+
+	const char *prev = NULL;
+	size_t prev_len = 0;
+
+	for (char *line = l->maps, *end = l->maps + len; line < end;) {
+		char *eol = memchr(line, '\n', end - line);
+		if (eol == NULL)
+			eol = end;
+
+		size_t path_len;
+		const char *path = maps_path(line, eol, &path_len);
+		if (path != NULL && (path_len != prev_len || memcmp(path, prev, prev_len) != 0)) {
+			log_path(l, 0, LSOF_FD_MAPPED, path, path_len);
+			prev = path;
+			prev_len = path_len;
+		}
+
+		line = eol + 1;
+	}
+}
+
+/* The state of one lsof_batch() call, on the calling thread. */
+struct lsof_scan
+{
+	struct lsof_strtab strtab;
+
+	struct lsof_file *files;
+	size_t nr_files;
+	lsof_files_fn fn;
+	void *arg;
+
+	/* seen[path_id] == nr_scanned if the process already mapped the path */
+	unsigned int *seen;
+	size_t nr_seen;
+	unsigned int nr_scanned;
+};
+
+static void batch_flush(struct lsof_scan *b)
+{
+	if (b->nr_files == 0)
+		return;
+
+	b->fn(b->arg, b->files, b->nr_files, b->strtab.paths, b->strtab.nr_paths);
+	b->nr_files = 0;
+}
+
+/* Whether the process mapped path @id before; mark it as mapped if not. */
+static bool batch_mapped(struct lsof_scan *b, unsigned int id)
+{
+	if (id >= b->nr_seen) {
+		size_t nr_seen = b->nr_seen ? b->nr_seen : 1024;
+		while (nr_seen <= id)
+			nr_seen *= 2;
+		b->seen = fs_xrealloc(b->seen, nr_seen * sizeof(*b->seen));
+		memset(b->seen + b->nr_seen, 0, (nr_seen - b->nr_seen) * sizeof(*b->seen));
+		b->nr_seen = nr_seen;
+	}
+
+	if (b->seen[id] == b->nr_scanned)
+		return true;
+	b->seen[id] = b->nr_scanned;
+	return false;
+}
+
+/* Intern the paths in the log of @pid, and queue its files. */
+static void batch_deliver(void *ctx, pid_t pid, const char *buf, size_t len)
+{
+	struct lsof_scan *b = ctx;
+
+	b->nr_scanned++;
+
+	for (size_t off = 0; off < len;) {
+		struct lsof_entry e;
+		const char *path;
+
+		off = log_next(buf, off, &e, &path);
+		if (e.errno_code) {
+			report_error(path, e.errno_code);
+			continue;
+		}
+
+		unsigned int id = strtab_intern(&b->strtab, path, strlen(path));
+		if (e.fd == LSOF_FD_MAPPED && batch_mapped(b, id))
+			continue;
+
+		struct lsof_file *f = &b->files[b->nr_files++];
+		f->pid = pid;
+		f->fd = e.fd;
+		f->path_id = id;
+		if (b->nr_files == LSOF_BATCH_ENTRIES)
+			batch_flush(b);
+	}
+}
+
+void lsof_batch(unsigned int nr_workers, unsigned int flags, lsof_files_fn fn, void *arg)
+{
+	struct lsof_scan b = {
+		.files = fs_xmalloc(LSOF_BATCH_ENTRIES * sizeof(struct lsof_file)),
+		.fn = fn,
+		.arg = arg,
+	};
+	strtab_rehash(&b.strtab, LSOF_STRTAB_SLOTS);
+
+	run_job(nr_workers, flags, LSOF_ORDER_PID, batch_deliver, &b);
+	batch_flush(&b);
+
+	fs_xfree(b.files);
+	fs_xfree(b.seen);
+	strtab_free(&b.strtab);
 }
@@ -9,12 +9,81 @@
 */
 void lsof(void);
 
+/**
+   The order in which lsof_parallel() reports files.
+
+   LSOF_ORDER_PID reports them grouped by process and sorted by PID.
+   LSOF_ORDER_ANY reports the files of each process as soon as they
+   have been read. Files of one process are never interleaved with
+   files of another one.
+ */
+enum lsof_order
+{
+	LSOF_ORDER_PID,
+	LSOF_ORDER_ANY,
+};
+
+/**
+   A version of lsof() that reads processes on @nr_workers threads
+   (0 means one per CPU), so that one slow process does not hold up
+   the others. report_file() and report_error() are still called
+   from the calling thread only, never concurrently.
+*/
+void lsof_parallel(unsigned int nr_workers, enum lsof_order order);
+
+/* lsof_batch() flag: also report files mapped into memory. */
+#define LSOF_BATCH_MAPS 0x1
+
+/* The fd of a file that is mapped by a process (see /proc/<pid>/maps). */
+#define LSOF_FD_MAPPED (-1)
+
+/**
+   An open file found by lsof_batch(): process @pid has the file
+   with path number @path_id open at @fd, or mapped if @fd is
+   LSOF_FD_MAPPED.
+ */
+struct lsof_file
+{
+	pid_t pid;
+	int fd;
+	unsigned int path_id;
+};
+
+/**
+   What lsof_batch() calls for each batch of @nr_files open files, with
+   the @arg given to it.
+
+   @paths holds all paths seen so far by the current lsof_batch() call,
+   so files[i].path_id < @nr_paths. Path numbers and the strings they
+   point to stay the same until lsof_batch() returns; only new paths are
+   appended from one batch to the next. The arrays themselves are valid
+   until the call returns.
+*/
+typedef void (*lsof_files_fn)(void *arg, const struct lsof_file *files, size_t nr_files,
+			      const char *const *paths, size_t nr_paths);
+
+/**
+   A version of lsof() that reports open files in batches through @fn
+   instead of one report_file() call per file. Every distinct path is
+   stored once, and files refer to it by number.
+
+   Processes are read on @nr_workers threads (0 means one per CPU), each
+   with buffers of its own that it reuses from one process to the next,
+   and files are reported sorted by PID. @fn and report_error() are
+   called from the calling thread only, never concurrently.
+
+   With LSOF_BATCH_MAPS in @flags, every file mapped by a process is
+   reported as well, once per process however many mappings it has.
+*/
+void lsof_batch(unsigned int nr_workers, unsigned int flags, lsof_files_fn fn, void *arg);
+
 /**
    lsof() must call this function to report each open file.
 
    @path is the absolute path to the file
 */
 void report_file(const char *path);
+
 /**
    lsof() must call this function whenever it detects an error when accessing
    a file or a directory.
@@ -0,0 +1,294 @@
+#include <solution.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <sys/resource.h>
+
+/*
+   use: ./bench.out uring [size-in-MiB] [dir]
+        ./bench.out engines [dir] [size...]
+        ./bench.out many [dir] [count] [size]
+
+   "uring" measures copy_ex() throughput against queue depth and block
+   size. The source file is created once and stays in the page cache, so
+   the numbers show the cost of the copy pipeline rather than of the device,
+   except in the "direct" modes, which bypass the page cache. Next to the
+   throughput is the CPU time the copy took, user and system, which includes
+   the SQPOLL kernel thread.
+
+   "engines" runs every copy engine on files of each size (1M, 1G and 10G
+   by default; K, M and G suffixes are understood), once with both files
+   in the page cache and once with the page cache of both files dropped.
+
+   "many" copies count files of size bytes each (10000 files of 16K by
+   default), one copy() at a time and then with copy_many() at several
+   depths, and reports files/s.
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void make_input(int fd, size_t size)
+{
+	size_t chunk = size < (1 << 20) ? size : (1 << 20);
+	char *buf = malloc(chunk);
+	if (buf == NULL)
+		errx(1, "malloc() failed");
+
+	for (size_t i = 0; i < chunk; ++i)
+		buf[i] = rand();
+	for (size_t off = 0; off < size; off += chunk) {
+		size_t n = size - off < chunk ? size - off : chunk;
+		if (pwrite(fd, buf, n, off) != (ssize_t)n)
+			err(1, "pwrite() failed");
+	}
+	free(buf);
+}
+
+static const struct {
+	const char *name;
+	unsigned int flags;
+} modes[] = {
+	{"plain", 0},
+	{"fixed", COPY_FIXED_BUFFERS | COPY_FIXED_FILES},
+	{"linked", COPY_LINK},
+	{"fixed+linked", COPY_FIXED_BUFFERS | COPY_FIXED_FILES | COPY_LINK},
+	{"sqpoll", COPY_SQPOLL},
+	{"sqpoll+fixed", COPY_SQPOLL | COPY_FIXED_BUFFERS | COPY_FIXED_FILES},
+	{"direct", COPY_DIRECT},
+	{"direct+fixed", COPY_DIRECT | COPY_FIXED_BUFFERS | COPY_FIXED_FILES},
+	{"direct+sqpoll", COPY_DIRECT | COPY_SQPOLL | COPY_FIXED_BUFFERS | COPY_FIXED_FILES},
+};
+
+/* User and system CPU time of the process so far, in seconds. */
+static double cpu_time(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static int bench_uring(int argc, char **argv)
+{
+	size_t size = (argc > 0 ? strtoull(argv[0], NULL, 10) : 256) << 20;
+	const char *dir = argc > 1 ? argv[1] : ".";
+	static const unsigned int depths[] = {1, 2, 4, 8, 16, 32};
+	static const unsigned int blocks[] = {64 << 10, 256 << 10, 1 << 20};
+	char in_path[4096], out_path[4096];
+
+	snprintf(in_path, sizeof(in_path), "%s/bench.in", dir);
+	snprintf(out_path, sizeof(out_path), "%s/bench.out.data", dir);
+
+	int in = open(in_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (in < 0 || out < 0)
+		err(1, "open() failed");
+	make_input(in, size);
+
+	printf("%-14s %8s %6s %10s %10s\n", "mode", "block", "depth", "GB/s", "CPU s");
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+		for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); ++b) {
+			for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+				struct copy_params params = {
+					.block_size = blocks[b],
+					.depth = depths[d],
+					.flags = modes[m].flags,
+				};
+
+				if (ftruncate(out, 0) < 0)
+					err(1, "ftruncate() failed");
+
+				double start = now(), cpu = cpu_time();
+				int r = copy_ex(in, out, &params);
+				double elapsed = now() - start;
+				cpu = cpu_time() - cpu;
+
+				if (r < 0)
+					errx(1, "copy_ex() failed: %s", strerror(-r));
+				printf("%-14s %7uk %6u %10.2f %10.3f\n", modes[m].name,
+				       blocks[b] >> 10, depths[d], size / elapsed / 1e9, cpu);
+			}
+		}
+	}
+
+	close(out);
+	close(in);
+	unlink(out_path);
+	unlink(in_path);
+	return 0;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		n <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+/* Write back and evict the page cache of @fd, so the next copy reads
+   from (and writes to) the device. */
+static void drop_cache(int fd)
+{
+	if (fdatasync(fd) < 0)
+		err(1, "fdatasync() failed");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static const char *const engine_names[] = {
+	[COPY_ENGINE_AUTO] = "auto",
+	[COPY_ENGINE_COPY_FILE_RANGE] = "copy_file_range",
+	[COPY_ENGINE_SPLICE] = "splice",
+	[COPY_ENGINE_IO_URING] = "io_uring",
+};
+
+static int bench_engines(int argc, char **argv)
+{
+	static char *default_sizes[] = {"1M", "1G", "10G"};
+	const char *dir = argc > 0 ? argv[0] : ".";
+	char **sizes = argc > 1 ? argv + 1 : default_sizes;
+	int nr_sizes = argc > 1 ? argc - 1 : 3;
+	char in_path[4096], out_path[4096];
+
+	snprintf(in_path, sizeof(in_path), "%s/bench.in", dir);
+	snprintf(out_path, sizeof(out_path), "%s/bench.out.data", dir);
+
+	printf("%-16s %10s %8s %10s\n", "engine", "size", "cache", "GB/s");
+	for (int i = 0; i < nr_sizes; ++i) {
+		size_t size = parse_size(sizes[i]);
+		int in = open(in_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (in < 0)
+			err(1, "open() failed");
+		make_input(in, size);
+
+		for (int cold = 0; cold < 2; ++cold) {
+			for (int e = COPY_ENGINE_AUTO; e <= COPY_ENGINE_IO_URING; ++e) {
+				int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+				if (out < 0)
+					err(1, "open() failed");
+
+				if (cold)
+					drop_cache(in);
+				else
+					copy_with_engine(in, out, COPY_ENGINE_SPLICE, NULL);
+				if (ftruncate(out, 0) < 0)
+					err(1, "ftruncate() failed");
+				drop_cache(out);
+
+				enum copy_engine used;
+				double start = now();
+				int r = copy_with_engine(in, out, e, &used);
+				double elapsed = now() - start;
+
+				if (r < 0)
+					printf("%-16s %10s %8s %10s (%s)\n", engine_names[e], sizes[i],
+					       cold ? "dropped" : "hot", "-", strerror(-r));
+				else
+					printf("%-16s %10s %8s %10.2f%s%s\n", engine_names[e], sizes[i],
+					       cold ? "dropped" : "hot", size / elapsed / 1e9,
+					       e == COPY_ENGINE_AUTO ? " -> " : "",
+					       e == COPY_ENGINE_AUTO ? engine_names[used] : "");
+				close(out);
+			}
+		}
+
+		close(in);
+	}
+
+	unlink(out_path);
+	unlink(in_path);
+	return 0;
+}
+
+static int bench_many(int argc, char **argv)
+{
+	const char *dir = argc > 0 ? argv[0] : ".";
+	size_t count = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000;
+	size_t size = argc > 2 ? parse_size(argv[2]) : 16 << 10;
+	static const unsigned int depths[] = {4, 16, 64, 256};
+	struct copy_job *jobs = calloc(count, sizeof(*jobs));
+	char path[4096];
+
+	if (jobs == NULL)
+		errx(1, "calloc() failed");
+
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(path, sizeof(path), "%s/bench.in.%zu", dir, i);
+		jobs[i].in = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		snprintf(path, sizeof(path), "%s/bench.out.%zu", dir, i);
+		jobs[i].out = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (jobs[i].in < 0 || jobs[i].out < 0)
+			err(1, "open() failed");
+		make_input(jobs[i].in, size);
+	}
+
+	printf("%-14s %6s %12s\n", "engine", "depth", "files/s");
+
+	double start = now();
+	for (size_t i = 0; i < count; ++i)
+		if (copy(jobs[i].in, jobs[i].out) < 0)
+			errx(1, "copy() failed");
+	printf("%-14s %6s %12.0f\n", "copy", "-", count / (now() - start));
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+		struct copy_params params = {
+			.block_size = 256 << 10,
+			.depth = depths[d],
+			.flags = COPY_FIXED_BUFFERS,
+		};
+
+		for (size_t i = 0; i < count; ++i)
+			if (ftruncate(jobs[i].out, 0) < 0)
+				err(1, "ftruncate() failed");
+
+		start = now();
+		int r = copy_many(jobs, count, &params);
+		double elapsed = now() - start;
+
+		if (r < 0)
+			errx(1, "copy_many() failed: %s", strerror(-r));
+		printf("%-14s %6u %12.0f\n", "copy_many", depths[d], count / elapsed);
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		close(jobs[i].in);
+		close(jobs[i].out);
+		snprintf(path, sizeof(path), "%s/bench.in.%zu", dir, i);
+		unlink(path);
+		snprintf(path, sizeof(path), "%s/bench.out.%zu", dir, i);
+		unlink(path);
+	}
+	free(jobs);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "many") == 0)
+		return bench_many(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "engines") == 0)
+		return bench_engines(argc - 2, argv + 2);
+	if (argc > 1 && strcmp(argv[1], "uring") == 0)
+		return bench_uring(argc - 2, argv + 2);
+	return bench_uring(argc - 1, argv + 1);
+}
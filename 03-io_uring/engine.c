@@ -0,0 +1,137 @@
+#include <solution.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Bytes asked from copy_file_range() and splice() at a time. */
+#define ENGINE_CHUNK (1 << 30)
+#define ENGINE_PIPE_SIZE (1 << 20)
+
+/* Errors that mean an engine cannot handle these two files at all, as
+   opposed to an IO error. */
+static int unsupported(int err)
+{
+	return err == ENOSYS || err == EXDEV || err == EINVAL ||
+	       err == EOPNOTSUPP || err == EBADF;
+}
+
+static int copy_file_range_engine(int in, int out, off_t size, off_t *done)
+{
+	off_t off_in = 0, off_out = 0;
+
+	while (off_in < size) {
+		size_t len = size - off_in < ENGINE_CHUNK ? size - off_in : ENGINE_CHUNK;
+		ssize_t n = copy_file_range(in, &off_in, out, &off_out, len, 0);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			*done = off_out;
+			return -errno;
+		}
+		if (n == 0)
+			break;
+	}
+
+	*done = off_out;
+	return 0;
+}
+
+static int splice_engine(int in, int out, off_t size, off_t *done)
+{
+	off_t off_in = 0, off_out = 0;
+	int p[2], r = 0;
+
+	if (pipe2(p, O_CLOEXEC) < 0)
+		return -errno;
+	/* a bigger pipe means fewer round trips; the default is fine too */
+	fcntl(p[1], F_SETPIPE_SZ, ENGINE_PIPE_SIZE);
+
+	while (off_in < size) {
+		size_t len = size - off_in < ENGINE_CHUNK ? size - off_in : ENGINE_CHUNK;
+		ssize_t n = splice(in, &off_in, p[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			r = -errno;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		while (n > 0) {
+			ssize_t m = splice(p[0], NULL, out, &off_out, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0) {
+				r = m < 0 ? -errno : -EIO;
+				goto out;
+			}
+			n -= m;
+		}
+	}
+
+out:
+	close(p[0]);
+	close(p[1]);
+	*done = off_out;
+	return r;
+}
+
+enum copy_engine copy_engine_pick(int in, int out)
+{
+	struct stat a, b;
+
+	if (fstat(in, &a) < 0 || fstat(out, &b) < 0)
+		return COPY_ENGINE_IO_URING;
+	if (a.st_dev == b.st_dev)
+		return COPY_ENGINE_COPY_FILE_RANGE;
+	return COPY_ENGINE_SPLICE;
+}
+
+static int run_engine(enum copy_engine engine, int in, int out, off_t size, off_t *done)
+{
+	*done = 0;
+
+	switch (engine) {
+	case COPY_ENGINE_COPY_FILE_RANGE:
+		return copy_file_range_engine(in, out, size, done);
+	case COPY_ENGINE_SPLICE:
+		return splice_engine(in, out, size, done);
+	case COPY_ENGINE_IO_URING:
+		return copy(in, out);
+	default:
+		return -EINVAL;
+	}
+}
+
+int copy_with_engine(int in, int out, enum copy_engine engine, enum copy_engine *used)
+{
+	struct stat st;
+	off_t done;
+	int r;
+
+	if (fstat(in, &st) < 0)
+		return -errno;
+
+	if (engine != COPY_ENGINE_AUTO) {
+		if (used != NULL)
+			*used = engine;
+		return run_engine(engine, in, out, st.st_size, &done);
+	}
+
+	/* Move on to the next engine only if this one refused the files before
+	   copying anything; past that point an error is a real one. */
+	for (engine = copy_engine_pick(in, out);; ++engine) {
+		r = run_engine(engine, in, out, st.st_size, &done);
+		if (r == 0 || engine == COPY_ENGINE_IO_URING || done > 0 || !unsupported(-r))
+			break;
+	}
+
+	if (used != NULL)
+		*used = engine;
+	return r;
+}
@@ -0,0 +1,172 @@
+#include <solution.h>
+#include <slots.h>
+#include <fs_malloc.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#define MANY_BLOCK_SIZE (256 * 1024)
+#define MANY_DEPTH 64
+
+/* How far along a job is: blocks up to @next have been handed out. */
+struct progress
+{
+	off_t size;
+	off_t next;
+};
+
+/*
+ * Every slot of the ring is a block of some job. A block starts as a read
+ * linked to its write; if the link breaks (a short read, a retry), the rest
+ * of the block goes through unlinked requests.
+ */
+struct scheduler
+{
+	struct slot_ring ring;
+	struct copy_params params;
+
+	struct copy_job *jobs;
+	struct progress *progress;
+	size_t nr_jobs;
+	/* the first job that may still have blocks to hand out */
+	size_t cur;
+};
+
+/* Record the first error of the job of @b, and hand out no more of it. */
+static void fail(void *arg, struct slot *b, int err)
+{
+	struct scheduler *s = arg;
+	struct copy_job *job = &s->jobs[b->job];
+	struct progress *p = &s->progress[b->job];
+
+	if (job->result == 0)
+		job->result = err;
+	p->next = p->size;
+}
+
+static void truncated(void *arg, struct slot *b)
+{
+	struct scheduler *s = arg;
+	struct progress *p = &s->progress[b->job];
+
+	if (p->size > b->off + b->want)
+		p->size = b->off + b->want;
+}
+
+static const struct slot_ops scheduler_ops = {
+	.fail = fail,
+	.truncated = truncated,
+};
+
+/*
+ * Find the next block to copy, starting jobs as we get to them. Return
+ * false once every job has been handed out.
+ */
+static bool next_block(struct scheduler *s, struct slot *b)
+{
+	for (; s->cur < s->nr_jobs; s->cur++) {
+		struct copy_job *job = &s->jobs[s->cur];
+		struct progress *p = &s->progress[s->cur];
+
+		if (p->size < 0) {
+			struct stat st;
+			if (fstat(job->in, &st) < 0) {
+				job->result = -errno;
+				p->size = 0;
+				continue;
+			}
+			p->size = st.st_size;
+		}
+		if (p->next >= p->size)
+			continue;
+
+		b->job = s->cur;
+		b->in = job->in;
+		b->out = job->out;
+		b->off = p->next;
+		b->want = p->size - p->next < s->params.block_size ?
+			p->size - p->next : s->params.block_size;
+		b->len = b->want;
+		p->next += b->want;
+		return true;
+	}
+	return false;
+}
+
+/* Give idle blocks the next pieces of the jobs. */
+static void refill(struct scheduler *s)
+{
+	for (unsigned int i = 0; i < s->ring.nr_slots; ++i) {
+		if (s->ring.slots[i].state != SLOT_IDLE)
+			continue;
+		if (!next_block(s, &s->ring.slots[i]))
+			return;
+		slot_start(&s->ring, i);
+	}
+}
+
+/* The ring failed with @err: every job that is not finished fails with it. */
+static void abandon(struct scheduler *s, int err)
+{
+	for (unsigned int i = 0; i < s->ring.nr_slots; ++i)
+		if (s->ring.slots[i].state != SLOT_IDLE)
+			fail(s, &s->ring.slots[i], err);
+	for (size_t i = s->cur; i < s->nr_jobs; ++i) {
+		struct progress *p = &s->progress[i];
+		if (s->jobs[i].result == 0 && (p->size < 0 || p->next < p->size))
+			s->jobs[i].result = err;
+	}
+}
+
+int copy_many(struct copy_job *jobs, size_t nr_jobs, const struct copy_params *params)
+{
+	struct copy_params defaults = {
+		.block_size = MANY_BLOCK_SIZE,
+		.depth = MANY_DEPTH,
+		.flags = 0,
+	};
+	struct scheduler s = {
+		.params = params != NULL ? *params : defaults,
+		.jobs = jobs,
+		.nr_jobs = nr_jobs,
+	};
+	int r = 0;
+
+	if (s.params.block_size == 0 || s.params.depth == 0)
+		return -EINVAL;
+	if (s.params.flags & ~(COPY_FIXED_BUFFERS | COPY_LINK | COPY_SQPOLL))
+		return -EINVAL;
+	if (nr_jobs == 0)
+		return 0;
+
+	/* blocks are always linked */
+	r = slot_ring_init(&s.ring, s.params.depth, s.params.block_size,
+			   s.params.flags | COPY_LINK, &scheduler_ops, &s);
+	if (r < 0)
+		return r;
+
+	s.progress = fs_xmalloc(nr_jobs * sizeof(*s.progress));
+	for (size_t i = 0; i < nr_jobs; ++i) {
+		s.progress[i].size = -1;
+		s.progress[i].next = 0;
+		jobs[i].result = 0;
+	}
+
+	refill(&s);
+	while (s.ring.inflight > 0) {
+		if ((r = slot_ring_wait(&s.ring)) < 0) {
+			abandon(&s, r);
+			break;
+		}
+		refill(&s);
+	}
+
+	slot_ring_exit(&s.ring);
+	fs_xfree(s.progress);
+
+	r = 0;
+	for (size_t i = 0; i < nr_jobs && r == 0; ++i)
+		r = jobs[i].result;
+	return r;
+}
@@ -0,0 +1,326 @@
+#include <slots.h>
+#include <fs_malloc.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/* user_data of a request: the slot index, and whether it is a write */
+#define UDATA(slot, write) ((uint64_t)(slot) << 1 | (write))
+#define UDATA_SLOT(x) ((unsigned int)((x) >> 1))
+#define UDATA_WRITE(x) ((x) & 1)
+
+int slot_ring_init(struct slot_ring *r, unsigned int nr_slots, size_t block_size,
+		   unsigned int flags, const struct slot_ops *ops, void *arg)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->flags = flags;
+	r->nr_slots = nr_slots;
+	r->ops = ops;
+	r->arg = arg;
+
+	memset(&p, 0, sizeof(p));
+	if (flags & COPY_SQPOLL)
+		p.flags |= IORING_SETUP_SQPOLL;
+
+	if ((err = io_uring_queue_init_params(2 * nr_slots, &r->ring, &p)) < 0)
+		return err;
+
+	/* one aligned pool, cut into a buffer per slot */
+	if (posix_memalign((void **)&r->buffers, SLOT_DIRECT_ALIGN, nr_slots * block_size)) {
+		io_uring_queue_exit(&r->ring);
+		return -ENOMEM;
+	}
+
+	r->slots = fs_xzalloc(nr_slots * sizeof(*r->slots));
+	for (unsigned int i = 0; i < nr_slots; ++i)
+		r->slots[i].buf = r->buffers + i * block_size;
+
+	if (flags & COPY_FIXED_BUFFERS) {
+		struct iovec *iov = fs_xmalloc(nr_slots * sizeof(*iov));
+		for (unsigned int i = 0; i < nr_slots; ++i) {
+			iov[i].iov_base = r->slots[i].buf;
+			iov[i].iov_len = block_size;
+		}
+		err = io_uring_register_buffers(&r->ring, iov, nr_slots);
+		fs_xfree(iov);
+		if (err < 0) {
+			slot_ring_exit(r);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void slot_ring_exit(struct slot_ring *r)
+{
+	/* io_uring_queue_exit() does not wait for requests in flight, and
+	   those the kernel has not taken from the ring are dropped with it:
+	   with SQPOLL, the ones queued since the last submit, and otherwise
+	   all that are left in the submission queue */
+	unsigned int unsubmitted = r->flags & COPY_SQPOLL ?
+		r->queued : io_uring_sq_ready(&r->ring);
+	unsigned int pending = r->inflight - unsubmitted;
+	bool lost = false;
+
+	while (pending > 0) {
+		struct io_uring_cqe *cqe;
+		int err = io_uring_wait_cqe(&r->ring, &cqe);
+		if (err == -EINTR || err == -EAGAIN)
+			continue;
+		if (err < 0) {
+			lost = true;
+			break;
+		}
+		pending--;
+		io_uring_cqe_seen(&r->ring, cqe);
+	}
+
+	io_uring_queue_exit(&r->ring);
+	fs_xfree(r->slots);
+	/* the kernel may still write to buffers whose reads we lost track of:
+	   leaking them is better */
+	if (!lost)
+		free(r->buffers);
+}
+
+static struct io_uring_sqe* get_sqe(struct slot_ring *r)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+	if (sqe == NULL) {
+		/* cannot happen: the ring has room for two requests per slot */
+		abort();
+	}
+	return sqe;
+}
+
+static void prep_io(struct slot_ring *r, unsigned int i, bool write, unsigned int flags)
+{
+	struct slot *s = &r->slots[i];
+	struct io_uring_sqe *sqe;
+	char *buf = s->buf + s->done;
+	unsigned int len = s->len - s->done;
+	off_t off = s->off + s->done;
+	int fd = write ? s->out : s->in;
+
+	if (r->stopped) {
+		s->state = SLOT_IDLE;
+		return;
+	}
+
+	sqe = get_sqe(r);
+	if (r->flags & COPY_FIXED_BUFFERS) {
+		if (write)
+			io_uring_prep_write_fixed(sqe, fd, buf, len, off, i);
+		else
+			io_uring_prep_read_fixed(sqe, fd, buf, len, off, i);
+	} else {
+		if (write)
+			io_uring_prep_write(sqe, fd, buf, len, off);
+		else
+			io_uring_prep_read(sqe, fd, buf, len, off);
+	}
+
+	io_uring_sqe_set_flags(sqe, r->sqe_flags | flags);
+	io_uring_sqe_set_data64(sqe, UDATA(i, write));
+	s->inflight++;
+	r->inflight++;
+	r->queued++;
+}
+
+static void start_read(struct slot_ring *r, unsigned int i)
+{
+	r->slots[i].state = SLOT_READING;
+	r->nr_reading++;
+	prep_io(r, i, false, 0);
+}
+
+static void start_write(struct slot_ring *r, unsigned int i)
+{
+	struct slot *s = &r->slots[i];
+
+	if (s->len > s->want)
+		memset(s->buf + s->want, 0, s->len - s->want);
+
+	s->state = SLOT_WRITING;
+	s->done = 0;
+	prep_io(r, i, true, 0);
+}
+
+static void start_linked(struct slot_ring *r, unsigned int i)
+{
+	struct slot *s = &r->slots[i];
+
+	s->state = SLOT_LINKED;
+	s->read_res = s->write_res = 0;
+	prep_io(r, i, false, IOSQE_IO_LINK);
+	prep_io(r, i, true, 0);
+}
+
+void slot_start(struct slot_ring *r, unsigned int i)
+{
+	struct slot *s = &r->slots[i];
+
+	s->done = 0;
+	/* the last O_DIRECT read is short, which would break a link */
+	if ((r->flags & COPY_LINK) && s->want == s->len)
+		start_linked(r, i);
+	else
+		start_read(r, i);
+}
+
+static unsigned int align_up(unsigned int len)
+{
+	return (len + SLOT_DIRECT_ALIGN - 1) & ~(SLOT_DIRECT_ALIGN - 1);
+}
+
+static void fail(struct slot_ring *r, struct slot *s, int err)
+{
+	s->state = SLOT_IDLE;
+	r->ops->fail(r->arg, s, err);
+}
+
+/* A read of @s completed with @res, outside of a link. */
+static void read_done(struct slot_ring *r, unsigned int i, int res)
+{
+	struct slot *s = &r->slots[i];
+
+	r->nr_reading--;
+
+	if (res == -EAGAIN || res == -EINTR) {
+		start_read(r, i);
+		return;
+	}
+	if (res < 0) {
+		fail(r, s, res);
+		return;
+	}
+
+	if (res == 0) {
+		/* @in got shorter since we looked: nothing is left past here */
+		s->want = s->done;
+		s->len = r->flags & COPY_DIRECT ? align_up(s->want) : s->want;
+		r->ops->truncated(r->arg, s);
+	} else {
+		s->done += res;
+	}
+
+	if (s->done < s->want)
+		start_read(r, i);
+	else if (s->want > 0)
+		start_write(r, i);
+	else
+		s->state = SLOT_IDLE;
+}
+
+/* A write of @s completed with @res, outside of a link. */
+static void write_done(struct slot_ring *r, unsigned int i, int res)
+{
+	struct slot *s = &r->slots[i];
+
+	if (res == -EAGAIN || res == -EINTR) {
+		prep_io(r, i, true, 0);
+		return;
+	}
+	if (res < 0) {
+		fail(r, s, res);
+		return;
+	}
+	if (res == 0) {
+		fail(r, s, -EIO);
+		return;
+	}
+
+	s->done += res;
+	if (s->done < s->len)
+		prep_io(r, i, true, 0);
+	else
+		s->state = SLOT_IDLE;
+}
+
+/*
+ * Both halves of a linked block completed. A short read breaks the link, and
+ * the write comes back with -ECANCELED; in that case, and after a short
+ * write, finish the block with unlinked requests.
+ */
+static void linked_done(struct slot_ring *r, unsigned int i)
+{
+	struct slot *s = &r->slots[i];
+	int rd = s->read_res, w = s->write_res;
+
+	if (w == -ECANCELED && rd >= 0 && (unsigned int)rd < s->want) {
+		r->nr_reading++;
+		read_done(r, i, rd);
+		return;
+	}
+	if (rd < 0 && rd != -EAGAIN && rd != -EINTR) {
+		fail(r, s, rd);
+		return;
+	}
+	if (rd < 0 || w == -ECANCELED) {
+		s->done = 0;
+		start_read(r, i);
+		return;
+	}
+
+	s->state = SLOT_WRITING;
+	s->done = 0;
+	write_done(r, i, w);
+}
+
+static void complete(struct slot_ring *r, struct io_uring_cqe *cqe)
+{
+	uint64_t data = io_uring_cqe_get_data64(cqe);
+	unsigned int i = UDATA_SLOT(data);
+	struct slot *s = &r->slots[i];
+
+	s->inflight--;
+	r->inflight--;
+
+	if (s->state == SLOT_LINKED) {
+		if (UDATA_WRITE(data))
+			s->write_res = cqe->res;
+		else
+			s->read_res = cqe->res;
+		if (s->inflight == 0)
+			linked_done(r, i);
+	} else if (UDATA_WRITE(data)) {
+		write_done(r, i, cqe->res);
+	} else {
+		read_done(r, i, cqe->res);
+	}
+}
+
+int slot_ring_wait(struct slot_ring *r)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, n = 0;
+	int err;
+
+	/* With SQPOLL, submitting is only a store to the ring, and we enter
+	   the kernel just to sleep when nothing has completed. */
+	if (r->flags & COPY_SQPOLL) {
+		err = io_uring_submit(&r->ring);
+		if (err >= 0 && io_uring_cq_ready(&r->ring) == 0)
+			err = io_uring_wait_cqe(&r->ring, &cqe);
+	} else {
+		err = io_uring_submit_and_wait(&r->ring, 1);
+	}
+	r->queued = 0;
+	if (err < 0 && err != -EINTR && err != -EAGAIN) {
+		r->stopped = true;
+		return err;
+	}
+
+	io_uring_for_each_cqe(&r->ring, head, cqe) {
+		complete(r, cqe);
+		n++;
+	}
+	io_uring_cq_advance(&r->ring, n);
+	return 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <solution.h>
+
+#include <liburing.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+   The blocks in flight on a ring, as copy_ex() and copy_many() move them
+   from one file to another. Internal to this exercise.
+ */
+
+enum slot_state
+{
+	SLOT_IDLE,
+	SLOT_READING,
+	SLOT_WRITING,
+	SLOT_LINKED,
+};
+
+/*
+ * A buffer and the block it is moving. A block is read in full before it
+ * is written; short reads and writes are resumed from @done. A linked block
+ * has its read and its write in flight together, and is looked at once both
+ * have completed.
+ *
+ * @want is the number of bytes of @in in the block. It is less than @len
+ * only for the last block with O_DIRECT, where @len is rounded up to the
+ * alignment and the tail of the write is cut off by ftruncate() at the end.
+ */
+struct slot
+{
+	char *buf;
+	/* the files, or their indices among the registered files with
+	   IOSQE_FIXED_FILE in @sqe_flags of the ring */
+	int in;
+	int out;
+	/* what the owner of the ring knows the block by */
+	size_t job;
+	off_t off;
+	unsigned int want;
+	unsigned int len;
+	unsigned int done;
+	enum slot_state state;
+
+	unsigned int inflight;
+	int read_res;
+	int write_res;
+};
+
+/* What the owner of a ring hears of its blocks, with the @arg it gave. */
+struct slot_ops
+{
+	/* The block of @s failed with @err; @s is idle again. */
+	void (*fail)(void *arg, struct slot *s, int err);
+	/* The file @s reads from ended at s->off + s->want, earlier than
+	   it was when the block was handed out. */
+	void (*truncated)(void *arg, struct slot *s);
+};
+
+struct slot_ring
+{
+	struct io_uring ring;
+	/* COPY_FIXED_BUFFERS, COPY_LINK, COPY_SQPOLL and COPY_DIRECT are
+	   looked at */
+	unsigned int flags;
+	int sqe_flags;
+
+	struct slot *slots;
+	unsigned int nr_slots;
+	/* slots reading outside of a link */
+	unsigned int nr_reading;
+	/* requests started and not completed, and those of them started
+	   since the last submit */
+	unsigned int inflight;
+	unsigned int queued;
+	/* set once the owner or the ring failed: no request is started any
+	   more, and those in flight are only reaped */
+	bool stopped;
+	char *buffers;
+
+	const struct slot_ops *ops;
+	void *arg;
+};
+
+/* O_DIRECT wants buffers, offsets and lengths aligned to the logical block
+   size of the device; a page covers every device we care about. */
+#define SLOT_DIRECT_ALIGN 4096
+
+/* Set @r up with @nr_slots idle slots of @block_size bytes, and room in the
+   ring for two requests per slot. Return 0, or -errno with nothing left to
+   release. */
+int slot_ring_init(struct slot_ring *r, unsigned int nr_slots, size_t block_size,
+		   unsigned int flags, const struct slot_ops *ops, void *arg);
+
+/* Wait for every request in flight, so that nothing lands in the buffers
+   once they are freed, and release @r. Requests not submitted yet are
+   dropped. */
+void slot_ring_exit(struct slot_ring *r);
+
+/* Start moving the block set up in slot @i: with COPY_LINK as a read
+   linked to its write, and otherwise as a read. */
+void slot_start(struct slot_ring *r, unsigned int i);
+
+/* Submit what was started, wait for at least one completion, and move the
+   blocks that completed on. Return 0, or -errno if the ring failed, which
+   stops @r. */
+int slot_ring_wait(struct slot_ring *r);
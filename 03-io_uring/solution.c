@@ -1,10 +1,195 @@
 #include <solution.h>
+#include <slots.h>
 
-int copy(int in, int out)
+#include <liburing.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define COPY_BLOCK_SIZE (256 * 1024)
+#define COPY_DEPTH 4
+
+/* Indices of @in and @out among the registered files. */
+#define FIXED_IN 0
+#define FIXED_OUT 1
+
+struct copier
 {
-	(void) in;
-	(void) out;
+	struct slot_ring ring;
+	struct copy_params params;
+	int in;
+	int out;
+	bool direct;
+	int in_fl;
+	int out_fl;
+
+	off_t size;
+	off_t next;
+
+	int err;
+};
+
+static unsigned int align_up(unsigned int len)
+{
+	return (len + SLOT_DIRECT_ALIGN - 1) & ~(SLOT_DIRECT_ALIGN - 1);
+}
+
+/* Give idle slots the next blocks of @in, as long as the depth allows. */
+static void refill(struct copier *c)
+{
+	bool link = c->params.flags & COPY_LINK;
+	bool fixed = c->ring.sqe_flags & IOSQE_FIXED_FILE;
+
+	for (unsigned int i = 0; i < c->ring.nr_slots && !c->err; ++i) {
+		struct slot *s = &c->ring.slots[i];
+
+		if (c->next >= c->size)
+			return;
+		if (!link && c->ring.nr_reading >= c->params.depth)
+			return;
+		if (s->state != SLOT_IDLE)
+			continue;
+
+		s->in = fixed ? FIXED_IN : c->in;
+		s->out = fixed ? FIXED_OUT : c->out;
+		s->off = c->next;
+		s->want = c->size - c->next < c->params.block_size ?
+			c->size - c->next : c->params.block_size;
+		s->len = c->direct ? align_up(s->want) : s->want;
+		c->next += s->want;
+
+		slot_start(&c->ring, i);
+	}
+}
+
+static void set_error(void *arg, struct slot *s, int err)
+{
+	struct copier *c = arg;
+
+	(void) s;
+	if (!c->err)
+		c->err = err;
+	/* nothing more is written once the copy failed */
+	c->ring.stopped = true;
+}
+
+static void truncated(void *arg, struct slot *s)
+{
+	struct copier *c = arg;
+
+	if (c->size > s->off + s->want)
+		c->size = s->off + s->want;
+}
+
+static const struct slot_ops copier_ops = {
+	.fail = set_error,
+	.truncated = truncated,
+};
 
-	/* implement me */
+static int setup(struct copier *c)
+{
+	unsigned int nr_slots;
+	int r;
+
+	/* Unlinked, a block's buffer is busy with the write while the next
+	   reads go on, so there are twice as many buffers as reads. */
+	nr_slots = c->params.flags & COPY_LINK ? c->params.depth : 2 * c->params.depth;
+
+	r = slot_ring_init(&c->ring, nr_slots, c->params.block_size, c->params.flags,
+			   &copier_ops, c);
+	if (r < 0)
+		return r;
+
+	if (c->params.flags & COPY_FIXED_FILES) {
+		int fds[2] = {[FIXED_IN] = c->in, [FIXED_OUT] = c->out};
+		if ((r = io_uring_register_files(&c->ring.ring, fds, 2)) < 0) {
+			slot_ring_exit(&c->ring);
+			return r;
+		}
+		c->ring.sqe_flags |= IOSQE_FIXED_FILE;
+	}
+
+	return 0;
+}
+
+/* Switch @fd to O_DIRECT, and remember its flags in @fl to restore them. */
+static int set_direct(int fd, int *fl)
+{
+	if ((*fl = fcntl(fd, F_GETFL)) < 0)
+		return -errno;
+	if (fcntl(fd, F_SETFL, *fl | O_DIRECT) < 0)
+		return -errno;
 	return 0;
 }
+
+int copy_ex(int in, int out, const struct copy_params *params)
+{
+	struct copier c = {
+		.params = *params,
+		.in = in,
+		.out = out,
+	};
+	struct stat st;
+
+	if (params->block_size == 0 || params->depth == 0)
+		return -EINVAL;
+	if ((params->flags & COPY_DIRECT) && params->block_size % SLOT_DIRECT_ALIGN)
+		return -EINVAL;
+	if (fstat(in, &st) < 0)
+		return -errno;
+
+	c.size = st.st_size;
+	if (c.size == 0)
+		return 0;
+
+	if (params->flags & COPY_DIRECT) {
+		int r = set_direct(in, &c.in_fl);
+		if (r == 0 && (r = set_direct(out, &c.out_fl)) < 0)
+			fcntl(in, F_SETFL, c.in_fl);
+		if (r < 0)
+			return r;
+		c.direct = true;
+	}
+
+	int r = setup(&c);
+	if (r < 0) {
+		c.err = r;
+		goto out;
+	}
+
+	/* after an error, what is in flight is left to slot_ring_exit(),
+	   and what is only queued is never submitted */
+	refill(&c);
+	while (c.ring.inflight > 0 && !c.err) {
+		if ((r = slot_ring_wait(&c.ring)) < 0) {
+			if (!c.err)
+				c.err = r;
+			break;
+		}
+		refill(&c);
+	}
+
+	slot_ring_exit(&c.ring);
+
+	if (c.direct && !c.err && c.size % SLOT_DIRECT_ALIGN && ftruncate(out, c.size) < 0)
+		c.err = -errno;
+
+out:
+	if (c.direct) {
+		fcntl(in, F_SETFL, c.in_fl);
+		fcntl(out, F_SETFL, c.out_fl);
+	}
+	return c.err;
+}
+
+int copy(int in, int out)
+{
+	struct copy_params params = {
+		.block_size = COPY_BLOCK_SIZE,
+		.depth = COPY_DEPTH,
+		.flags = 0,
+	};
+	return copy_ex(in, out, &params);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 /**
    Implement this function to copy data from @in to @out with io_uring.
    File descriptors @in and @out are guaranteed to be regular files.
@@ -17,3 +19,105 @@
    Assume a recent kernel and use IORING_OP_READ and IORING_OP_WRITE.
 */
 int copy(int in, int out);
+
+/* Register the copy buffers with the ring, and use IORING_OP_READ_FIXED
+   and IORING_OP_WRITE_FIXED, so pages are not pinned for every request. */
+#define COPY_FIXED_BUFFERS 0x1
+/* Register @in and @out with the ring as fixed files. */
+#define COPY_FIXED_FILES 0x2
+/* Submit every read linked (IOSQE_IO_LINK) to the write of the same
+   block, so a block costs one submission instead of two. */
+#define COPY_LINK 0x4
+/* Set the ring up with IORING_SETUP_SQPOLL: a kernel thread picks up
+   requests, so submitting them takes no system call. */
+#define COPY_SQPOLL 0x8
+/* Read and write with O_DIRECT, bypassing the page cache. @block_size must
+   be a multiple of 4k. The last block is written in full and @out is then
+   truncated to the size of @in. */
+#define COPY_DIRECT 0x10
+
+/**
+   Parameters of copy_ex().
+
+   @block_size is the size of reads and writes, except maybe the last block,
+   @depth is the number of reads kept in flight as long as there is enough
+   data in @in (with COPY_LINK, the number of read-write pairs),
+   @flags is a combination of COPY_* flags.
+ */
+struct copy_params
+{
+	unsigned int block_size;
+	unsigned int depth;
+	unsigned int flags;
+};
+
+/**
+   A version of copy() with tunable IO patterns. copy(in, out) is
+   copy_ex(in, out, &(struct copy_params){256k, 4, 0}).
+
+   Return 0 if a copy was successful, -EINVAL if @params make no sense,
+   and -errno if an error occurred during a read or a write.
+*/
+int copy_ex(int in, int out, const struct copy_params *params);
+
+/**
+   Ways to move data from one file to another, from the cheapest one.
+
+   COPY_ENGINE_COPY_FILE_RANGE lets the kernel (or the file system, which
+   may share extents or copy on the server side) copy without the data
+   ever reaching user space,
+   COPY_ENGINE_SPLICE moves page cache pages of @in into a pipe, and from
+   the pipe into @out,
+   COPY_ENGINE_IO_URING is copy().
+ */
+enum copy_engine
+{
+	COPY_ENGINE_AUTO,
+	COPY_ENGINE_COPY_FILE_RANGE,
+	COPY_ENGINE_SPLICE,
+	COPY_ENGINE_IO_URING,
+};
+
+/* Return the engine COPY_ENGINE_AUTO tries first for @in and @out:
+   copy_file_range() if they are on the same file system, splice()
+   otherwise. */
+enum copy_engine copy_engine_pick(int in, int out);
+
+/**
+   Copy @in to @out like copy() does, with @engine. COPY_ENGINE_AUTO
+   starts from copy_engine_pick(), and falls back to the next engine
+   if the kernel or the file system does not support the previous one
+   for these files. If @used is not NULL, it receives the engine that
+   did the copy (or failed to).
+
+   Return 0 if a copy was successful, and -errno otherwise.
+*/
+int copy_with_engine(int in, int out, enum copy_engine engine, enum copy_engine *used);
+
+/**
+   A pair of files for copy_many(). @result receives 0 if @in was copied to
+   @out, and -errno otherwise.
+ */
+struct copy_job
+{
+	int in;
+	int out;
+	int result;
+};
+
+/**
+   Copy every @in of @jobs to its @out through a single ring, so the cost of
+   setting a ring and buffers up is paid once for the whole batch.
+
+   @params->depth is the number of blocks in flight at a time, across all
+   files; a file no bigger than @params->block_size takes one read and one
+   write, bigger files are cut into blocks. Files are started in order, and
+   the blocks of several files are in flight together. Every read is linked
+   to the write of the same block (COPY_LINK is implied); COPY_FIXED_BUFFERS
+   and COPY_SQPOLL are honored, other flags are not supported. If @params
+   is NULL, 256k blocks and a depth of 64 are used.
+
+   Return 0 if every copy was successful, -EINVAL if @params make no sense,
+   and otherwise the first error among @jobs (or of the ring itself).
+*/
+int copy_many(struct copy_job *jobs, size_t nr_jobs, const struct copy_params *params);
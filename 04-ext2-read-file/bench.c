@@ -0,0 +1,172 @@
+#include <solution.h>
+#include <fs_ext2.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+/*
+   use: ./bench.out [dir] [size...]
+
+   For each size (1G, 2G, 4G and 8G by default; K, M and G suffixes are
+   understood), builds an ext2 image with a single file of that size in
+   dir with mke2fs, and dumps the file with dump_file_ex(), synchronously
+   and then on an io_uring at several depths. The page cache of the image
+   is dropped before every run, so the numbers are those of a cold image.
+   The output goes to a file whose page cache is dropped as well: writing
+   to /dev/null would not even touch the pages of a mapped image.
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* User and system CPU time of the process so far, in seconds. */
+static double cpu_time(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		n <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+static void make_input(int fd, size_t size)
+{
+	size_t chunk = size < (1 << 20) ? size : (1 << 20);
+	char *buf = malloc(chunk);
+	if (buf == NULL)
+		errx(1, "malloc() failed");
+
+	for (size_t i = 0; i < chunk; ++i)
+		buf[i] = rand();
+	for (size_t off = 0; off < size; off += chunk) {
+		size_t n = size - off < chunk ? size - off : chunk;
+		if (pwrite(fd, buf, n, off) != (ssize_t)n)
+			err(1, "pwrite() failed");
+	}
+	free(buf);
+}
+
+/* Write back and evict the page cache of @fd. */
+static void drop_cache(int fd)
+{
+	if (fdatasync(fd) < 0)
+		err(1, "fdatasync() failed");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* Build an image at @img_path holding a file "data" of @size bytes, and
+   return the inode number of the file. */
+static int make_image(const char *dir, const char *img_path, size_t size)
+{
+	char src_dir[4096], src_path[4096], cmd[3 * 4096];
+	struct fs_ext2 fs;
+	struct ext2_inode inode;
+	uint32_t ino;
+	int fd, r;
+
+	snprintf(src_dir, sizeof(src_dir), "%s/bench.src", dir);
+	snprintf(src_path, sizeof(src_path), "%s/bench.src/data", dir);
+	if (mkdir(src_dir, S_IRWXU) < 0 && access(src_dir, F_OK) < 0)
+		err(1, "mkdir() failed");
+	if ((fd = open(src_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		err(1, "open() failed");
+	make_input(fd, size);
+	close(fd);
+
+	/* room for the block map and the rest of the metadata */
+	snprintf(cmd, sizeof(cmd), "mke2fs -q -F -t ext2 -b 4096 -d '%s' '%s' %zuk >/dev/null",
+		 src_dir, img_path, (size + size / 32 + (64 << 20)) >> 10);
+	r = system(cmd);
+	unlink(src_path);
+	rmdir(src_dir);
+	if (r != 0)
+		errx(1, "%s failed", cmd);
+
+	if ((fd = open(img_path, O_RDONLY)) < 0)
+		err(1, "open() failed");
+	if ((r = fs_ext2_open(&fs, fd, 0)) < 0 ||
+	    (r = fs_ext2_namei(&fs, "data", &ino, &inode)) < 0)
+		errx(1, "cannot find the file in the image: %s", strerror(-r));
+	fs_ext2_close(&fs);
+	close(fd);
+	return ino;
+}
+
+int main(int argc, char **argv)
+{
+	static char *default_sizes[] = {"1G", "2G", "4G", "8G"};
+	static const unsigned int depths[] = {0, 1, 4, 16, 64, 256};
+	const char *dir = argc > 1 ? argv[1] : ".";
+	char **sizes = argc > 2 ? argv + 2 : default_sizes;
+	int nr_sizes = argc > 2 ? argc - 2 : 4;
+	char img_path[4096], out_path[4096];
+
+	snprintf(img_path, sizeof(img_path), "%s/bench.img", dir);
+	snprintf(out_path, sizeof(out_path), "%s/bench.out.data", dir);
+
+	printf("%-10s %8s %6s %10s %10s\n", "engine", "size", "depth", "GB/s", "CPU s");
+	for (int i = 0; i < nr_sizes; ++i) {
+		size_t size = parse_size(sizes[i]);
+		int ino = make_image(dir, img_path, size);
+		int img = open(img_path, O_RDONLY);
+		if (img < 0)
+			err(1, "open() failed");
+
+		for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+			int out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+			if (out < 0)
+				err(1, "open() failed");
+			drop_cache(img);
+
+			double start = now(), cpu = cpu_time();
+			int r = dump_file_ex(img, ino, out, depths[d]);
+			if (r == 0 && fdatasync(out) < 0)
+				r = -errno;
+			double elapsed = now() - start;
+			cpu = cpu_time() - cpu;
+
+			if (r < 0)
+				printf("%-10s %8s %6u %10s (%s)\n", depths[d] ? "io_uring" : "sync",
+				       sizes[i], depths[d], "-", strerror(-r));
+			else
+				printf("%-10s %8s %6u %10.2f %10.3f\n", depths[d] ? "io_uring" : "sync",
+				       sizes[i], depths[d], size / elapsed / 1e9, cpu);
+			close(out);
+			unlink(out_path);
+		}
+
+		close(img);
+		unlink(img_path);
+	}
+
+	return 0;
+}
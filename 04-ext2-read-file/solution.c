@@ -1,11 +1,16 @@
 #include <solution.h>
+#include <fs_ext2.h>
+#include <fs_ext2_uring.h>
 
-int dump_file(int img, int inode_nr, int out)
+int dump_file_ex(int img, int inode_nr, int out, unsigned int depth)
 {
-	(void) img;
-	(void) inode_nr;
-	(void) out;
+	struct fs_ext2_sink sink;
+
+	fs_ext2_fd_sink(&sink, &out);
+	return fs_ext2_dump_image(img, inode_nr, &sink, depth);
+}
 
-	/* implement me */
-	return 0;
+int dump_file(int img, int inode_nr, int out)
+{
+	return dump_file_ex(img, inode_nr, out, FS_EXT2_URING_DEPTH);
 }
@@ -5,9 +5,20 @@
    to a file descriptor @out. @img is a file descriptor of an open
    ext2 image.
 
-   It suffices to support single- and double-indirect blocks.
+   Single-, double- and triple-indirect blocks are supported.
 
    If a copy was successful, return 0. If an error occurred during
    a read or a write, return -errno.
 */
 int dump_file(int img, int inode_nr, int out);
+
+/**
+   Like dump_file(), but keep up to @depth reads of data blocks in flight
+   on an io_uring, and read indirect blocks ahead of them. Data is written
+   to @out in order as it arrives. With @depth of 0, or if io_uring is not
+   available, the inode is copied synchronously, a run of contiguous blocks
+   at a time.
+
+   dump_file() is dump_file_ex() with a depth of 64.
+*/
+int dump_file_ex(int img, int inode_nr, int out, unsigned int depth);
@@ -1,10 +1,85 @@
 #include <solution.h>
+#include <fs_ext2.h>
+#include <fs_malloc.h>
 
-int dump_dir(int img, int inode_nr)
+#include <errno.h>
+#include <string.h>
+
+/* Blocks cached for a directory stream: it only ever holds one at a time. */
+#define EXT2_DIR_CACHE_BLOCKS 16
+
+struct ext2_dir
 {
-	(void) img;
-	(void) inode_nr;
+	struct fs_ext2 fs;
+	struct fs_ext2_dir cursor;
+};
+
+int ext2_dir_open(struct ext2_dir **d, int img, int inode_nr)
+{
+	struct ext2_dir *dir = fs_xzalloc(sizeof(*dir));
+	struct ext2_inode inode;
+	int r;
+
+	if ((r = fs_ext2_open(&dir->fs, img, EXT2_DIR_CACHE_BLOCKS)) < 0) {
+		fs_xfree(dir);
+		return r;
+	}
+
+	if ((r = fs_ext2_read_inode(&dir->fs, inode_nr, &inode)) < 0 ||
+	    (r = fs_ext2_dir_open(&dir->fs, &inode, &dir->cursor)) < 0) {
+		fs_ext2_close(&dir->fs);
+		fs_xfree(dir);
+		return r;
+	}
 
-	/* implement me */
+	*d = dir;
 	return 0;
 }
+
+int ext2_dir_next(struct ext2_dir *d, struct ext2_dirent *e)
+{
+	const struct ext2_dir_entry_2 *de;
+	uint64_t off;
+	int r;
+
+	if ((r = fs_ext2_dir_next(&d->cursor, &de, &off)) <= 0)
+		return r;
+
+	e->inode_nr = de->inode;
+	e->type = de->file_type == EXT2_FT_DIR ? 'd' : 'f';
+	e->cookie = fs_ext2_dir_tell(&d->cursor);
+	memcpy(e->name, de->name, de->name_len);
+	e->name[de->name_len] = '\0';
+	return 1;
+}
+
+void ext2_dir_seek(struct ext2_dir *d, uint64_t cookie)
+{
+	fs_ext2_dir_seek(&d->cursor, cookie);
+}
+
+void ext2_dir_close(struct ext2_dir *d)
+{
+	if (d == NULL)
+		return;
+
+	fs_ext2_dir_close(&d->cursor);
+	fs_ext2_close(&d->fs);
+	fs_xfree(d);
+}
+
+int dump_dir(int img, int inode_nr)
+{
+	struct ext2_dirent e;
+	struct ext2_dir *d;
+	int r;
+
+	if ((r = ext2_dir_open(&d, img, inode_nr)) < 0)
+		return r;
+
+	while ((r = ext2_dir_next(d, &e)) > 0)
+		report_file(e.inode_nr, e.type, e.name);
+
+	ext2_dir_close(d);
+	return r;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 /**
    Implement this function to parse the content of an inode @inode_nr
    as an ext2 directory. The function must call report_file() for each
@@ -20,3 +22,51 @@ int dump_dir(int img, int inode_nr);
    @name is the name (NULL-terminated) of the entry.
  */
 void report_file(int inode_nr, char type, const char *name);
+
+struct ext2_dir;
+
+/* An entry returned by ext2_dir_next(). */
+struct ext2_dirent
+{
+	int inode_nr;
+	/* 'f' or 'd', as for report_file() */
+	char type;
+	/* where to ext2_dir_seek() to resume after this entry; never 0 */
+	uint64_t cookie;
+	char name[256];
+};
+
+/**
+   Open a stream over the entries of directory @inode_nr of the image at
+   @img, which stays owned by the caller. The stream reads one block of
+   the directory at a time, when ext2_dir_next() gets to it, so memory use
+   does not depend on the size of the directory.
+
+   Return 0, -ENOTDIR if the inode is not a directory, or -errno.
+ */
+int ext2_dir_open(struct ext2_dir **d, int img, int inode_nr);
+
+/**
+   Return the next entry of @d in @e.
+
+   Return values:
+   * +1 if successful and @e was filled in,
+   * 0 if successful and the iteration is over,
+   * -EPROTO if the directory is corrupted, or another -errno.
+ */
+int ext2_dir_next(struct ext2_dir *d, struct ext2_dirent *e);
+
+/**
+   Make ext2_dir_next() resume after the entry @cookie came from, even from
+   another stream over the same directory; 0 starts over. Cookies are byte
+   offsets in the directory, so they stay valid as long as the image does
+   not change.
+ */
+void ext2_dir_seek(struct ext2_dir *d, uint64_t cookie);
+
+/**
+   Free the stream @d.
+
+   Note: ext2_dir_close(NULL) is a no-op.
+ */
+void ext2_dir_close(struct ext2_dir *d);
@@ -0,0 +1,126 @@
+#include <solution.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/stat.h>
+
+/*
+   use: ./bench.out [dir] [files] [size]
+
+   Builds an ext2 image in dir with mke2fs holding @files files (20000 by
+   default) of up to @size bytes (64K by default, K and M suffixes are
+   understood) spread over 100 directories, and extracts it with
+   dump_tree_ex() on 1, 2, 4, 8 and 16 workers. The page cache of the
+   image is dropped before every run, so the numbers are those of a cold
+   image.
+ */
+
+#define BENCH_DIRS 100
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'M': case 'm':
+		n <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+static void run(const char *cmd)
+{
+	if (system(cmd) != 0)
+		errx(1, "%s failed", cmd);
+}
+
+/* Fill @src_dir with @nr_files files of random sizes up to @max_size. */
+static size_t make_tree(const char *src_dir, size_t nr_files, size_t max_size)
+{
+	char path[4096 + 64];
+	char *buf = malloc(max_size + 1);
+	size_t total = 0;
+
+	if (buf == NULL)
+		errx(1, "malloc() failed");
+	for (size_t i = 0; i <= max_size; ++i)
+		buf[i] = rand();
+
+	if (mkdir(src_dir, S_IRWXU) < 0)
+		err(1, "mkdir() failed");
+	for (int d = 0; d < BENCH_DIRS; ++d) {
+		snprintf(path, sizeof(path), "%s/%d", src_dir, d);
+		if (mkdir(path, S_IRWXU) < 0)
+			err(1, "mkdir() failed");
+	}
+
+	for (size_t i = 0; i < nr_files; ++i) {
+		size_t size = rand() % (max_size + 1);
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/%zu/%zu", src_dir, i % BENCH_DIRS, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+			err(1, "open() failed");
+		if (write(fd, buf + i % 64, size) != (ssize_t)size)
+			err(1, "write() failed");
+		close(fd);
+		total += size;
+	}
+
+	free(buf);
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int workers[] = {1, 2, 4, 8, 16};
+	const char *dir = argc > 1 ? argv[1] : ".";
+	size_t nr_files = argc > 2 ? strtoull(argv[2], NULL, 10) : 20000;
+	size_t max_size = argc > 3 ? parse_size(argv[3]) : 64 << 10;
+	char src_dir[4096], img_path[4096], out_dir[4096], cmd[3 * 4096];
+
+	snprintf(src_dir, sizeof(src_dir), "%s/bench.src", dir);
+	snprintf(img_path, sizeof(img_path), "%s/bench.img", dir);
+	snprintf(out_dir, sizeof(out_dir), "%s/bench.out.tree", dir);
+
+	size_t total = make_tree(src_dir, nr_files, max_size);
+	/* room for a block per file of slack, the inodes and the rest of the metadata */
+	snprintf(cmd, sizeof(cmd), "mke2fs -q -F -t ext2 -b 4096 -N %zu -d '%s' '%s' %zuk >/dev/null",
+		 nr_files + 2 * BENCH_DIRS, src_dir, img_path,
+		 (total + nr_files * 4096 + total / 32 + (64 << 20)) >> 10);
+	run(cmd);
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", src_dir);
+	run(cmd);
+
+	int img = open(img_path, O_RDONLY);
+	if (img < 0)
+		err(1, "open() failed");
+
+	printf("%8s %10s %10s %10s\n", "workers", "files/s", "MB/s", "s");
+	for (size_t w = 0; w < sizeof(workers) / sizeof(workers[0]); ++w) {
+		struct dump_tree_stats stats;
+
+		posix_fadvise(img, 0, 0, POSIX_FADV_DONTNEED);
+		int r = dump_tree_ex(img, "/", out_dir, workers[w], &stats);
+		if (r < 0)
+			printf("%8u %10s (%s)\n", workers[w], "-", strerror(-r));
+		else
+			printf("%8u %10.0f %10.1f %10.3f\n", workers[w], stats.files / stats.seconds,
+			       stats.bytes / stats.seconds / 1e6, stats.seconds);
+
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", out_dir);
+		run(cmd);
+	}
+
+	close(img);
+	unlink(img_path);
+	return 0;
+}
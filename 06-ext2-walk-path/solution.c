@@ -1,11 +1,413 @@
 #include <solution.h>
+#include <fs_ext2.h>
+#include <fs_malloc.h>
+#include <fs_pool.h>
+#include <fs_string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Files handed to a dump_tree() worker at a time. */
+#define DUMP_TREE_BATCH 8
+
+/*
+   The dentry cache of the image dump_file() was last called on, kept from
+   one call to the next. An image is told apart from the previous one by
+   its inode, size and mtime. A call on another image while the cache is in
+   use goes without one rather than wait.
+ */
+static struct
+{
+	pthread_mutex_t lock;
+	struct fs_dcache *cache;
+	unsigned int users;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+} shared_dcache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct fs_dcache* dcache_get(int img)
+{
+	struct fs_dcache *c = NULL;
+	struct stat st;
+
+	if (fstat(img, &st) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&shared_dcache.lock);
+	if (shared_dcache.cache != NULL && shared_dcache.dev == st.st_dev &&
+	    shared_dcache.ino == st.st_ino && shared_dcache.size == st.st_size &&
+	    shared_dcache.mtime.tv_sec == st.st_mtim.tv_sec &&
+	    shared_dcache.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		c = shared_dcache.cache;
+	} else if (shared_dcache.users == 0) {
+		fs_dcache_free(shared_dcache.cache);
+		c = shared_dcache.cache = fs_dcache_alloc(0);
+		shared_dcache.dev = st.st_dev;
+		shared_dcache.ino = st.st_ino;
+		shared_dcache.size = st.st_size;
+		shared_dcache.mtime = st.st_mtim;
+	}
+	if (c != NULL)
+		shared_dcache.users++;
+	pthread_mutex_unlock(&shared_dcache.lock);
+	return c;
+}
+
+static void dcache_put(struct fs_dcache *c)
+{
+	if (c == NULL)
+		return;
+
+	pthread_mutex_lock(&shared_dcache.lock);
+	shared_dcache.users--;
+	pthread_mutex_unlock(&shared_dcache.lock);
+}
 
 int dump_file(int img, const char *path, int out)
 {
-	(void) img;
-	(void) path;
-	(void) out;
+	struct fs_ext2 fs;
+	struct ext2_inode inode;
+	char *buf = NULL;
+	uint32_t ino;
+	int r;
+
+	/* fall back to the cache if the image cannot be mapped (a pipe, say) */
+	if (fs_ext2_open_mmap(&fs, img) < 0 && (r = fs_ext2_open(&fs, img, 0)) < 0)
+		return r;
+	fs.dcache = dcache_get(img);
+
+	if ((r = fs_ext2_namei(&fs, path, &ino, &inode)) == 0) {
+		if ((inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+			r = -EISDIR;
+		else
+			r = fs_ext2_dump_fd(&fs, &inode, out, &buf);
+	}
+
+	fs_xfree(buf);
+	dcache_put(fs.dcache);
+	fs_ext2_close(&fs);
+	return r;
+}
+
+/* A regular file found by the walk, waiting for a worker to extract it. */
+struct tree_file
+{
+	struct ext2_inode inode;
+	/* the first block of data, by which files are read; 0 if none */
+	uint32_t first;
+	char *path;
+};
+
+/* A symlink found by the walk, made once every file is written. */
+struct tree_link
+{
+	struct ext2_inode inode;
+	char *path;
+};
+
+struct tree
+{
+	struct fs_ext2 *fs;
+	struct tree_file *files;
+	size_t nr_files;
+	size_t cap_files;
+	size_t nr_dirs;
+	struct tree_link *links;
+	size_t nr_links;
+	size_t cap_links;
+
+	/* per-worker fs_ext2_dump() buffers */
+	char **bufs;
+	_Atomic uint64_t bytes;
+	/* the first error a worker ran into */
+	_Atomic int err;
+};
+
+/* A directory of the walk, and where its entries go. */
+struct tree_dir
+{
+	uint32_t ino;
+	char *path;
+};
+
+struct walk_ctx
+{
+	struct tree *t;
+	const char *path;
+	struct tree_dir *dirs;
+	size_t nr_dirs;
+	size_t cap_dirs;
+};
+
+static void tree_fail(struct tree *t, int err)
+{
+	int expected = 0;
+	atomic_compare_exchange_strong(&t->err, &expected, err);
+}
+
+/* Queue a file for extraction to @path, which @t takes over either way. */
+static int add_file(struct tree *t, const struct ext2_inode *inode, char *path)
+{
+	struct tree_file *f;
+
+	if (t->nr_files == t->cap_files) {
+		t->cap_files = t->cap_files ? 2 * t->cap_files : 256;
+		t->files = fs_xrealloc(t->files, t->cap_files * sizeof(*t->files));
+	}
+
+	f = &t->files[t->nr_files++];
+	f->inode = *inode;
+	f->first = 0;
+	f->path = path;
+	if (ext2_inode_size(inode) == 0)
+		return 0;
+	return fs_ext2_bmap(t->fs, inode, 0, &f->first);
+}
+
+/* Queue a symlink to be made at @path, which @t takes over. */
+static void add_link(struct tree *t, const struct ext2_inode *inode, char *path)
+{
+	if (t->nr_links == t->cap_links) {
+		t->cap_links = t->cap_links ? 2 * t->cap_links : 16;
+		t->links = fs_xrealloc(t->links, t->cap_links * sizeof(*t->links));
+	}
+	t->links[t->nr_links++] = (struct tree_link){.inode = *inode, .path = path};
+}
+
+static int make_dir(const char *path, const struct ext2_inode *inode)
+{
+	struct stat st;
+
+	/* the owner needs rwx to fill the directory in */
+	if (mkdir(path, (inode->i_mode & 07777) | S_IRWXU) == 0)
+		return 0;
+	if (errno != EEXIST)
+		return -errno;
+	/* an old directory is reused, but nothing goes through a symlink */
+	if (lstat(path, &st) < 0)
+		return -errno;
+	return S_ISDIR(st.st_mode) ? 0 : -EEXIST;
+}
+
+static int make_symlink(struct fs_ext2 *fs, const struct ext2_inode *inode, const char *path)
+{
+	uint64_t len = ext2_inode_size(inode);
+	char *target;
+	ssize_t r;
+
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	target = fs_xmalloc(len + 1);
+	if ((r = fs_ext2_readlink(fs, inode, target, len)) >= 0) {
+		target[r] = '\0';
+		r = 0;
+		if (symlink(target, path) < 0 &&
+		    (errno != EEXIST || unlink(path) < 0 || symlink(target, path) < 0))
+			r = -errno;
+	}
+
+	fs_xfree(target);
+	return r;
+}
+
+static int walk_entry(void *arg, const struct ext2_dir_entry_2 *de, uint64_t off)
+{
+	struct walk_ctx *ctx = arg;
+	struct ext2_inode inode;
+	char *path;
+	int r;
+	(void) off;
+
+	if ((de->name_len == 1 && de->name[0] == '.') ||
+	    (de->name_len == 2 && de->name[0] == '.' && de->name[1] == '.'))
+		return 0;
+	/* a name is one component of the path, and all of it */
+	if (de->name_len == 0 || memchr(de->name, '/', de->name_len) ||
+	    memchr(de->name, '\0', de->name_len))
+		return -EPROTO;
+
+	if ((r = fs_ext2_read_inode(ctx->t->fs, de->inode, &inode)) < 0)
+		return r;
+	path = fs_xasprintf("%s/%.*s", ctx->path, (int)de->name_len, de->name);
+
+	switch (inode.i_mode & EXT2_S_IFMT) {
+	case EXT2_S_IFREG:
+		return add_file(ctx->t, &inode, path);
+	case EXT2_S_IFDIR:
+		if ((r = make_dir(path, &inode)) < 0)
+			break;
+		if (ctx->nr_dirs == ctx->cap_dirs) {
+			ctx->cap_dirs = ctx->cap_dirs ? 2 * ctx->cap_dirs : 16;
+			ctx->dirs = fs_xrealloc(ctx->dirs, ctx->cap_dirs * sizeof(*ctx->dirs));
+		}
+		ctx->dirs[ctx->nr_dirs++] = (struct tree_dir){.ino = de->inode, .path = path};
+		ctx->t->nr_dirs++;
+		return 0;
+	case EXT2_S_IFLNK:
+		add_link(ctx->t, &inode, path);
+		return 0;
+	default:
+		/* devices, pipes and sockets are left out */
+		break;
+	}
+
+	fs_xfree(path);
+	return r;
+}
+
+/*
+   Create the directories under directory @ino in @path, and collect its
+   regular files and symlinks into @t. The walk is depth-first with a stack
+   of directories still to be listed, so that no block of a directory
+   stays pinned while its subdirectories are.
+ */
+static int walk(struct tree *t, uint32_t ino, char *path)
+{
+	struct walk_ctx ctx = {.t = t};
+	struct ext2_inode inode;
+	int r = 0;
+
+	ctx.dirs = fs_xmalloc(sizeof(*ctx.dirs));
+	ctx.cap_dirs = 1;
+	ctx.dirs[ctx.nr_dirs++] = (struct tree_dir){.ino = ino, .path = path};
+
+	while (ctx.nr_dirs > 0) {
+		struct tree_dir d = ctx.dirs[--ctx.nr_dirs];
+
+		if (r == 0 && (r = fs_ext2_read_inode(t->fs, d.ino, &inode)) == 0) {
+			ctx.path = d.path;
+			r = fs_ext2_dir_iterate(t->fs, &inode, walk_entry, &ctx);
+		}
+		fs_xfree(d.path);
+	}
+
+	fs_xfree(ctx.dirs);
+	return r;
+}
+
+static void extract_file(void *arg, unsigned int worker, size_t idx)
+{
+	struct tree *t = arg;
+	struct tree_file *f = &t->files[idx];
+	int out, r;
+
+	if (atomic_load_explicit(&t->err, memory_order_relaxed) != 0)
+		return;
+
+	out = open(f->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		   f->inode.i_mode & 07777);
+	if (out < 0) {
+		tree_fail(t, -errno);
+		return;
+	}
+
+	if ((r = fs_ext2_dump_fd(t->fs, &f->inode, out, &t->bufs[worker])) < 0)
+		tree_fail(t, r);
+	else
+		atomic_fetch_add_explicit(&t->bytes, ext2_inode_size(&f->inode),
+					  memory_order_relaxed);
+	close(out);
+}
+
+static int cmp_first(const void *a, const void *b)
+{
+	uint32_t x = ((const struct tree_file *)a)->first;
+	uint32_t y = ((const struct tree_file *)b)->first;
+	return (x > y) - (x < y);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int dump_tree_ex(int img, const char *src_path, const char *out_dir,
+		 unsigned int nr_workers, struct dump_tree_stats *stats)
+{
+	struct fs_ext2 fs;
+	struct tree t = {.fs = &fs};
+	struct ext2_inode inode;
+	double start = now();
+	uint32_t ino;
+	int r;
 
-	/* implement me */
-	return 0;
+	if (nr_workers == 0)
+		nr_workers = fs_pool_default_workers();
+
+	if (fs_ext2_open_mmap(&fs, img) < 0 && (r = fs_ext2_open(&fs, img, 0)) < 0)
+		return r;
+	fs.dcache = dcache_get(img);
+
+	if ((r = fs_ext2_namei(&fs, src_path, &ino, &inode)) < 0)
+		goto out;
+	if (mkdir(out_dir, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST) {
+		r = -errno;
+		goto out;
+	}
+
+	switch (inode.i_mode & EXT2_S_IFMT) {
+	case EXT2_S_IFDIR:
+		r = walk(&t, ino, fs_xstrdup(out_dir));
+		break;
+	case EXT2_S_IFREG: {
+		/* a single file goes into @out_dir under its own name */
+		const char *name = strrchr(src_path, '/');
+		r = add_file(&t, &inode, fs_xasprintf("%s/%s", out_dir, name ? name + 1 : src_path));
+		break;
+	}
+	default:
+		r = -EINVAL;
+		break;
+	}
+
+	if (r == 0 && t.nr_files > 0) {
+		/* read the files in the order their data lies on disk */
+		qsort(t.files, t.nr_files, sizeof(*t.files), cmp_first);
+		t.bufs = fs_xzalloc(nr_workers * sizeof(*t.bufs));
+		fs_pool_run(nr_workers, t.nr_files, DUMP_TREE_BATCH, extract_file, &t);
+		r = atomic_load(&t.err);
+
+		for (unsigned int i = 0; i < nr_workers; ++i)
+			fs_xfree(t.bufs[i]);
+		fs_xfree(t.bufs);
+	}
+
+	for (size_t i = 0; i < t.nr_links && r == 0; ++i)
+		r = make_symlink(&fs, &t.links[i].inode, t.links[i].path);
+
+	if (stats != NULL) {
+		stats->files = t.nr_files;
+		stats->dirs = t.nr_dirs;
+		stats->bytes = atomic_load(&t.bytes);
+		stats->seconds = now() - start;
+	}
+
+out:
+	for (size_t i = 0; i < t.nr_files; ++i)
+		fs_xfree(t.files[i].path);
+	fs_xfree(t.files);
+	for (size_t i = 0; i < t.nr_links; ++i)
+		fs_xfree(t.links[i].path);
+	fs_xfree(t.links);
+	dcache_put(fs.dcache);
+	fs_ext2_close(&fs);
+	return r;
+}
+
+int dump_tree(int img, const char *src_path, const char *out_dir)
+{
+	return dump_tree_ex(img, src_path, out_dir, 0, NULL);
 }
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
    Implement this function to copy the content of a file at @path
    to a file descriptor @out. @path has no symlinks inside it.
    @img is a file descriptor of an open ext2 image.
 
-   It suffices to support single- and double-indirect blocks.
+   Single-, double- and triple-indirect blocks are supported. Directories
+   on the way are indexed and kept from one call to the next, as long as
+   @img is the same image.
 
    If a copy was successful, return 0. If an error occurred during
    a read or a write, return -errno.
@@ -14,3 +19,37 @@
    may happen during a path traversal.
 */
 int dump_file(int img, const char *path, int out);
+
+/* What dump_tree_ex() extracted, and how long it took. */
+struct dump_tree_stats
+{
+	size_t files;
+	size_t dirs;
+	uint64_t bytes;
+	double seconds;
+};
+
+/**
+   Extract @src_path of the image, a directory with everything under it or
+   a single file, into directory @out_dir, which is created if it does not
+   exist. Directories are made while the tree is walked; the contents of
+   regular files are then written by @nr_workers threads (0 means one per
+   CPU), in the order of their first block on disk, so that the image is
+   read mostly sequentially. Symlinks are made last, so that nothing is
+   written through one the image holds. Devices, pipes and sockets are
+   skipped.
+
+   Nothing is written outside of @out_dir: a name that holds '/' or NUL
+   fails the walk with -EPROTO, and a symlink, whether already in @out_dir
+   or from the image, is never followed to make a directory or a file; the
+   path fails instead (-EEXIST, -ELOOP, -EISDIR).
+
+   Return 0, or the first -errno of the walk or of a worker; a failed file
+   stops the extraction of the files not started yet. If @stats is not
+   NULL, it is filled in either way.
+*/
+int dump_tree_ex(int img, const char *src_path, const char *out_dir,
+		 unsigned int nr_workers, struct dump_tree_stats *stats);
+
+/* dump_tree_ex() with a worker per CPU. */
+int dump_tree(int img, const char *src_path, const char *out_dir);
@@ -1,11 +1,163 @@
 #include <solution.h>
+#include <fs_ext2.h>
+#include <fs_ext2_uring.h>
 
-int dump_file(int img, int inode_nr, int out)
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Where the file goes. In sparse mode, holes are not written but added up
+ * in @hole, and skipped over once data follows them, or at the end.
+ */
+struct output
+{
+	int fd;
+	bool sparse;
+	/* the position in @fd, and its size when the dump started */
+	off_t pos;
+	off_t end;
+	uint64_t hole;
+	struct dump_stats stats;
+};
+
+static int output_init(struct output *o, int fd, bool sparse)
+{
+	struct stat st;
+
+	memset(o, 0, sizeof(*o));
+	o->fd = fd;
+	if (!sparse)
+		return 0;
+
+	/* pipes and sockets get zeroes */
+	if ((o->pos = lseek(fd, 0, SEEK_CUR)) < 0 || fstat(fd, &st) < 0) {
+		if (errno != ESPIPE)
+			return -errno;
+		return 0;
+	}
+	o->sparse = S_ISREG(st.st_mode);
+	o->end = st.st_size;
+	return 0;
+}
+
+/*
+   Move past the pending hole. The part of it over data that @fd already
+   had is punched out, or, where punching holes is not supported, zeroed.
+ */
+static int skip_hole(struct output *o)
+{
+	off_t to = o->pos + o->hole;
+	int r;
+
+	if (o->pos < o->end) {
+		off_t len = (to < o->end ? to : o->end) - o->pos;
+
+		if (fallocate(o->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, o->pos, len) < 0) {
+			if (errno != EOPNOTSUPP && errno != ENOSYS)
+				return -errno;
+			if (lseek(o->fd, o->pos, SEEK_SET) < 0)
+				return -errno;
+			if ((r = fs_ext2_write_zeroes(o->fd, len)) < 0)
+				return r;
+			o->stats.written += len;
+		}
+	}
+
+	if (lseek(o->fd, to, SEEK_SET) < 0)
+		return -errno;
+	o->pos = to;
+	o->hole = 0;
+	return 0;
+}
+
+static int output_data(struct output *o, const void *buf, size_t len)
 {
-	(void) img;
-	(void) inode_nr;
-	(void) out;
+	int r;
 
-	/* implement me */
+	if (o->hole > 0 && (r = skip_hole(o)) < 0)
+		return r;
+	if ((r = fs_ext2_write_all(o->fd, buf, len)) < 0)
+		return r;
+	o->pos += len;
+	o->stats.size += len;
+	o->stats.written += len;
 	return 0;
 }
+
+static int output_hole(struct output *o, uint64_t len)
+{
+	o->stats.size += len;
+	if (o->sparse) {
+		o->hole += len;
+		return 0;
+	}
+	o->stats.written += len;
+	return fs_ext2_write_zeroes(o->fd, len);
+}
+
+/* Skip the trailing hole, if any, and make the file as long as it goes. */
+static int output_finish(struct output *o)
+{
+	int r;
+
+	if (o->hole == 0)
+		return 0;
+	if ((r = skip_hole(o)) < 0)
+		return r;
+	if (o->pos > o->end && ftruncate(o->fd, o->pos) < 0)
+		return -errno;
+	return 0;
+}
+
+static int sink_data(void *arg, const void *buf, size_t len)
+{
+	return output_data(arg, buf, len);
+}
+
+static int sink_hole(void *arg, uint64_t len)
+{
+	return output_hole(arg, len);
+}
+
+static int dump(int img, int inode_nr, int out, unsigned int depth, bool sparse,
+		struct dump_stats *stats)
+{
+	struct output o;
+	struct fs_ext2_sink sink = {
+		.data = sink_data,
+		.hole = sink_hole,
+		.arg = &o,
+	};
+	int r;
+
+	if ((r = output_init(&o, out, sparse)) < 0)
+		return r;
+
+	r = fs_ext2_dump_image(img, inode_nr, &sink, depth);
+	if (r == 0)
+		r = output_finish(&o);
+
+	if (stats != NULL)
+		*stats = o.stats;
+	return r;
+}
+
+int dump_file_ex(int img, int inode_nr, int out, unsigned int depth)
+{
+	return dump(img, inode_nr, out, depth, false, NULL);
+}
+
+int dump_file_sparse(int img, int inode_nr, int out, unsigned int depth,
+		     struct dump_stats *stats)
+{
+	return dump(img, inode_nr, out, depth, true, stats);
+}
+
+int dump_file(int img, int inode_nr, int out)
+{
+	return dump_file_ex(img, inode_nr, out, FS_EXT2_URING_DEPTH);
+}
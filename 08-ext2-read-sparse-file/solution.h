@@ -1,13 +1,49 @@
 #pragma once
 
+#include <stdint.h>
+
 /**
    Implement this function to copy the content of an inode @inode_nr
    to a file descriptor @out. A file at @inode_nr may be a sparse file.
    @img is a file descriptor of an open ext2 image.
 
-   It suffices to support single- and double-indirect blocks.
+   Single-, double- and triple-indirect blocks are supported.
 
    If a copy was successful, return 0. If an error occurred during
    a read or a write, return -errno.
 */
 int dump_file(int img, int inode_nr, int out);
+
+/**
+   Like dump_file(), but keep up to @depth reads of data blocks in flight
+   on an io_uring, and read indirect blocks ahead of them. Data is written
+   to @out in order as it arrives. With @depth of 0, or if io_uring is not
+   available, the inode is copied synchronously, a run of contiguous blocks
+   at a time.
+
+   dump_file() is dump_file_ex() with a depth of 64.
+*/
+int dump_file_ex(int img, int inode_nr, int out, unsigned int depth);
+
+struct dump_stats
+{
+	/* the logical size of the inode */
+	uint64_t size;
+	/* the bytes written to the output, holes excluded in sparse mode */
+	uint64_t written;
+};
+
+/**
+   Like dump_file_ex(), but leave the holes of the inode (zero block
+   numbers at any level of the block map, missing indirect blocks
+   included) out of @out: they are skipped with lseek(), ranges of @out
+   that already hold data are deallocated with
+   fallocate(FALLOC_FL_PUNCH_HOLE), and a trailing hole is made with
+   ftruncate(). Only allocated blocks get written. If @out is not a
+   regular file, holes are written as zeroes.
+
+   If @stats is not NULL, it gets the logical size of the inode and the
+   number of bytes actually written.
+*/
+int dump_file_sparse(int img, int inode_nr, int out, unsigned int depth,
+		     struct dump_stats *stats);
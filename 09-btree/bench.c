@@ -0,0 +1,486 @@
+#include <solution.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+   use: ./bench.out lookups [max keys] [L...]
+        ./bench.out churn [keys] [L...]
+        ./bench.out load [keys] [L...]
+        ./bench.out threads [keys] [seconds]
+        ./bench.out ranges [keys] [L...]
+
+   "lookups" grows a tree for each L (4, 8, 16, 64 and 256 by default) by
+   random inserts up to max keys (1e8 by default), and at every power of
+   ten from 1e3 on, times random lookups, half of them of keys in the tree,
+   with each search the CPU supports.
+
+   "churn" fills a tree for each L with keys random inserts (1e7 by
+   default), then replaces all of them, inserting a new key and deleting
+   the oldest one in turn, with nodes from malloc(), from slabs, and from
+   slabs of huge pages. It reports inserts/s while filling, operations/s
+   while churning, the growth of the resident set, and how long
+   btree_free() takes. Every run is in a process of its own, so that it
+   does not reuse the heap freed by the one before.
+
+   "load" builds a tree of keys (1e7 by default) for each L, by random
+   inserts, by btree_bulk_load() of the sorted keys, and by one
+   btree_insert_batch() of them in random order. It then times inserts and
+   deletes of 1% of the keys, one at a time and in a batch, and a batch
+   insert of 25% more, with the nodes of the bulk load 100% and 70% full.
+
+   "threads" fills a cbtree with keys (1e6 by default), and runs 1 to 64
+   threads on it for seconds (1 by default) at each count, with 0%, 10% and
+   50% of the operations inserts and deletes, the rest lookups. It does the
+   same with a btree behind a reader-writer lock, and reports Mops/s for
+   both.
+
+   "ranges" builds a tree of keys (1e7 by default) for each L, and times
+   btree_count_range() and a walk with btree_iter_range() over random
+   ranges that hold 1, 100 and 10000 keys on average.
+ */
+
+#define NR_LOOKUPS (1 << 22)
+
+static const char *search_names[] = {"auto", "scalar", "sse4", "avx2"};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A bijection on 32 bits: the keys in the tree are key(0) ... key(n - 1). */
+static int key(uint32_t i)
+{
+	i ^= i >> 16;
+	i *= 0x7feb352d;
+	i ^= i >> 15;
+	i *= 0x846ca68b;
+	i ^= i >> 16;
+	return (int)i;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* The resident set of the process, in bytes. */
+static size_t rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL || fscanf(f, "%lu %lu", &size, &resident) != 2)
+		errx(1, "cannot read /proc/self/statm");
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void bench_lookups(struct btree *t, unsigned int L, size_t n, int *lookups)
+{
+	uint64_t seed = 42;
+
+	for (size_t i = 0; i < NR_LOOKUPS; ++i) {
+		uint32_t j = next_rand(&seed) % n;
+		lookups[i] = key(i % 2 ? j : n + j);
+	}
+
+	for (int s = BTREE_SEARCH_SCALAR; s <= BTREE_SEARCH_AVX2; ++s) {
+		size_t hits = 0;
+
+		if (btree_set_search(t, s) < 0)
+			continue;
+
+		double start = now();
+		for (size_t i = 0; i < NR_LOOKUPS; ++i)
+			hits += btree_contains(t, lookups[i]);
+		double elapsed = now() - start;
+
+		if (hits != NR_LOOKUPS / 2)
+			errx(1, "%zu lookups out of %d found keys", hits, NR_LOOKUPS / 2);
+		printf("%6u %12zu %8s %12.2f\n", L, n, search_names[s], NR_LOOKUPS / elapsed / 1e6);
+	}
+	btree_set_search(t, BTREE_SEARCH_AUTO);
+}
+
+static void lookups(int argc, char **argv)
+{
+	static const unsigned int default_Ls[] = {4, 8, 16, 64, 256};
+	size_t max_keys = argc > 0 ? strtod(argv[0], NULL) : 1e8;
+	int nr_Ls = argc > 1 ? argc - 1 : 5;
+	int *lookups = malloc(NR_LOOKUPS * sizeof(*lookups));
+
+	if (lookups == NULL)
+		errx(1, "malloc() failed");
+	/* half of the lookups are of keys from n to 2n */
+	if (max_keys > UINT32_MAX / 2)
+		errx(1, "too many keys");
+
+	printf("%6s %12s %8s %12s\n", "L", "keys", "search", "Mlookups/s");
+	for (int l = 0; l < nr_Ls; ++l) {
+		unsigned int L = argc > 1 ? strtoul(argv[l + 1], NULL, 0) : default_Ls[l];
+		struct btree *t = btree_alloc(L);
+		size_t n = 0;
+
+		if (t == NULL)
+			errx(1, "btree_alloc(%u) failed", L);
+		for (size_t target = 1000; target <= max_keys; target *= 10) {
+			for (; n < target; ++n)
+				btree_insert(t, key(n));
+			bench_lookups(t, L, n, lookups);
+		}
+		btree_free(t);
+	}
+
+	free(lookups);
+}
+
+static void churn(int argc, char **argv)
+{
+	static const unsigned int default_Ls[] = {4, 8, 16, 64, 256};
+	static const struct
+	{
+		const char *name;
+		unsigned int flags;
+	} allocators[] = {
+		{"malloc", BTREE_MALLOC},
+		{"slab", 0},
+		{"huge", BTREE_HUGE_PAGES},
+	};
+	size_t n = argc > 0 ? strtod(argv[0], NULL) : 1e7;
+	int nr_Ls = argc > 1 ? argc - 1 : 5;
+
+	if (n > UINT32_MAX / 2)
+		errx(1, "too many keys");
+
+	printf("%6s %12s %8s %12s %12s %10s %10s\n", "L", "keys", "nodes", "Minserts/s",
+	       "Mops/s", "RSS MB", "free ms");
+	for (int l = 0; l < nr_Ls; ++l) {
+		unsigned int L = argc > 1 ? strtoul(argv[l + 1], NULL, 0) : default_Ls[l];
+
+		for (size_t a = 0; a < sizeof(allocators) / sizeof(allocators[0]); ++a) {
+			pid_t pid;
+
+			fflush(stdout);
+			if ((pid = fork()) < 0)
+				err(1, "fork() failed");
+			if (pid > 0) {
+				waitpid(pid, NULL, 0);
+				continue;
+			}
+
+			size_t base = rss();
+			struct btree *t = btree_alloc_ex(L, allocators[a].flags);
+			if (t == NULL)
+				errx(1, "btree_alloc_ex(%u) failed", L);
+
+			double start = now();
+			for (size_t i = 0; i < n; ++i)
+				btree_insert(t, key(i));
+			double fill = now() - start;
+
+			start = now();
+			for (size_t i = 0; i < n; ++i) {
+				btree_insert(t, key(n + i));
+				btree_delete(t, key(i));
+			}
+			double mixed = now() - start;
+			size_t grown = rss() - base;
+
+			start = now();
+			btree_free(t);
+			double release = now() - start;
+
+			printf("%6u %12zu %8s %12.2f %12.2f %10.1f %10.1f\n", L, n, allocators[a].name,
+			       n / fill / 1e6, 2 * n / mixed / 1e6, grown / 1e6, release * 1e3);
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+static void report(unsigned int L, unsigned int fill, const char *op, size_t n, double start)
+{
+	printf("%6u %6u %12s %12.2f\n", L, fill, op, n / (now() - start) / 1e6);
+}
+
+static void load(int argc, char **argv)
+{
+	static const unsigned int default_Ls[] = {4, 8, 16, 64, 256};
+	static const unsigned int fills[] = {100, 70};
+	size_t n = argc > 0 ? strtod(argv[0], NULL) : 1e7;
+	int nr_Ls = argc > 1 ? argc - 1 : 5;
+	size_t extra = n / 4;
+	int *keys = malloc((n + extra) * sizeof(*keys));
+	int *sorted = malloc(n * sizeof(*sorted));
+
+	if (keys == NULL || sorted == NULL)
+		errx(1, "malloc() failed");
+	if (n + extra > UINT32_MAX)
+		errx(1, "too many keys");
+	for (size_t i = 0; i < n + extra; ++i)
+		keys[i] = key(i);
+	memcpy(sorted, keys, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), compare_ints);
+
+	printf("%6s %6s %12s %12s\n", "L", "fill", "op", "Mkeys/s");
+	for (int l = 0; l < nr_Ls; ++l) {
+		unsigned int L = argc > 1 ? strtoul(argv[l + 1], NULL, 0) : default_Ls[l];
+
+		for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); ++f) {
+			struct btree *t = btree_alloc(L);
+			size_t pct = n / 100;
+			double start;
+
+			if (t == NULL)
+				errx(1, "btree_alloc(%u) failed", L);
+			btree_set_fill(t, fills[f]);
+
+			start = now();
+			for (size_t i = 0; i < n; ++i)
+				btree_insert(t, keys[i]);
+			report(L, fills[f], "insert", n, start);
+
+			btree_bulk_load(t, NULL, 0);
+			start = now();
+			btree_insert_batch(t, keys, n);
+			report(L, fills[f], "batch", n, start);
+
+			start = now();
+			btree_bulk_load(t, sorted, n);
+			report(L, fills[f], "bulk load", n, start);
+
+			start = now();
+			for (size_t i = 0; i < pct; ++i)
+				btree_insert(t, keys[n + i]);
+			report(L, fills[f], "insert 1%", pct, start);
+
+			start = now();
+			btree_insert_batch(t, keys + n + pct, pct);
+			report(L, fills[f], "batch +1%", pct, start);
+
+			start = now();
+			for (size_t i = 0; i < pct; ++i)
+				btree_delete(t, keys[i]);
+			report(L, fills[f], "delete 1%", pct, start);
+
+			start = now();
+			btree_delete_batch(t, keys + pct, pct);
+			report(L, fills[f], "batch -1%", pct, start);
+
+			start = now();
+			btree_insert_batch(t, keys + n, extra);
+			report(L, fills[f], "batch +25%", extra, start);
+
+			btree_free(t);
+		}
+	}
+
+	free(sorted);
+	free(keys);
+}
+
+struct worker
+{
+	pthread_t thread;
+	struct cbtree *ct;
+	struct btree *t;
+	pthread_rwlock_t *lock;
+	size_t n;
+	unsigned int writes;
+	uint64_t seed;
+	size_t ops;
+};
+
+static atomic_bool stop;
+
+/* Look up, insert, or delete random keys out of 2n, until told to stop. */
+static void* work(void *arg)
+{
+	struct worker *w = arg;
+	size_t ops = 0;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		uint64_t r = next_rand(&w->seed);
+		int x = key(r % (2 * w->n));
+		unsigned int op = (r >> 32) % 100;
+
+		if (w->ct != NULL) {
+			if (op >= w->writes)
+				cbtree_contains(w->ct, x);
+			else if (op % 2)
+				cbtree_insert(w->ct, x);
+			else
+				cbtree_delete(w->ct, x);
+		} else if (op >= w->writes) {
+			pthread_rwlock_rdlock(w->lock);
+			btree_contains(w->t, x);
+			pthread_rwlock_unlock(w->lock);
+		} else {
+			pthread_rwlock_wrlock(w->lock);
+			if (op % 2)
+				btree_insert(w->t, x);
+			else
+				btree_delete(w->t, x);
+			pthread_rwlock_unlock(w->lock);
+		}
+		++ops;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+static void threads(int argc, char **argv)
+{
+	static const unsigned int counts[] = {1, 2, 4, 8, 16, 32, 64};
+	static const unsigned int writes[] = {0, 10, 50};
+	size_t n = argc > 0 ? strtod(argv[0], NULL) : 1e6;
+	double seconds = argc > 1 ? strtod(argv[1], NULL) : 1;
+	struct worker workers[64];
+	pthread_rwlock_t lock;
+
+	if (n == 0 || n > UINT32_MAX / 2)
+		errx(1, "bad number of keys");
+	pthread_rwlock_init(&lock, NULL);
+
+	printf("%8s %8s %12s %12s\n", "threads", "writes", "cbtree", "locked");
+	for (size_t m = 0; m < sizeof(writes) / sizeof(writes[0]); ++m) {
+		for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+			double mops[2];
+
+			for (int locked = 0; locked < 2; ++locked) {
+				struct cbtree *ct = locked ? NULL : cbtree_alloc(BTREE_LINE_L);
+				struct btree *t = locked ? btree_alloc(BTREE_LINE_L) : NULL;
+				size_t ops = 0;
+
+				for (size_t i = 0; i < n; ++i)
+					if (locked)
+						btree_insert(t, key(i));
+					else
+						cbtree_insert(ct, key(i));
+
+				atomic_store(&stop, false);
+				for (unsigned int i = 0; i < counts[c]; ++i) {
+					workers[i] = (struct worker){
+						.ct = ct, .t = t, .lock = &lock, .n = n,
+						.writes = writes[m], .seed = 0x9e3779b97f4a7c15 * (i + 1),
+					};
+					if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+						errx(1, "pthread_create() failed");
+				}
+
+				double start = now();
+				usleep(seconds * 1e6);
+				atomic_store(&stop, true);
+				for (unsigned int i = 0; i < counts[c]; ++i) {
+					pthread_join(workers[i].thread, NULL);
+					ops += workers[i].ops;
+				}
+				mops[locked] = ops / (now() - start) / 1e6;
+
+				cbtree_free(ct);
+				btree_free(t);
+			}
+			printf("%8u %7u%% %12.2f %12.2f\n", counts[c], writes[m], mops[0], mops[1]);
+			fflush(stdout);
+		}
+	}
+
+	pthread_rwlock_destroy(&lock);
+}
+
+static void ranges(int argc, char **argv)
+{
+	static const unsigned int default_Ls[] = {4, 8, 16, 64, 256};
+	static const unsigned int widths[] = {1, 100, 10000};
+	size_t n = argc > 0 ? strtod(argv[0], NULL) : 1e7;
+	int nr_Ls = argc > 1 ? argc - 1 : 5;
+
+	if (n == 0 || n > UINT32_MAX)
+		errx(1, "bad number of keys");
+
+	printf("%6s %8s %12s %12s %12s\n", "L", "width", "Mcounts/s", "Mwalks/s", "Mkeys/s");
+	for (int l = 0; l < nr_Ls; ++l) {
+		unsigned int L = argc > 1 ? strtoul(argv[l + 1], NULL, 0) : default_Ls[l];
+		struct btree *t = btree_alloc(L);
+
+		if (t == NULL)
+			errx(1, "btree_alloc(%u) failed", L);
+		for (size_t i = 0; i < n; ++i)
+			btree_insert(t, key(i));
+
+		for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); ++w) {
+			/* keys are spread evenly over the 2^32 ints */
+			int64_t span = ((int64_t)1 << 32) / n * widths[w];
+			size_t queries = NR_LOOKUPS / widths[w] / 4 + 1000, counted = 0, walked = 0;
+			uint64_t seed = 42;
+			double start, count_time;
+
+			start = now();
+			for (size_t q = 0; q < queries; ++q) {
+				int lo = next_rand(&seed);
+				counted += btree_count_range(t, lo, lo + span > INT_MAX ? INT_MAX : lo + span);
+			}
+			count_time = now() - start;
+
+			seed = 42;
+			start = now();
+			for (size_t q = 0; q < queries; ++q) {
+				int lo = next_rand(&seed), x;
+				struct btree_iter *i = btree_iter_range(t, lo,
+					lo + span > INT_MAX ? INT_MAX : lo + span);
+
+				while (btree_iter_next(i, &x))
+					walked++;
+				btree_iter_end(i);
+			}
+			double walk_time = now() - start;
+
+			if (counted != walked)
+				errx(1, "counted %zu keys in ranges, walked %zu", counted, walked);
+			printf("%6u %8u %12.2f %12.2f %12.2f\n", L, widths[w], queries / count_time / 1e6,
+			       queries / walk_time / 1e6, walked / walk_time / 1e6);
+		}
+		btree_free(t);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = argc > 1 ? argv[1] : "lookups";
+
+	if (strcmp(mode, "lookups") == 0)
+		lookups(argc - 2, argv + 2);
+	else if (strcmp(mode, "churn") == 0)
+		churn(argc - 2, argv + 2);
+	else if (strcmp(mode, "load") == 0)
+		load(argc - 2, argv + 2);
+	else if (strcmp(mode, "threads") == 0)
+		threads(argc - 2, argv + 2);
+	else if (strcmp(mode, "ranges") == 0)
+		ranges(argc - 2, argv + 2);
+	else
+		errx(1, "unknown mode %s", mode);
+	return 0;
+}
@@ -1,63 +1,956 @@
 #include <solution.h>
+#include <fs_malloc.h>
+#include <fs_slab.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define CACHE_LINE 64
+#define KEYS_PER_LINE (CACHE_LINE / (int)sizeof(int))
+
+/*
+   A batch of at least 1/REBUILD_RATIO of the keys in a tree is merged with
+   all of them, and the tree rebuilt from the result in linear time; a
+   smaller one is applied a key at a time, in order, so that consecutive
+   keys walk down mostly the same, cached, nodes.
+ */
+#define REBUILD_RATIO 8
+
+/* Every node but the root has at least two children, so 2^32 keys fit in
+   33 levels. */
+#define MAX_HEIGHT 40
+
+/*
+   A node is a run of lines of keys, sorted and padded with INT_MAX past the
+   last one, followed by this header and, in an inner node, the children and
+   the number of keys under each of them. A struct node * points at the
+   header; the keys are right before it. The search only reads the keys, a
+   line at a time, and then the one child it goes down to.
+ */
+struct node
+{
+	unsigned int nr;
+	bool leaf;
+	struct node *child[];
+};
+
+/* The number of keys less than @x in @nr_lines lines of sorted, padded keys. */
+typedef unsigned int (*rank_fn)(const int *keys, unsigned int nr_lines, int x);
 
 struct btree
 {
-	/* implement me */
+	unsigned int L;
+	/* at most 2L keys in a node */
+	unsigned int max;
+	unsigned int nr_lines;
+	size_t key_bytes;
+	rank_fn rank;
+	struct node *root;
+	size_t nr_keys;
+	/* percentage of 2L keys in the nodes that btree_bulk_load() builds */
+	unsigned int fill;
+
+	/* where leaves and inner nodes come from, unless BTREE_MALLOC */
+	struct fs_slab *leaves;
+	struct fs_slab *inner;
+	unsigned int slab_flags;
+
+	/* the keys and children of a full node and the ones added to it, as it splits */
+	int *split_keys;
+	struct node **split_child;
+	size_t *split_counts;
 };
 
+static inline int* keys_of(const struct btree *t, const struct node *n)
+{
+	return (int *)((char *)n - t->key_bytes);
+}
+
+/* The number of keys under each child of the inner node @n. */
+static inline size_t* counts_of(const struct btree *t, const struct node *n)
+{
+	return (size_t *)((char *)n->child + (t->max + 1) * sizeof(n->child[0]));
+}
+
+/* The number of keys under @n, and in it. */
+static size_t count_under(const struct btree *t, const struct node *n)
+{
+	size_t count = n->nr;
+
+	if (!n->leaf)
+		for (unsigned int i = 0; i <= n->nr; ++i)
+			count += counts_of(t, n)[i];
+	return count;
+}
+
+/*
+   The rank of @x in a single line. The scalar version is what compilers may
+   vectorize on their own; the others compare the whole line with a few
+   instructions, and count the keys below @x from the mask of the results.
+ */
+
+static inline unsigned int line_rank_scalar(const int *line, int x)
+{
+	unsigned int r = 0;
+	for (int i = 0; i < KEYS_PER_LINE; ++i)
+		r += line[i] < x;
+	return r;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2,popcnt")))
+static inline unsigned int line_rank_sse4(const int *line, int x)
+{
+	const __m128i *v = (const __m128i *)line;
+	__m128i y = _mm_set1_epi32(x);
+	__m128i a = _mm_packs_epi32(_mm_cmpgt_epi32(y, _mm_load_si128(v)),
+				     _mm_cmpgt_epi32(y, _mm_load_si128(v + 1)));
+	__m128i b = _mm_packs_epi32(_mm_cmpgt_epi32(y, _mm_load_si128(v + 2)),
+				     _mm_cmpgt_epi32(y, _mm_load_si128(v + 3)));
+	return __builtin_popcount(_mm_movemask_epi8(_mm_packs_epi16(a, b)));
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline unsigned int line_rank_avx2(const int *line, int x)
+{
+	const __m256i *v = (const __m256i *)line;
+	__m256i y = _mm256_set1_epi32(x);
+	unsigned int lo = _mm256_movemask_ps(_mm256_castsi256_ps(
+		_mm256_cmpgt_epi32(y, _mm256_load_si256(v))));
+	unsigned int hi = _mm256_movemask_ps(_mm256_castsi256_ps(
+		_mm256_cmpgt_epi32(y, _mm256_load_si256(v + 1))));
+	return __builtin_popcount(lo | hi << 8);
+}
+#endif
+
+/* Binary search for the first line that does not end below @x, then rank
+   @x in it: every line before it is below @x. */
+static inline __attribute__((always_inline))
+unsigned int rank_lines(const int *keys, unsigned int nr_lines, int x,
+			unsigned int (*line_rank)(const int *, int))
+{
+	unsigned int lo = 0, hi = nr_lines - 1;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (keys[mid * KEYS_PER_LINE + KEYS_PER_LINE - 1] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo * KEYS_PER_LINE + line_rank(keys + lo * KEYS_PER_LINE, x);
+}
+
+/*
+   A version of each search for nodes of any size, and one for nodes of a
+   single line, which is just the rank in that line. Nodes of BTREE_LINE_L
+   get the latter.
+ */
+
+static unsigned int rank_scalar(const int *keys, unsigned int nr_lines, int x)
+{
+	return rank_lines(keys, nr_lines, x, line_rank_scalar);
+}
+
+static unsigned int rank_line_scalar(const int *keys, unsigned int nr_lines, int x)
+{
+	(void) nr_lines;
+	return line_rank_scalar(keys, x);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2,popcnt")))
+static unsigned int rank_sse4(const int *keys, unsigned int nr_lines, int x)
+{
+	return rank_lines(keys, nr_lines, x, line_rank_sse4);
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static unsigned int rank_line_sse4(const int *keys, unsigned int nr_lines, int x)
+{
+	(void) nr_lines;
+	return line_rank_sse4(keys, x);
+}
+
+__attribute__((target("avx2,popcnt")))
+static unsigned int rank_avx2(const int *keys, unsigned int nr_lines, int x)
+{
+	return rank_lines(keys, nr_lines, x, line_rank_avx2);
+}
+
+__attribute__((target("avx2,popcnt")))
+static unsigned int rank_line_avx2(const int *keys, unsigned int nr_lines, int x)
+{
+	(void) nr_lines;
+	return line_rank_avx2(keys, x);
+}
+#endif
+
+static bool cpu_supports(enum btree_search search)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (search == BTREE_SEARCH_SSE4)
+		return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+	if (search == BTREE_SEARCH_AVX2)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#endif
+	return search == BTREE_SEARCH_SCALAR;
+}
+
+int btree_set_search(struct btree *t, enum btree_search search)
+{
+	bool line = t->nr_lines == 1;
+
+	if (search == BTREE_SEARCH_AUTO) {
+		search = BTREE_SEARCH_AVX2;
+		while (!cpu_supports(search))
+			search--;
+	}
+	if (!cpu_supports(search))
+		return -ENOTSUP;
+
+	switch (search) {
+#ifdef HAVE_X86_SIMD
+	case BTREE_SEARCH_AVX2:
+		t->rank = line ? rank_line_avx2 : rank_avx2;
+		break;
+	case BTREE_SEARCH_SSE4:
+		t->rank = line ? rank_line_sse4 : rank_sse4;
+		break;
+#endif
+	default:
+		t->rank = line ? rank_line_scalar : rank_scalar;
+	}
+	return 0;
+}
+
+static size_t node_size(const struct btree *t, bool leaf)
+{
+	size_t size = t->key_bytes + sizeof(struct node);
+
+	if (!leaf)
+		size += (t->max + 1) * (sizeof(struct node *) + sizeof(size_t));
+	return size;
+}
+
+static struct node* node_alloc(struct btree *t, bool leaf)
+{
+	struct node *n;
+	void *p;
+
+	if (t->leaves != NULL)
+		p = fs_slab_get(leaf ? t->leaves : t->inner);
+	else if (posix_memalign(&p, CACHE_LINE, node_size(t, leaf)) != 0)
+		errx(1, "posix_memalign() failed");
+
+	n = (struct node *)((char *)p + t->key_bytes);
+	n->nr = 0;
+	n->leaf = leaf;
+	for (unsigned int i = 0; i < t->nr_lines * KEYS_PER_LINE; ++i)
+		((int *)p)[i] = INT_MAX;
+	return n;
+}
+
+static void node_free(struct btree *t, struct node *n)
+{
+	if (t->leaves != NULL)
+		fs_slab_put(n->leaf ? t->leaves : t->inner, keys_of(t, n));
+	else
+		free(keys_of(t, n));
+}
+
+/* Pad the keys of @n past the last one. */
+static void pad(struct btree *t, struct node *n)
+{
+	int *k = keys_of(t, n);
+	for (unsigned int i = n->nr; i < t->nr_lines * KEYS_PER_LINE; ++i)
+		k[i] = INT_MAX;
+}
+
+struct btree* btree_alloc_ex(unsigned int L, unsigned int flags)
+{
+	struct btree *t;
+
+	if (L == 0)
+		return NULL;
+
+	t = fs_xzalloc(sizeof(*t));
+	t->L = L;
+	t->max = 2 * L;
+	t->fill = BTREE_DEFAULT_FILL;
+	t->nr_lines = (t->max + KEYS_PER_LINE - 1) / KEYS_PER_LINE;
+	t->key_bytes = t->nr_lines * CACHE_LINE;
+	btree_set_search(t, BTREE_SEARCH_AUTO);
+
+	t->split_keys = fs_xmalloc((t->max + 1) * sizeof(*t->split_keys));
+	t->split_child = fs_xmalloc((t->max + 2) * sizeof(*t->split_child));
+	t->split_counts = fs_xmalloc((t->max + 2) * sizeof(*t->split_counts));
+
+	if (!(flags & BTREE_MALLOC)) {
+		t->slab_flags = flags & BTREE_HUGE_PAGES ? FS_SLAB_HUGE : 0;
+		t->leaves = fs_slab_alloc(node_size(t, true), CACHE_LINE, t->slab_flags);
+		t->inner = fs_slab_alloc(node_size(t, false), CACHE_LINE, t->slab_flags);
+	}
+
+	t->root = node_alloc(t, true);
+	return t;
+}
+
 struct btree* btree_alloc(unsigned int L)
 {
-	(void) L;
+	return btree_alloc_ex(L, 0);
+}
 
-	return NULL;
+static void free_subtree(struct btree *t, struct node *n)
+{
+	if (!n->leaf)
+		for (unsigned int i = 0; i <= n->nr; ++i)
+			free_subtree(t, n->child[i]);
+	node_free(t, n);
 }
 
 void btree_free(struct btree *t)
 {
-	(void) t;
+	if (t == NULL)
+		return;
+
+	/* nodes from slabs go with them */
+	if (t->leaves != NULL) {
+		fs_slab_free(t->leaves);
+		fs_slab_free(t->inner);
+	} else {
+		free_subtree(t, t->root);
+	}
+	fs_xfree(t->split_keys);
+	fs_xfree(t->split_child);
+	fs_xfree(t->split_counts);
+	fs_xfree(t);
 }
 
-void btree_insert(struct btree *t, int x)
+bool btree_contains(struct btree *t, int x)
 {
-	(void) t;
-	(void) x;
+	struct node *n = t->root;
+
+	for (;;) {
+		const int *k = keys_of(t, n);
+		unsigned int i = t->rank(k, t->nr_lines, x);
+
+		if (i < n->nr && k[i] == x)
+			return true;
+		if (n->leaf)
+			return false;
+		n = n->child[i];
+	}
 }
 
-void btree_delete(struct btree *t, int x)
+/* The number of keys of @t below @x, and whether @x is in @t too. */
+static size_t count_below(struct btree *t, int x, bool *found)
 {
-	(void) t;
-	(void) x;
+	struct node *n = t->root;
+	size_t count = 0;
+
+	for (;;) {
+		const int *k = keys_of(t, n);
+		unsigned int i = t->rank(k, t->nr_lines, x);
+
+		*found = i < n->nr && k[i] == x;
+		count += i;
+		if (n->leaf)
+			return count;
+		for (unsigned int j = 0; j < i; ++j)
+			count += counts_of(t, n)[j];
+		if (*found)
+			return count + counts_of(t, n)[i];
+		n = n->child[i];
+	}
 }
 
-bool btree_contains(struct btree *t, int x)
+size_t btree_count_range(struct btree *t, int lo, int hi)
 {
-	(void) t;
-	(void) x;
+	size_t below_lo, below_hi;
+	bool found;
+
+	if (lo > hi)
+		return 0;
+	below_lo = count_below(t, lo, &found);
+	below_hi = count_below(t, hi, &found);
+	return below_hi + found - below_lo;
+}
+
+/*
+   Add @x, and @right, with @right_count keys under it, after it if @n is an
+   inner node, at @i in @n, which is full: split the 2L + 1 keys into L keys
+   that stay in @n, the one in the middle, which goes to *@up, and L keys in
+   a new node, *@right.
+ */
+static void split(struct btree *t, struct node *n, unsigned int i, int x,
+		  struct node *right, size_t right_count, int *up, struct node **new)
+{
+	int *k = keys_of(t, n), *sk = t->split_keys;
+	struct node **sc = t->split_child;
+	size_t *scc = t->split_counts;
+	unsigned int L = t->L;
+	struct node *r;
+
+	memcpy(sk, k, i * sizeof(*sk));
+	sk[i] = x;
+	memcpy(sk + i + 1, k + i, (n->nr - i) * sizeof(*sk));
+	if (!n->leaf) {
+		size_t *c = counts_of(t, n);
+
+		memcpy(sc, n->child, (i + 1) * sizeof(*sc));
+		sc[i + 1] = right;
+		memcpy(sc + i + 2, n->child + i + 1, (n->nr - i) * sizeof(*sc));
+		memcpy(scc, c, (i + 1) * sizeof(*scc));
+		scc[i + 1] = right_count;
+		memcpy(scc + i + 2, c + i + 1, (n->nr - i) * sizeof(*scc));
+	}
+
+	r = node_alloc(t, n->leaf);
+	memcpy(k, sk, L * sizeof(*k));
+	memcpy(keys_of(t, r), sk + L + 1, L * sizeof(*k));
+	if (!n->leaf) {
+		memcpy(n->child, sc, (L + 1) * sizeof(*sc));
+		memcpy(r->child, sc + L + 1, (L + 1) * sizeof(*sc));
+		memcpy(counts_of(t, n), scc, (L + 1) * sizeof(*scc));
+		memcpy(counts_of(t, r), scc + L + 1, (L + 1) * sizeof(*scc));
+	}
+	n->nr = r->nr = L;
+	pad(t, n);
+
+	*up = sk[L];
+	*new = r;
+}
+
+/* Insert @x under @n. Return true if @n split, with *@up and *@new as in split(). */
+static bool insert(struct btree *t, struct node *n, int x, int *up, struct node **new)
+{
+	int *k = keys_of(t, n);
+	unsigned int i = t->rank(k, t->nr_lines, x);
+	struct node *right = NULL;
+	size_t right_count = 0;
+
+	if (i < n->nr && k[i] == x)
+		return false;
+	if (n->leaf) {
+		t->nr_keys++;
+	} else {
+		size_t *c = counts_of(t, n), before = t->nr_keys;
+
+		if (!insert(t, n->child[i], x, &x, &right)) {
+			c[i] += t->nr_keys - before;
+			return false;
+		}
+		c[i] = count_under(t, n->child[i]);
+		right_count = count_under(t, right);
+	}
 
+	if (n->nr == t->max) {
+		split(t, n, i, x, right, right_count, up, new);
+		return true;
+	}
+
+	memmove(k + i + 1, k + i, (n->nr - i) * sizeof(*k));
+	k[i] = x;
+	if (!n->leaf) {
+		size_t *c = counts_of(t, n);
+
+		memmove(n->child + i + 2, n->child + i + 1, (n->nr - i) * sizeof(n->child[0]));
+		n->child[i + 1] = right;
+		memmove(c + i + 2, c + i + 1, (n->nr - i) * sizeof(*c));
+		c[i + 1] = right_count;
+	}
+	n->nr++;
 	return false;
 }
 
+void btree_insert(struct btree *t, int x)
+{
+	struct node *right, *root;
+	int up;
+
+	if (!insert(t, t->root, x, &up, &right))
+		return;
+
+	root = node_alloc(t, false);
+	keys_of(t, root)[0] = up;
+	root->child[0] = t->root;
+	root->child[1] = right;
+	counts_of(t, root)[0] = count_under(t, t->root);
+	counts_of(t, root)[1] = count_under(t, right);
+	root->nr = 1;
+	t->root = root;
+}
+
+/* Remove the key at @i of @n, and the child after it if @child is set. */
+static void remove_at(struct btree *t, struct node *n, unsigned int i, bool child)
+{
+	int *k = keys_of(t, n);
+
+	memmove(k + i, k + i + 1, (n->nr - i - 1) * sizeof(*k));
+	if (child) {
+		size_t *c = counts_of(t, n);
+
+		memmove(n->child + i + 1, n->child + i + 2,
+			(n->nr - i - 1) * sizeof(n->child[0]));
+		memmove(c + i + 1, c + i + 2, (n->nr - i - 1) * sizeof(*c));
+	}
+	k[--n->nr] = INT_MAX;
+}
+
+/* Merge child @i + 1 of @n, and the key between them, into child @i. */
+static void merge(struct btree *t, struct node *n, unsigned int i)
+{
+	struct node *l = n->child[i], *r = n->child[i + 1];
+	int *lk = keys_of(t, l);
+
+	lk[l->nr] = keys_of(t, n)[i];
+	memcpy(lk + l->nr + 1, keys_of(t, r), r->nr * sizeof(*lk));
+	if (!l->leaf) {
+		memcpy(l->child + l->nr + 1, r->child, (r->nr + 1) * sizeof(l->child[0]));
+		memcpy(counts_of(t, l) + l->nr + 1, counts_of(t, r),
+		       (r->nr + 1) * sizeof(size_t));
+	}
+	l->nr += r->nr + 1;
+	counts_of(t, n)[i] += counts_of(t, n)[i + 1] + 1;
+
+	node_free(t, r);
+	remove_at(t, n, i, true);
+}
+
+/* Move the last key of child @i of @n up into @n, and the key it replaces
+   down to the front of child @i + 1. */
+static void rotate_right(struct btree *t, struct node *n, unsigned int i)
+{
+	struct node *l = n->child[i], *r = n->child[i + 1];
+	int *k = keys_of(t, n), *lk = keys_of(t, l), *rk = keys_of(t, r);
+	size_t moved = 1;
+
+	memmove(rk + 1, rk, r->nr * sizeof(*rk));
+	rk[0] = k[i];
+	if (!r->leaf) {
+		size_t *rc = counts_of(t, r);
+
+		memmove(r->child + 1, r->child, (r->nr + 1) * sizeof(r->child[0]));
+		r->child[0] = l->child[l->nr];
+		memmove(rc + 1, rc, (r->nr + 1) * sizeof(*rc));
+		rc[0] = counts_of(t, l)[l->nr];
+		moved += rc[0];
+	}
+	r->nr++;
+	counts_of(t, n)[i] -= moved;
+	counts_of(t, n)[i + 1] += moved;
+
+	k[i] = lk[l->nr - 1];
+	lk[--l->nr] = INT_MAX;
+}
+
+/* Move the first key of child @i + 1 of @n up into @n, and the key it
+   replaces down to the back of child @i. */
+static void rotate_left(struct btree *t, struct node *n, unsigned int i)
+{
+	struct node *l = n->child[i], *r = n->child[i + 1];
+	int *k = keys_of(t, n), *lk = keys_of(t, l), *rk = keys_of(t, r);
+	size_t moved = 1;
+
+	lk[l->nr] = k[i];
+	if (!l->leaf) {
+		l->child[l->nr + 1] = r->child[0];
+		counts_of(t, l)[l->nr + 1] = counts_of(t, r)[0];
+		moved += counts_of(t, r)[0];
+	}
+	l->nr++;
+
+	k[i] = rk[0];
+	memmove(rk, rk + 1, (r->nr - 1) * sizeof(*rk));
+	if (!r->leaf) {
+		size_t *rc = counts_of(t, r);
+
+		memmove(r->child, r->child + 1, r->nr * sizeof(r->child[0]));
+		memmove(rc, rc + 1, r->nr * sizeof(*rc));
+	}
+	rk[--r->nr] = INT_MAX;
+	counts_of(t, n)[i] += moved;
+	counts_of(t, n)[i + 1] -= moved;
+}
+
+/* Bring child @i of @n, left with L - 1 keys, back to L: borrow a key from
+   a sibling that can spare one, or merge it with a sibling. */
+static void refill(struct btree *t, struct node *n, unsigned int i)
+{
+	if (i > 0 && n->child[i - 1]->nr > t->L)
+		rotate_right(t, n, i - 1);
+	else if (i < n->nr && n->child[i + 1]->nr > t->L)
+		rotate_left(t, n, i);
+	else
+		merge(t, n, i > 0 ? i - 1 : i);
+}
+
+/* Delete @x under @n. Return true if @n is left with fewer than L keys. */
+static bool delete(struct btree *t, struct node *n, int x)
+{
+	int *k = keys_of(t, n);
+	unsigned int i = t->rank(k, t->nr_lines, x);
+	bool found = i < n->nr && k[i] == x, under;
+	size_t before = t->nr_keys;
+
+	if (n->leaf) {
+		if (!found)
+			return false;
+		remove_at(t, n, i, false);
+		t->nr_keys--;
+		return n->nr < t->L;
+	}
+
+	/* take the largest key of the left subtree instead, and delete that */
+	if (found) {
+		struct node *m = n->child[i];
+		while (!m->leaf)
+			m = m->child[m->nr];
+		k[i] = x = keys_of(t, m)[m->nr - 1];
+	}
+
+	under = delete(t, n->child[i], x);
+	counts_of(t, n)[i] -= before - t->nr_keys;
+	if (!under)
+		return false;
+	refill(t, n, i);
+	return n->nr < t->L;
+}
+
+void btree_delete(struct btree *t, int x)
+{
+	struct node *root = t->root;
+
+	delete(t, root, x);
+	if (root->nr == 0 && !root->leaf) {
+		t->root = root->child[0];
+		node_free(t, root);
+	}
+}
+
+/*
+   The path from the root to the next key: the next key of each node on it
+   is at @pos, and in an inner node, everything before it has been visited.
+   Keys past @hi end the iteration.
+ */
 struct btree_iter
 {
+	struct btree *t;
+	int hi;
+	unsigned int depth;
+	struct
+	{
+		struct node *node;
+		unsigned int pos;
+	} path[MAX_HEIGHT];
 };
 
+/* Push @n and the leftmost path under it. */
+static void push_leftmost(struct btree_iter *i, struct node *n)
+{
+	for (;;) {
+		i->path[i->depth].node = n;
+		i->path[i->depth].pos = 0;
+		i->depth++;
+		if (n->leaf)
+			return;
+		n = n->child[0];
+	}
+}
+
 struct btree_iter* btree_iter_start(struct btree *t)
 {
-	(void) t;
+	struct btree_iter *i = fs_xmalloc(sizeof(*i));
 
-	return NULL;
+	i->t = t;
+	i->hi = INT_MAX;
+	i->depth = 0;
+	push_leftmost(i, t->root);
+	return i;
+}
+
+/* Push the path from the root down to the first key of @t from @lo on. */
+static void push_from(struct btree_iter *i, int lo)
+{
+	struct btree *t = i->t;
+	struct node *n = t->root;
+
+	for (;;) {
+		const int *k = keys_of(t, n);
+		unsigned int pos = t->rank(k, t->nr_lines, lo);
+
+		i->path[i->depth].node = n;
+		i->path[i->depth].pos = pos;
+		i->depth++;
+		if (n->leaf || (pos < n->nr && k[pos] == lo))
+			return;
+		n = n->child[pos];
+	}
+}
+
+struct btree_iter* btree_iter_range(struct btree *t, int lo, int hi)
+{
+	struct btree_iter *i = fs_xmalloc(sizeof(*i));
+
+	i->t = t;
+	i->hi = hi;
+	i->depth = 0;
+	push_from(i, lo);
+	return i;
+}
+
+struct btree_iter* btree_iter_seek(struct btree *t, int lo)
+{
+	return btree_iter_range(t, lo, INT_MAX);
 }
 
 void btree_iter_end(struct btree_iter *i)
 {
-	(void) i;
+	fs_xfree(i);
 }
 
 bool btree_iter_next(struct btree_iter *i, int *x)
 {
-	(void) i;
-	(void) x;
+	while (i->depth > 0) {
+		struct node *n = i->path[i->depth - 1].node;
+		unsigned int pos = i->path[i->depth - 1].pos;
 
+		if (pos == n->nr) {
+			i->depth--;
+			continue;
+		}
+
+		*x = keys_of(i->t, n)[pos];
+		if (*x > i->hi) {
+			i->depth = 0;
+			return false;
+		}
+		i->path[i->depth - 1].pos = pos + 1;
+		if (!n->leaf)
+			push_leftmost(i, n->child[pos + 1]);
+		return true;
+	}
 	return false;
 }
+
+/* The number of keys in the nodes that btree_bulk_load() builds. */
+static unsigned int fill_keys(const struct btree *t)
+{
+	unsigned int n = (t->max * t->fill + 50) / 100;
+	return n < t->L ? t->L : n > t->max ? t->max : n;
+}
+
+/*
+   The number of nodes to split @total into, for nodes of @target keys. A
+   node with k keys takes k + 1 of @total: its children, or in a leaf, its
+   keys and the key after it, which goes up to the level above. The nodes
+   are given sizes as even as they can be, and there are as many of them as
+   needed to keep each within L and 2L keys.
+ */
+static size_t nr_nodes(const struct btree *t, size_t total, unsigned int target)
+{
+	size_t n = (total + target) / (target + 1);
+
+	while (n > 1 && total / n < t->L + 1)
+		n--;
+	return n > 0 ? n : 1;
+}
+
+/* Build @t bottom-up from the @n keys of @keys, sorted and distinct. */
+static void build(struct btree *t, const int *keys, size_t n)
+{
+	unsigned int target = fill_keys(t);
+	size_t total = n + 1, nr = nr_nodes(t, total, target), pos = 0;
+	struct node **nodes = fs_xmalloc(nr * sizeof(*nodes));
+	int *seps = fs_xmalloc(nr * sizeof(*seps));
+	/* the number of keys under each of the nodes */
+	size_t *counts = fs_xmalloc(nr * sizeof(*counts));
+
+	for (size_t i = 0; i < nr; ++i) {
+		struct node *leaf = node_alloc(t, true);
+
+		leaf->nr = total / nr + (i < total % nr) - 1;
+		memcpy(keys_of(t, leaf), keys + pos, leaf->nr * sizeof(*keys));
+		pos += leaf->nr;
+		nodes[i] = leaf;
+		counts[i] = leaf->nr;
+		if (i + 1 < nr)
+			seps[i] = keys[pos++];
+	}
+
+	/* the nodes of a level, the keys between them, and their counts are
+	   rewritten in place with those of the level above, which are fewer */
+	while (nr > 1) {
+		size_t below = nr, child = 0, sep = 0;
+
+		nr = nr_nodes(t, below, target);
+		for (size_t i = 0; i < nr; ++i) {
+			struct node *n = node_alloc(t, false);
+
+			n->nr = below / nr + (i < below % nr) - 1;
+			memcpy(n->child, nodes + child, (n->nr + 1) * sizeof(*nodes));
+			memcpy(counts_of(t, n), counts + child, (n->nr + 1) * sizeof(*counts));
+			memcpy(keys_of(t, n), seps + sep, n->nr * sizeof(*seps));
+			child += n->nr + 1;
+			sep += n->nr;
+			nodes[i] = n;
+			counts[i] = count_under(t, n);
+			if (i + 1 < nr)
+				seps[i] = seps[sep++];
+		}
+	}
+
+	t->root = nodes[0];
+	t->nr_keys = n;
+	fs_xfree(nodes);
+	fs_xfree(seps);
+	fs_xfree(counts);
+}
+
+/* Free every node of @t, leaving it without a root. */
+static void drop_nodes(struct btree *t)
+{
+	if (t->leaves != NULL) {
+		fs_slab_free(t->leaves);
+		fs_slab_free(t->inner);
+		t->leaves = fs_slab_alloc(node_size(t, true), CACHE_LINE, t->slab_flags);
+		t->inner = fs_slab_alloc(node_size(t, false), CACHE_LINE, t->slab_flags);
+	} else {
+		free_subtree(t, t->root);
+	}
+	t->root = NULL;
+	t->nr_keys = 0;
+}
+
+int btree_set_fill(struct btree *t, unsigned int percent)
+{
+	if (percent < 50 || percent > 100)
+		return -EINVAL;
+	t->fill = percent;
+	return 0;
+}
+
+int btree_bulk_load(struct btree *t, const int *sorted, size_t n)
+{
+	int *keys = NULL;
+	size_t nr = 0;
+	bool repeats = false;
+
+	/* nothing is allocated before the order is known to be right */
+	for (size_t i = 1; i < n; ++i) {
+		if (sorted[i] < sorted[i - 1])
+			return -EINVAL;
+		if (sorted[i] == sorted[i - 1])
+			repeats = true;
+	}
+
+	if (repeats) {
+		keys = fs_xmalloc(n * sizeof(*keys));
+		for (size_t i = 0; i < n; ++i)
+			if (nr == 0 || sorted[i] != keys[nr - 1])
+				keys[nr++] = sorted[i];
+	}
+
+	drop_nodes(t);
+	if (keys == NULL) {
+		build(t, sorted, n);
+	} else {
+		build(t, keys, nr);
+		fs_xfree(keys);
+	}
+	return 0;
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+/* A sorted copy of the @n keys of @keys without repeats; *@nr is set to
+   how many are left. */
+static int* sort_batch(const int *keys, size_t n, size_t *nr)
+{
+	int *sorted = fs_xmalloc((n > 0 ? n : 1) * sizeof(*sorted));
+	size_t m = 0;
+
+	memcpy(sorted, keys, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), compare_ints);
+	for (size_t i = 0; i < n; ++i)
+		if (m == 0 || sorted[i] != sorted[m - 1])
+			sorted[m++] = sorted[i];
+
+	*nr = m;
+	return sorted;
+}
+
+/*
+   Rebuild @t from a merge of its keys with the @n sorted, distinct keys of
+   @batch: added to them, or taken out of them if @remove is set.
+ */
+static void rebuild(struct btree *t, const int *batch, size_t n, bool remove)
+{
+	int *keys = fs_xmalloc((t->nr_keys + (remove ? 0 : n) + 1) * sizeof(*keys));
+	struct btree_iter i = {.t = t, .hi = INT_MAX};
+	size_t nr = 0, j = 0;
+	bool more;
+	int x;
+
+	push_leftmost(&i, t->root);
+	more = btree_iter_next(&i, &x);
+	while (more || j < n) {
+		if (more && (j == n || x < batch[j])) {
+			keys[nr++] = x;
+			more = btree_iter_next(&i, &x);
+			continue;
+		}
+		if (!remove)
+			keys[nr++] = batch[j];
+		if (more && x == batch[j])
+			more = btree_iter_next(&i, &x);
+		j++;
+	}
+
+	drop_nodes(t);
+	build(t, keys, nr);
+	fs_xfree(keys);
+}
+
+void btree_insert_batch(struct btree *t, const int *keys, size_t n)
+{
+	size_t nr;
+	int *sorted = sort_batch(keys, n, &nr);
+
+	if (nr * REBUILD_RATIO >= t->nr_keys) {
+		rebuild(t, sorted, nr, false);
+	} else {
+		for (size_t i = 0; i < nr; ++i)
+			btree_insert(t, sorted[i]);
+	}
+	fs_xfree(sorted);
+}
+
+void btree_delete_batch(struct btree *t, const int *keys, size_t n)
+{
+	size_t nr;
+	int *sorted = sort_batch(keys, n, &nr);
+
+	if (nr * REBUILD_RATIO >= t->nr_keys) {
+		rebuild(t, sorted, nr, true);
+	} else {
+		for (size_t i = 0; i < nr; ++i)
+			btree_delete(t, sorted[i]);
+	}
+	fs_xfree(sorted);
+}
@@ -0,0 +1,488 @@
+#include <solution.h>
+#include <fs_epoch.h>
+#include <fs_malloc.h>
+
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+/*
+   Bits of a node version. A writer sets LOCKED while it changes the node,
+   and clearing it counts the version up, so a reader that sees the same
+   version before and after reading a node read it whole. OBSOLETE marks a
+   node taken out of the tree.
+ */
+#define OBSOLETE 1
+#define LOCKED 2
+
+/* Restarts of an operation after which it yields rather than spins. */
+#define SPIN_RESTARTS 16
+
+/*
+   A node of the tree, a B+-tree: every key is in a leaf, and the keys of
+   an inner node are copies that separate its children, child i holding
+   the keys from key i - 1 up to key i. Readers read nodes without locks,
+   so what they read may be torn until its version is checked again.
+ */
+struct cnode
+{
+	_Atomic uint64_t version;
+	unsigned int nr;
+	bool leaf;
+	int keys[];
+};
+
+struct cbtree
+{
+	_Atomic(struct cnode *) root;
+	unsigned int max;
+	/* where the children of an inner node start, after its keys */
+	size_t child_offset;
+	struct fs_epoch *epoch;
+};
+
+static inline struct cnode** children(const struct cbtree *t, struct cnode *n)
+{
+	return (struct cnode **)((char *)n + t->child_offset);
+}
+
+/* The number of keys of @n, within bounds even if @n is being changed. */
+static inline unsigned int load_nr(const struct cbtree *t, struct cnode *n)
+{
+	unsigned int nr = __atomic_load_n(&n->nr, __ATOMIC_RELAXED);
+	return nr < t->max ? nr : t->max;
+}
+
+static inline void store_nr(struct cnode *n, unsigned int nr)
+{
+	__atomic_store_n(&n->nr, nr, __ATOMIC_RELAXED);
+}
+
+/* Read the version of @n into *@v; return false if a writer holds @n, or
+   @n is no longer in the tree. */
+static inline bool read_lock(struct cnode *n, uint64_t *v)
+{
+	*v = atomic_load_explicit(&n->version, memory_order_acquire);
+	return !(*v & (LOCKED | OBSOLETE));
+}
+
+/* Whether @n is still at version @v, so that what was read of it holds. */
+static inline bool validate(struct cnode *n, uint64_t v)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&n->version, memory_order_relaxed) == v;
+}
+
+/* Lock @n if it is still at version @v. */
+static inline bool upgrade(struct cnode *n, uint64_t v)
+{
+	return atomic_compare_exchange_strong(&n->version, &v, v + LOCKED);
+}
+
+static inline void write_unlock(struct cnode *n)
+{
+	atomic_fetch_add_explicit(&n->version, LOCKED, memory_order_release);
+}
+
+static inline void write_unlock_obsolete(struct cnode *n)
+{
+	atomic_fetch_add_explicit(&n->version, LOCKED + OBSOLETE, memory_order_release);
+}
+
+static void backoff(unsigned int *restarts)
+{
+	if (++*restarts > SPIN_RESTARTS)
+		sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+	else
+		__builtin_ia32_pause();
+#endif
+}
+
+/* The number of keys of @keys below @x. */
+static unsigned int lower_bound(const int *keys, unsigned int nr, int64_t x)
+{
+	unsigned int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (keys[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The number of keys of @keys up to @x: the child of an inner node to go
+   down to for @x. */
+static unsigned int upper_bound(const int *keys, unsigned int nr, int64_t x)
+{
+	unsigned int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (keys[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct cnode* node_alloc(struct cbtree *t, bool leaf)
+{
+	size_t size = leaf ? offsetof(struct cnode, keys) + t->max * sizeof(int) :
+			     t->child_offset + (t->max + 1) * sizeof(struct cnode *);
+	struct cnode *n;
+
+	if (posix_memalign((void **)&n, 64, size) != 0)
+		errx(1, "posix_memalign() failed");
+	atomic_init(&n->version, 0);
+	n->nr = 0;
+	n->leaf = leaf;
+	return n;
+}
+
+struct cbtree* cbtree_alloc(unsigned int L)
+{
+	struct cbtree *t;
+
+	if (L == 0)
+		return NULL;
+
+	t = fs_xzalloc(sizeof(*t));
+	t->max = 2 * L;
+	t->child_offset = (offsetof(struct cnode, keys) + t->max * sizeof(int) + 7) & ~(size_t)7;
+	t->epoch = fs_epoch_alloc();
+	atomic_init(&t->root, node_alloc(t, true));
+	return t;
+}
+
+static void free_subtree(struct cbtree *t, struct cnode *n)
+{
+	if (!n->leaf)
+		for (unsigned int i = 0; i <= n->nr; ++i)
+			free_subtree(t, children(t, n)[i]);
+	free(n);
+}
+
+void cbtree_free(struct cbtree *t)
+{
+	if (t == NULL)
+		return;
+
+	free_subtree(t, atomic_load(&t->root));
+	fs_epoch_free(t->epoch);
+	fs_xfree(t);
+}
+
+/*
+   Read-lock the root into *@n and *@v. The root may have split between
+   loading it and reading its version, and then it is no longer the root.
+ */
+static bool lock_root(struct cbtree *t, struct cnode **n, uint64_t *v)
+{
+	*n = atomic_load_explicit(&t->root, memory_order_acquire);
+	return read_lock(*n, v) && *n == atomic_load(&t->root);
+}
+
+/* Go from @n, at version *@v, down to its child for @x, and read-lock it. */
+static bool descend(struct cbtree *t, struct cnode **n, uint64_t *v, int64_t x,
+		    unsigned int *pos)
+{
+	struct cnode *c;
+	uint64_t cv;
+
+	*pos = upper_bound((*n)->keys, load_nr(t, *n), x);
+	c = children(t, *n)[*pos];
+	/* the parent checked again after the child is locked: it was its child then */
+	if (!validate(*n, *v) || !read_lock(c, &cv) || !validate(*n, *v))
+		return false;
+	*n = c;
+	*v = cv;
+	return true;
+}
+
+static bool try_contains(struct cbtree *t, int x, bool *found)
+{
+	struct cnode *n;
+	unsigned int i, nr;
+	uint64_t v;
+
+	if (!lock_root(t, &n, &v))
+		return false;
+	while (!n->leaf)
+		if (!descend(t, &n, &v, x, &i))
+			return false;
+
+	nr = load_nr(t, n);
+	i = lower_bound(n->keys, nr, x);
+	*found = i < nr && n->keys[i] == x;
+	return validate(n, v);
+}
+
+bool cbtree_contains(struct cbtree *t, int x)
+{
+	unsigned int restarts = 0;
+	bool found = false;
+
+	fs_epoch_enter(t->epoch);
+	while (!try_contains(t, x, &found))
+		backoff(&restarts);
+	fs_epoch_exit(t->epoch);
+	return found;
+}
+
+/*
+   Split @n, locked and full, into itself and a new node on its right, and
+   add the key between them to @parent, locked and not full, where @n is
+   child @pos; or to a new root if @n is the root.
+ */
+static void split(struct cbtree *t, struct cnode *parent, unsigned int pos, struct cnode *n)
+{
+	struct cnode *r = node_alloc(t, n->leaf);
+	unsigned int h = n->nr / 2;
+	int sep;
+
+	if (n->leaf) {
+		r->nr = n->nr - h;
+		memcpy(r->keys, n->keys + h, r->nr * sizeof(int));
+		sep = r->keys[0];
+	} else {
+		r->nr = n->nr - h - 1;
+		memcpy(r->keys, n->keys + h + 1, r->nr * sizeof(int));
+		memcpy(children(t, r), children(t, n) + h + 1, (r->nr + 1) * sizeof(struct cnode *));
+		sep = n->keys[h];
+	}
+	store_nr(n, h);
+
+	if (parent == NULL) {
+		struct cnode *root = node_alloc(t, false);
+		root->nr = 1;
+		root->keys[0] = sep;
+		children(t, root)[0] = n;
+		children(t, root)[1] = r;
+		atomic_store_explicit(&t->root, root, memory_order_release);
+		return;
+	}
+
+	memmove(parent->keys + pos + 1, parent->keys + pos, (parent->nr - pos) * sizeof(int));
+	memmove(children(t, parent) + pos + 2, children(t, parent) + pos + 1,
+		(parent->nr - pos) * sizeof(struct cnode *));
+	parent->keys[pos] = sep;
+	children(t, parent)[pos + 1] = r;
+	store_nr(parent, parent->nr + 1);
+}
+
+/*
+   Full nodes are split on the way down, so that the parent of a node that
+   splits always has room for the key that goes up; the operation then
+   starts over.
+ */
+static bool try_insert(struct cbtree *t, int x)
+{
+	struct cnode *n, *parent = NULL;
+	unsigned int pos = 0, i, nr;
+	uint64_t v, pv = 0;
+
+	if (!lock_root(t, &n, &v))
+		return false;
+
+	for (;;) {
+		if (load_nr(t, n) == t->max) {
+			if (parent != NULL && !upgrade(parent, pv))
+				return false;
+			if (!upgrade(n, v)) {
+				if (parent != NULL)
+					write_unlock(parent);
+				return false;
+			}
+			split(t, parent, pos, n);
+			write_unlock(n);
+			if (parent != NULL)
+				write_unlock(parent);
+			return false;
+		}
+		if (n->leaf)
+			break;
+
+		parent = n;
+		pv = v;
+		if (!descend(t, &n, &v, x, &pos))
+			return false;
+	}
+
+	if (!upgrade(n, v))
+		return false;
+	nr = n->nr;
+	i = lower_bound(n->keys, nr, x);
+	if (i == nr || n->keys[i] != x) {
+		memmove(n->keys + i + 1, n->keys + i, (nr - i) * sizeof(int));
+		n->keys[i] = x;
+		store_nr(n, nr + 1);
+	}
+	write_unlock(n);
+	return true;
+}
+
+void cbtree_insert(struct cbtree *t, int x)
+{
+	unsigned int restarts = 0;
+
+	fs_epoch_enter(t->epoch);
+	while (!try_insert(t, x))
+		backoff(&restarts);
+	fs_epoch_exit(t->epoch);
+}
+
+/*
+   Nodes are not merged as they empty, but a leaf left without keys is
+   taken out of its parent, if that has other children, and freed once no
+   reader can be in it any more.
+ */
+static bool try_delete(struct cbtree *t, int x)
+{
+	struct cnode *n, *parent = NULL;
+	unsigned int pos = 0, i, nr;
+	uint64_t v, pv = 0;
+
+	if (!lock_root(t, &n, &v))
+		return false;
+	while (!n->leaf) {
+		parent = n;
+		pv = v;
+		if (!descend(t, &n, &v, x, &pos))
+			return false;
+	}
+
+	nr = load_nr(t, n);
+	i = lower_bound(n->keys, nr, x);
+	if (i == nr || n->keys[i] != x)
+		return validate(n, v);
+
+	if (nr == 1 && parent != NULL && load_nr(t, parent) > 0) {
+		if (!upgrade(parent, pv))
+			return false;
+		if (!upgrade(n, v)) {
+			write_unlock(parent);
+			return false;
+		}
+
+		/* drop the key on either side of the leaf, and the leaf */
+		i = pos > 0 ? pos - 1 : 0;
+		memmove(parent->keys + i, parent->keys + i + 1, (parent->nr - i - 1) * sizeof(int));
+		memmove(children(t, parent) + pos, children(t, parent) + pos + 1,
+			(parent->nr - pos) * sizeof(struct cnode *));
+		store_nr(parent, parent->nr - 1);
+
+		write_unlock(parent);
+		write_unlock_obsolete(n);
+		fs_epoch_retire(t->epoch, n);
+		return true;
+	}
+
+	if (!upgrade(n, v))
+		return false;
+	memmove(n->keys + i, n->keys + i + 1, (nr - i - 1) * sizeof(int));
+	store_nr(n, nr - 1);
+	write_unlock(n);
+	return true;
+}
+
+void cbtree_delete(struct cbtree *t, int x)
+{
+	unsigned int restarts = 0;
+
+	fs_epoch_enter(t->epoch);
+	while (!try_delete(t, x))
+		backoff(&restarts);
+	fs_epoch_exit(t->epoch);
+}
+
+/*
+   An iterator copies the keys of a leaf at a time, and remembers where the
+   next leaf begins: the separator on the right of the path to the leaf.
+   Between two calls it holds no node, so the tree can change under it.
+ */
+struct cbtree_iter
+{
+	struct cbtree *t;
+	/* the next key to return is at least @from; past INT_MAX, none is left */
+	int64_t from;
+	unsigned int pos;
+	unsigned int nr;
+	int keys[];
+};
+
+struct cbtree_iter* cbtree_iter_start(struct cbtree *t)
+{
+	struct cbtree_iter *i = fs_xmalloc(sizeof(*i) + t->max * sizeof(int));
+
+	i->t = t;
+	i->from = INT_MIN;
+	i->pos = i->nr = 0;
+	return i;
+}
+
+void cbtree_iter_end(struct cbtree_iter *i)
+{
+	fs_xfree(i);
+}
+
+static bool try_fill(struct cbtree_iter *i)
+{
+	struct cbtree *t = i->t;
+	int64_t next = (int64_t)INT_MAX + 1;
+	unsigned int pos, nr, first;
+	struct cnode *n;
+	uint64_t v;
+
+	if (!lock_root(t, &n, &v))
+		return false;
+	while (!n->leaf) {
+		struct cnode *parent = n;
+		uint64_t pv = v;
+
+		nr = load_nr(t, n);
+		if (!descend(t, &n, &v, i->from, &pos))
+			return false;
+		if (pos < nr)
+			next = parent->keys[pos];
+		if (!validate(parent, pv))
+			return false;
+	}
+
+	nr = load_nr(t, n);
+	first = lower_bound(n->keys, nr, i->from);
+	memcpy(i->keys, n->keys + first, (nr - first) * sizeof(int));
+	if (!validate(n, v))
+		return false;
+
+	i->pos = 0;
+	i->nr = nr - first;
+	i->from = next;
+	return true;
+}
+
+bool cbtree_iter_next(struct cbtree_iter *i, int *x)
+{
+	while (i->pos == i->nr) {
+		unsigned int restarts = 0;
+
+		if (i->from > INT_MAX)
+			return false;
+		fs_epoch_enter(i->t->epoch);
+		while (!try_fill(i))
+			backoff(&restarts);
+		fs_epoch_exit(i->t->epoch);
+	}
+
+	*x = i->keys[i->pos++];
+	return true;
+}
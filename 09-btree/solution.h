@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 /**
    Implement a B-tree that holds a set of integers. The tree must
@@ -8,8 +9,19 @@
  */
 struct btree;
 
-/* Allocate an empty btree with node sizes between L and 2*L. */
+/* Allocate an empty btree with node sizes between L and 2*L. Return NULL
+   if L is 0. */
 struct btree* btree_alloc(unsigned int L);
+/* Back the nodes of a tree with huge pages. */
+#define BTREE_HUGE_PAGES 0x1
+/* Allocate every node on its own with malloc(), rather than from slabs of
+   the tree, which are otherwise freed at once with it. */
+#define BTREE_MALLOC 0x2
+
+/* btree_alloc() with a combination of BTREE_* @flags. btree_alloc(L) is
+   btree_alloc_ex(L, 0). */
+struct btree* btree_alloc_ex(unsigned int L, unsigned int flags);
+
 /* Release all memory allocated to @t. */
 void btree_free(struct btree *t);
 
@@ -22,6 +34,42 @@ void btree_delete(struct btree *t, int x);
 /* Test whether @t contains @x, or not. */
 bool btree_contains(struct btree *t, int x);
 
+/* The default of btree_set_fill(): packed nodes. */
+#define BTREE_DEFAULT_FILL 100
+
+/* Fill the nodes btree_bulk_load() builds to @percent of 2*L keys, at
+   least 50: less leaves room for inserts before nodes split. Return 0, or
+   -EINVAL if @percent is out of range. */
+int btree_set_fill(struct btree *t, unsigned int percent);
+
+/* Replace the values in @t with the @n values of @sorted, in ascending
+   order, building the tree bottom-up in linear time. A value repeated in
+   @sorted is inserted once. Return 0, or -EINVAL if @sorted is not sorted. */
+int btree_bulk_load(struct btree *t, const int *sorted, size_t n);
+
+/* btree_insert() and btree_delete() of the @n values of @keys, in any
+   order: they are sorted and then applied in a single pass. */
+void btree_insert_batch(struct btree *t, const int *keys, size_t n);
+void btree_delete_batch(struct btree *t, const int *keys, size_t n);
+
+/* The L for which the keys of a full node fill exactly a 64-byte cache
+   line: a node is then searched with a single pass of vector compares. */
+#define BTREE_LINE_L 8
+
+/* How the keys of a node are searched. */
+enum btree_search
+{
+	/* the best one the CPU supports */
+	BTREE_SEARCH_AUTO,
+	BTREE_SEARCH_SCALAR,
+	BTREE_SEARCH_SSE4,
+	BTREE_SEARCH_AVX2,
+};
+
+/* Search the nodes of @t with @search, BTREE_SEARCH_AUTO by default.
+   Return 0, or -ENOTSUP if the CPU does not support @search. */
+int btree_set_search(struct btree *t, enum btree_search search);
+
 /**
    Implement iteration over all values contained in a B-tree.
    Iterating over a B-tree must return all values in it, sorted
@@ -40,3 +88,41 @@ void btree_iter_end(struct btree_iter *i);
 /* Advance the iterator @i. If @i can be advanced, put the new
    value to @x, and return true. Otherwise, return false. */
 bool btree_iter_next(struct btree_iter *i, int *x);
+
+/* Create an iterator over the values of @t from @lo on, or from @lo to
+   @hi, both included. They go down to @lo directly, rather than past
+   every smaller value. */
+struct btree_iter* btree_iter_seek(struct btree *t, int lo);
+struct btree_iter* btree_iter_range(struct btree *t, int lo, int hi);
+
+/* The number of values of @t from @lo to @hi, both included. The nodes of
+   the tree count the values under them, so this takes as long as a lookup. */
+size_t btree_count_range(struct btree *t, int lo, int hi);
+
+/**
+   A B-tree of integers that threads may change and read at once. Readers
+   take no locks: nodes carry versions, and a read that saw one change
+   starts over. Writers lock the nodes they change, a parent before its
+   child. Nodes taken out of the tree are freed once no thread can still
+   be reading them.
+ */
+struct cbtree;
+
+/* As btree_alloc(). Nodes split at 2*L keys, but are not merged as they
+   empty: a leaf is only dropped once it has no keys. */
+struct cbtree* cbtree_alloc(unsigned int L);
+/* No thread may use @t any more. */
+void cbtree_free(struct cbtree *t);
+
+void cbtree_insert(struct cbtree *t, int x);
+void cbtree_delete(struct cbtree *t, int x);
+bool cbtree_contains(struct cbtree *t, int x);
+
+/* An iterator may run alongside inserts and deletes: it returns values in
+   ascending order, every value in @t from start to end, and maybe some of
+   those inserted or deleted meanwhile. */
+struct cbtree_iter;
+
+struct cbtree_iter* cbtree_iter_start(struct cbtree *t);
+void cbtree_iter_end(struct cbtree_iter *i);
+bool cbtree_iter_next(struct cbtree_iter *i, int *x);
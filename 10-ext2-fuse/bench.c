@@ -0,0 +1,195 @@
+#include <solution.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+   use: ./bench.out [dir] [size]
+
+   Builds an ext2 image with a single file of size bytes (1G by default; K,
+   M and G suffixes are understood) in dir with mke2fs, mounts it on
+   dir/bench.mnt with ext2fuse_ex(), with and without EXT2FUSE_SPLICE, and
+   reads the file through the mount with dd at a few block sizes. The image
+   is mounted again and its page cache dropped before every run, so the
+   numbers are those of a cold image; the CPU time is that of dd and of the
+   file system, which runs in a child process.
+ */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double tv_seconds(const struct timeval *u, const struct timeval *s)
+{
+	return u->tv_sec + s->tv_sec + (u->tv_usec + s->tv_usec) * 1e-6;
+}
+
+/* User and system CPU time of the children waited for so far, in seconds. */
+static double children_cpu_time(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_CHILDREN, &ru);
+	return tv_seconds(&ru.ru_utime, &ru.ru_stime);
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		n <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+	return n;
+}
+
+static void make_input(int fd, size_t size)
+{
+	size_t chunk = size < (1 << 20) ? size : (1 << 20);
+	char *buf = malloc(chunk);
+	if (buf == NULL)
+		errx(1, "malloc() failed");
+
+	for (size_t i = 0; i < chunk; ++i)
+		buf[i] = rand();
+	for (size_t off = 0; off < size; off += chunk) {
+		size_t n = size - off < chunk ? size - off : chunk;
+		if (pwrite(fd, buf, n, off) != (ssize_t)n)
+			err(1, "pwrite() failed");
+	}
+	free(buf);
+}
+
+/* Build an image at @img_path holding a file "data" of @size bytes. */
+static void make_image(const char *dir, const char *img_path, size_t size)
+{
+	char src_dir[4096], src_path[4096], cmd[3 * 4096];
+	int fd, r;
+
+	snprintf(src_dir, sizeof(src_dir), "%s/bench.src", dir);
+	snprintf(src_path, sizeof(src_path), "%s/bench.src/data", dir);
+	if (mkdir(src_dir, S_IRWXU) < 0 && access(src_dir, F_OK) < 0)
+		err(1, "mkdir() failed");
+	if ((fd = open(src_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0)
+		err(1, "open() failed");
+	make_input(fd, size);
+	close(fd);
+
+	/* room for the block map and the rest of the metadata */
+	snprintf(cmd, sizeof(cmd), "mke2fs -q -F -t ext2 -b 4096 -d '%s' '%s' %zuk >/dev/null",
+		 src_dir, img_path, (size + size / 32 + (64 << 20)) >> 10);
+	r = system(cmd);
+	unlink(src_path);
+	rmdir(src_dir);
+	if (r != 0)
+		errx(1, "%s failed", cmd);
+}
+
+/* Mount @img_path on @mnt in a child process, and wait for it to be up. */
+static pid_t mount_image(const char *img_path, const char *mnt, unsigned int flags)
+{
+	struct stat parent, root;
+	char up[4096 + 8];
+	pid_t pid;
+	int img;
+
+	if ((img = open(img_path, O_RDONLY)) < 0)
+		err(1, "open() failed");
+	/* the mount is served from the page cache of the image: start cold */
+	posix_fadvise(img, 0, 0, POSIX_FADV_DONTNEED);
+
+	if ((pid = fork()) < 0)
+		err(1, "fork() failed");
+	if (pid == 0)
+		_exit(ext2fuse_ex(img, mnt, flags) == 0 ? 0 : 1);
+	close(img);
+
+	/* the mount point moves to another device once it is mounted */
+	snprintf(up, sizeof(up), "%s/..", mnt);
+	if (stat(up, &parent) < 0)
+		err(1, "stat() failed");
+	for (int i = 0; i < 10000; ++i) {
+		if (stat(mnt, &root) == 0 && root.st_dev != parent.st_dev)
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			errx(1, "ext2fuse_ex() failed to mount %s", mnt);
+		usleep(1000);
+	}
+	errx(1, "timed out waiting for %s to be mounted", mnt);
+}
+
+/* Unmount the file system of @pid, and return the CPU time it used. */
+static double unmount_image(pid_t pid)
+{
+	struct rusage ru;
+	int status;
+
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &ru) < 0)
+		err(1, "wait4() failed");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		warnx("ext2fuse_ex() exited with status %#x", status);
+	return tv_seconds(&ru.ru_utime, &ru.ru_stime);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *block_sizes[] = {"128K", "1M", "8M"};
+	const char *dir = argc > 1 ? argv[1] : ".";
+	const char *size_arg = argc > 2 ? argv[2] : "1G";
+	size_t size = parse_size(size_arg);
+	char img_path[4096], mnt[4096], cmd[3 * 4096];
+
+	snprintf(img_path, sizeof(img_path), "%s/bench.img", dir);
+	snprintf(mnt, sizeof(mnt), "%s/bench.mnt", dir);
+	if (mkdir(mnt, S_IRWXU) < 0 && errno != EEXIST)
+		err(1, "mkdir() failed");
+	make_image(dir, img_path, size);
+
+	printf("%-8s %8s %6s %10s %10s %10s\n", "mode", "size", "bs", "GB/s", "dd CPU s",
+	       "fs CPU s");
+	for (int splice = 0; splice <= 1; ++splice) {
+		for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); ++i) {
+			pid_t pid = mount_image(img_path, mnt, splice ? EXT2FUSE_SPLICE : 0);
+
+			snprintf(cmd, sizeof(cmd), "dd if='%s/data' of=/dev/null bs=%s 2>/dev/null",
+				 mnt, block_sizes[i]);
+			double start = now(), cpu = children_cpu_time();
+			int r = system(cmd);
+			double elapsed = now() - start;
+			cpu = children_cpu_time() - cpu;
+			double fs_cpu = unmount_image(pid);
+
+			if (r != 0)
+				printf("%-8s %8s %6s %10s (dd failed)\n", splice ? "splice" : "copy",
+				       size_arg, block_sizes[i], "-");
+			else
+				printf("%-8s %8s %6s %10.2f %10.3f %10.3f\n", splice ? "splice" : "copy",
+				       size_arg, block_sizes[i], size / elapsed / 1e9, cpu, fs_cpu);
+		}
+	}
+
+	rmdir(mnt);
+	unlink(img_path);
+	return 0;
+}
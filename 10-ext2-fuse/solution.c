@@ -1,15 +1,459 @@
 #include <solution.h>
+#include <fs_ext2.h>
+#include <fs_malloc.h>
 
 #include <fuse.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+/*
+ * An open file: its inode, and the index of its block map, built at open()
+ * so that reads at random offsets do not walk indirect blocks again.
+ */
+struct open_file
+{
+	struct ext2_inode inode;
+	struct fs_ext2_index index;
+};
+
+/* What a mount serves: the image, and the EXT2FUSE_* flags it was made with. */
+struct mount
+{
+	struct fs_ext2 fs;
+	unsigned int flags;
+};
+
+static struct mount* get_mount(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct fs_ext2* get_fs(void)
+{
+	return &get_mount()->fs;
+}
+
+static void fill_stat(struct fs_ext2 *fs, uint32_t ino, const struct ext2_inode *inode,
+		      struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = ino;
+	st->st_mode = inode->i_mode;
+	st->st_nlink = inode->i_links_count;
+	st->st_uid = inode->i_uid;
+	st->st_gid = inode->i_gid;
+	st->st_size = ext2_inode_size(inode);
+	st->st_blksize = fs->block_size;
+	st->st_blocks = inode->i_blocks;
+	st->st_atime = inode->i_atime;
+	st->st_mtime = inode->i_mtime;
+	st->st_ctime = inode->i_ctime;
+}
+
+static void* ext2_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct mount *m = get_mount();
+
+	cfg->use_ino = 1;
+	cfg->kernel_cache = 1;
+	/* let libfuse splice the ranges of the image returned by read_buf */
+	if (m->flags & EXT2FUSE_SPLICE)
+		conn->want |= conn->capable & FUSE_CAP_SPLICE_WRITE;
+	return m;
+}
+
+static int ext2_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	struct fs_ext2 *fs = get_fs();
+	struct ext2_inode inode;
+	uint32_t ino;
+	int r;
+	(void) fi;
+
+	if ((r = fs_ext2_namei(fs, path, &ino, &inode)) < 0)
+		return r;
+	fill_stat(fs, ino, &inode, st);
+	return 0;
+}
+
+static int ext2_readlink(const char *path, char *buf, size_t size)
+{
+	struct fs_ext2 *fs = get_fs();
+	struct ext2_inode inode;
+	uint32_t ino;
+	ssize_t r;
+
+	if (size == 0)
+		return -EINVAL;
+	if ((r = fs_ext2_namei(fs, path, &ino, &inode)) < 0)
+		return r;
+	if ((r = fs_ext2_readlink(fs, &inode, buf, size - 1)) < 0)
+		return r;
+
+	buf[r] = '\0';
+	return 0;
+}
+
+static int ext2_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fs_ext2 *fs = get_fs();
+	struct open_file *f;
+	uint32_t ino;
+	int r;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+
+	f = fs_xzalloc(sizeof(*f));
+	if ((r = fs_ext2_namei(fs, path, &ino, &f->inode)) == 0 &&
+	    (f->inode.i_mode & EXT2_S_IFMT) == EXT2_S_IFDIR)
+		r = -EISDIR;
+	if (r == 0)
+		r = fs_ext2_index_build(fs, &f->inode, &f->index);
+	if (r < 0) {
+		fs_xfree(f);
+		return r;
+	}
+
+	fi->fh = (uintptr_t)f;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int ext2_read(const char *path, char *buf, size_t size, off_t off,
+		     struct fuse_file_info *fi)
+{
+	struct open_file *f = (struct open_file *)(uintptr_t)fi->fh;
+	(void) path;
+
+	return fs_ext2_read_indexed(get_fs(), &f->inode, &f->index, buf, size, off);
+}
+
+/*
+ * Describe @size bytes of @f from @off on, all of them within the file, as
+ * a buffer per run of blocks, that points at the run in the image, and a
+ * zeroed buffer per hole. Return the number of buffers; @bufs may be NULL
+ * to only count them.
+ */
+static size_t map_range(struct fs_ext2 *fs, const struct open_file *f, size_t size,
+			uint64_t off, struct fuse_buf *bufs)
+{
+	uint32_t bs = fs->block_size;
+	size_t done = 0, n = 0;
+
+	for (; done < size; ++n) {
+		uint64_t pos = off + done;
+		uint32_t skip = pos % bs;
+		uint64_t want = (skip + (size - done) + bs - 1) / bs;
+		uint32_t pblk, nr;
+		size_t len;
+
+		fs_ext2_index_map(&f->index, pos / bs, want < UINT32_MAX ? want : UINT32_MAX,
+				  &pblk, &nr);
+		len = (uint64_t)nr * bs - skip < size - done ? (uint64_t)nr * bs - skip : size - done;
+		done += len;
+		if (bufs == NULL)
+			continue;
+
+		bufs[n] = (struct fuse_buf){.size = len, .fd = -1};
+		if (pblk == 0) {
+			bufs[n].mem = fs_xzalloc(len);
+		} else {
+			bufs[n].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			bufs[n].fd = fs->fd;
+			bufs[n].pos = (uint64_t)pblk * bs + skip;
+		}
+	}
+	return n;
+}
+
+/*
+ * Reply with where the data is rather than with the data: libfuse then
+ * splices it from the image into /dev/fuse, without it being copied into
+ * user space, or preads it straight into the reply if it cannot splice.
+ */
+static int ext2_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off,
+			 struct fuse_file_info *fi)
+{
+	struct open_file *f = (struct open_file *)(uintptr_t)fi->fh;
+	struct fs_ext2 *fs = get_fs();
+	uint64_t end = ext2_inode_size(&f->inode);
+	struct fuse_bufvec *v;
+	size_t n;
+	(void) path;
+
+	if ((uint64_t)off >= end)
+		size = 0;
+	else if (size > end - off)
+		size = end - off;
+
+	/* libfuse frees the vector, and its memory buffers, with free() */
+	n = map_range(fs, f, size, off, NULL);
+	v = fs_xzalloc(sizeof(*v) + (n > 1 ? n - 1 : 0) * sizeof(v->buf[0]));
+	v->count = 1;
+	v->buf[0].fd = -1;
+	if (n > 0)
+		v->count = map_range(fs, f, size, off, v->buf);
+
+	*bufp = v;
+	return 0;
+}
+
+static int ext2_release(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file *f = (struct open_file *)(uintptr_t)fi->fh;
+	(void) path;
+
+	fs_ext2_index_free(&f->index);
+	fs_xfree(f);
+	return 0;
+}
+
+/*
+ * Entries are passed with the offset to resume after them, so a directory
+ * too large for one reply is picked up where the last one stopped rather
+ * than read from the start again.
+ */
+static int ext2_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off,
+			struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	struct fs_ext2 *fs = get_fs();
+	const struct ext2_dir_entry_2 *de;
+	char name[EXT2_NAME_LEN + 1];
+	struct ext2_inode inode;
+	struct fs_ext2_dir d;
+	uint64_t pos;
+	uint32_t ino;
+	int r;
+	(void) fi;
+	(void) flags;
+
+	if ((r = fs_ext2_namei(fs, path, &ino, &inode)) < 0)
+		return r;
+	if ((r = fs_ext2_dir_open(fs, &inode, &d)) < 0)
+		return r;
+
+	fs_ext2_dir_seek(&d, off);
+	while ((r = fs_ext2_dir_next(&d, &de, &pos)) > 0) {
+		memcpy(name, de->name, de->name_len);
+		name[de->name_len] = '\0';
+		/* the reply is full */
+		if (filler(buf, name, NULL, fs_ext2_dir_tell(&d), 0) != 0) {
+			r = 0;
+			break;
+		}
+	}
+
+	fs_ext2_dir_close(&d);
+	return r;
+}
+
+static int ext2_statfs(const char *path, struct statvfs *st)
+{
+	struct fs_ext2 *fs = get_fs();
+	(void) path;
+
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = st->f_frsize = fs->block_size;
+	st->f_blocks = fs->sb.s_blocks_count;
+	st->f_bfree = st->f_bavail = fs->sb.s_free_blocks_count;
+	st->f_files = fs->sb.s_inodes_count;
+	st->f_ffree = st->f_favail = fs->sb.s_free_inodes_count;
+	st->f_namemax = EXT2_NAME_LEN;
+	st->f_flag = ST_RDONLY;
+	return 0;
+}
+
+/* Everything that would change the image. */
+
+static int ext2_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) mode;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	(void) path;
+	(void) mode;
+	(void) dev;
+	return -EROFS;
+}
+
+static int ext2_mkdir(const char *path, mode_t mode)
+{
+	(void) path;
+	(void) mode;
+	return -EROFS;
+}
+
+static int ext2_remove(const char *path)
+{
+	(void) path;
+	return -EROFS;
+}
+
+static int ext2_link(const char *from, const char *to)
+{
+	(void) from;
+	(void) to;
+	return -EROFS;
+}
+
+static int ext2_rename(const char *from, const char *to, unsigned int flags)
+{
+	(void) from;
+	(void) to;
+	(void) flags;
+	return -EROFS;
+}
+
+static int ext2_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) mode;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) uid;
+	(void) gid;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) size;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_write(const char *path, const char *buf, size_t size, off_t off,
+		      struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) buf;
+	(void) size;
+	(void) off;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) tv;
+	(void) fi;
+	return -EROFS;
+}
+
+static int ext2_setxattr(const char *path, const char *name, const char *value,
+			 size_t size, int flags)
+{
+	(void) path;
+	(void) name;
+	(void) value;
+	(void) size;
+	(void) flags;
+	return -EROFS;
+}
+
+static int ext2_removexattr(const char *path, const char *name)
+{
+	(void) path;
+	(void) name;
+	return -EROFS;
+}
 
 static const struct fuse_operations ext2_ops = {
-	/* implement me */
+	.init = ext2_init,
+	.getattr = ext2_getattr,
+	.readlink = ext2_readlink,
+	.open = ext2_open,
+	.read = ext2_read,
+	.read_buf = ext2_read_buf,
+	.release = ext2_release,
+	.readdir = ext2_readdir,
+	.statfs = ext2_statfs,
+
+	.create = ext2_create,
+	.mknod = ext2_mknod,
+	.mkdir = ext2_mkdir,
+	.unlink = ext2_remove,
+	.rmdir = ext2_remove,
+	.symlink = ext2_link,
+	.link = ext2_link,
+	.rename = ext2_rename,
+	.chmod = ext2_chmod,
+	.chown = ext2_chown,
+	.truncate = ext2_truncate,
+	.write = ext2_write,
+	.utimens = ext2_utimens,
+	.setxattr = ext2_setxattr,
+	.removexattr = ext2_removexattr,
 };
 
-int ext2fuse(int img, const char *mntp)
+/*
+ * Requests are served by several threads at once. Blocks of the image are
+ * pread() into buffers of the thread that needs them, and inodes and
+ * directory entries are cached with locks split across many inodes and
+ * directories, so readers of different files do not wait for each other;
+ * reads of open files go straight to the image through their index.
+ */
+int ext2fuse_ex(int img, const char *mntp, unsigned int flags)
 {
-	(void) img;
+	char *argv[] = {"exercise", NULL};
+	struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+	struct fuse_operations ops = ext2_ops;
+	struct fuse_session *se;
+	struct mount m = {.flags = flags};
+	struct fuse *f;
+	int r;
+
+	if ((r = fs_ext2_open_direct(&m.fs, img)) < 0)
+		return r;
+	m.fs.dcache = fs_dcache_alloc(0);
+	m.fs.icache = fs_icache_alloc(0);
 
-	char *argv[] = {"exercise", "-f", (char *)mntp, NULL};
-	return fuse_main(3, argv, &ext2_ops, NULL);
+	/* without splicing, data is read by ext2_read() as it always was */
+	if (!(flags & EXT2FUSE_SPLICE))
+		ops.read_buf = NULL;
+
+	r = 1;
+	if ((f = fuse_new(&args, &ops, sizeof(ops), &m)) == NULL)
+		goto out;
+	if (fuse_mount(f, mntp) != 0)
+		goto out_destroy;
+
+	se = fuse_get_session(f);
+	if (fuse_set_signal_handlers(se) == 0) {
+		/* a /dev/fuse clone per thread: no contention on reading requests */
+		r = fuse_loop_mt(f, 1);
+		fuse_remove_signal_handlers(se);
+	}
+	fuse_unmount(f);
+
+out_destroy:
+	fuse_destroy(f);
+out:
+	fs_icache_free(m.fs.icache);
+	fs_dcache_free(m.fs.dcache);
+	fs_ext2_close(&m.fs);
+	return r;
+}
+
+int ext2fuse(int img, const char *mntp)
+{
+	return ext2fuse_ex(img, mntp, EXT2FUSE_SPLICE);
 }
@@ -9,3 +9,14 @@
    Any attempt write to the FS must report EROFS.
 */
 int ext2fuse(int img, const char *mntp);
+
+/* Reply to reads with ranges of @img rather than with their data, so that
+   the kernel splices the data from the page cache of the image into the
+   reply, and it is never copied through user space. */
+#define EXT2FUSE_SPLICE 0x1
+
+/**
+   ext2fuse() with a combination of EXT2FUSE_* @flags. ext2fuse(img, mntp)
+   is ext2fuse_ex(img, mntp, EXT2FUSE_SPLICE).
+*/
+int ext2fuse_ex(int img, const char *mntp, unsigned int flags);
@@ -1,51 +1,327 @@
 #include <solution.h>
 #include <fs_malloc.h>
+#include <fs_ext2.h>
+#include <fs_pool.h>
 
 #include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Bytes of an inode table read at once by ext2_scan_inodes(). */
+#define SCAN_CHUNK (1 << 20)
 
 struct ext2_fs
 {
-	/* implement me */
+	struct fs_ext2 ext2;
 };
 
+/*
+ * Walks logical blocks in order. Before the first data block that an
+ * indirect block maps, the indirect blocks on the way to it (at most one
+ * per level, three with the triple-indirect block) are queued in @meta and
+ * returned first, as a sequential read would fetch them.
+ */
 struct ext2_blkiter
 {
-	/* implement me */
+	struct ext2_fs *fs;
+	struct ext2_inode inode;
+	uint32_t lblk;
+	uint32_t nr_blocks;
+
+	bool queued;
+	uint32_t meta[3];
+	unsigned int nr_meta;
+	unsigned int next_meta;
 };
 
+static int fs_init(struct ext2_fs **fs, int fd, bool mapped)
+{
+	struct ext2_fs *x = fs_xzalloc(sizeof(*x));
+	int r;
+
+	r = mapped ? fs_ext2_open_mmap(&x->ext2, fd) : fs_ext2_open(&x->ext2, fd, 0);
+	if (r < 0) {
+		fs_xfree(x);
+		return r;
+	}
+
+	*fs = x;
+	return 0;
+}
+
 int ext2_fs_init(struct ext2_fs **fs, int fd)
 {
-	/* implement me */
-	(void) fs;
-	(void) fd;
-	return -EOPNOTSUPP;
+	return fs_init(fs, fd, false);
+}
+
+int ext2_fs_init_mmap(struct ext2_fs **fs, int fd)
+{
+	return fs_init(fs, fd, true);
 }
 
 void ext2_fs_free(struct ext2_fs *fs)
 {
-	/* implement me */
-	(void) fs;
+	if (fs == NULL)
+		return;
+
+	fs_ext2_close(&fs->ext2);
+	close(fs->ext2.fd);
+	fs_xfree(fs);
 }
 
 int ext2_blkiter_init(struct ext2_blkiter **i, struct ext2_fs *fs, int ino)
 {
-	/* implement me */
-	(void) i;
-	(void) fs;
-	(void) ino;
-	return -EOPNOTSUPP;
+	struct ext2_blkiter *x;
+	int r;
+
+	if (ino <= 0)
+		return -EINVAL;
+	if ((r = fs_ext2_inode_in_use(&fs->ext2, ino)) < 0)
+		return r;
+	if (r == 0)
+		return -ENOENT;
+
+	x = fs_xzalloc(sizeof(*x));
+	x->fs = fs;
+	if ((r = fs_ext2_read_inode(&fs->ext2, ino, &x->inode)) < 0) {
+		fs_xfree(x);
+		return r;
+	}
+
+	/* fast symlinks keep their target in i_block, and own no blocks; a
+	   file that is all hole has none either, but still spans its size */
+	if (!fs_ext2_fast_symlink(&fs->ext2, &x->inode))
+		x->nr_blocks = (ext2_inode_size(&x->inode) + fs->ext2.block_size - 1) /
+			fs->ext2.block_size;
+
+	*i = x;
+	return 0;
 }
 
-int ext2_blkiter_next(struct ext2_blkiter *i, int *blkno)
+/* Return in @out entry @idx of the indirect block @blkno. */
+static int read_entry(struct fs_ext2 *fs, uint32_t blkno, uint32_t idx, uint32_t *out)
 {
-	/* implement me */
-	(void) i;
-	(void) blkno;
+	struct fs_ext2_block b;
+	int r;
+
+	if (blkno == 0 || blkno >= fs->sb.s_blocks_count)
+		return -EPROTO;
+	if ((r = fs_ext2_get_block(fs, blkno, &b)) < 0)
+		return r;
+	*out = ((const uint32_t *)b.data)[idx];
+	fs_ext2_put_block(fs, &b);
 	return 0;
 }
 
+/* Queue the indirect blocks that are read first when @i gets to its @lblk. */
+static int queue_meta(struct ext2_blkiter *i)
+{
+	struct fs_ext2 *fs = &i->fs->ext2;
+	uint64_t apb = fs->addr_per_block;
+	uint64_t x = i->lblk;
+	uint32_t dind;
+	int r;
+
+	i->nr_meta = i->next_meta = 0;
+
+	if (x < EXT2_NDIR_BLOCKS)
+		return 0;
+	x -= EXT2_NDIR_BLOCKS;
+
+	if (x < apb) {
+		if (x == 0)
+			i->meta[i->nr_meta++] = i->inode.i_block[EXT2_IND_BLOCK];
+		return 0;
+	}
+	x -= apb;
+
+	if (x < apb * apb) {
+		dind = i->inode.i_block[EXT2_DIND_BLOCK];
+		if (x == 0)
+			i->meta[i->nr_meta++] = dind;
+	} else if ((x -= apb * apb) < apb * apb * apb) {
+		uint32_t tind = i->inode.i_block[EXT2_TIND_BLOCK];
+		if (x % apb != 0)
+			return 0;
+		if (x == 0)
+			i->meta[i->nr_meta++] = tind;
+		if ((r = read_entry(fs, tind, x / (apb * apb), &dind)) < 0)
+			return r;
+		if (x % (apb * apb) == 0)
+			i->meta[i->nr_meta++] = dind;
+		x %= apb * apb;
+	} else {
+		return -EFBIG;
+	}
+
+	if (x % apb != 0)
+		return 0;
+	if ((r = read_entry(fs, dind, x / apb, &i->meta[i->nr_meta])) < 0)
+		return r;
+	i->nr_meta++;
+	return 0;
+}
+
+int ext2_blkiter_next(struct ext2_blkiter *i, int *blkno)
+{
+	struct fs_ext2 *fs = &i->fs->ext2;
+	uint32_t pblk;
+	int r;
+
+	if (i->lblk >= i->nr_blocks)
+		return 0;
+
+	if (!i->queued) {
+		if ((r = queue_meta(i)) < 0)
+			return r;
+		i->queued = true;
+	}
+
+	if (i->next_meta < i->nr_meta) {
+		pblk = i->meta[i->next_meta++];
+		if (pblk == 0 || pblk >= fs->sb.s_blocks_count)
+			return -EPROTO;
+		*blkno = pblk;
+		return 1;
+	}
+
+	if ((r = fs_ext2_bmap(fs, &i->inode, i->lblk, &pblk)) < 0)
+		return r;
+	if (pblk == 0)
+		return -EPROTO;
+
+	i->lblk++;
+	i->queued = false;
+	*blkno = pblk;
+	return 1;
+}
+
+int ext2_blkiter_next_run(struct ext2_blkiter *i, int *start, int *len)
+{
+	uint32_t pblk, n;
+	int r;
+
+	if (i->lblk >= i->nr_blocks)
+		return 0;
+	if ((r = fs_ext2_bmap_run(&i->fs->ext2, &i->inode, i->lblk, i->nr_blocks - i->lblk,
+				  &pblk, &n)) < 0)
+		return r;
+
+	i->lblk += n;
+	i->queued = false;
+	*start = pblk;
+	*len = n;
+	return 1;
+}
+
 void ext2_blkiter_free(struct ext2_blkiter *i)
 {
-	/* implement me */
-	(void) i;
+	fs_xfree(i);
+}
+
+struct scan
+{
+	struct ext2_fs *fs;
+	ext2_inode_fn fn;
+	void *arg;
+	/* per-worker chunks of inode tables, when the image is not mapped */
+	char **bufs;
+	/* the first error, or non-zero return of @fn */
+	_Atomic int ret;
+};
+
+static bool bit_set(const uint8_t *bitmap, uint32_t bit)
+{
+	return bitmap[bit / 8] >> (bit % 8) & 1;
+}
+
+/*
+   Call @s->fn for the used inodes of @group, reading its inode table a
+   chunk at a time. Chunks without a used inode are skipped, and a chunk is
+   only read up to its last used inode.
+ */
+static int scan_group(struct scan *s, uint32_t group, char **buf)
+{
+	struct fs_ext2 *fs = &s->fs->ext2;
+	uint32_t ipg = fs->sb.s_inodes_per_group;
+	uint32_t per_chunk = SCAN_CHUNK / fs->inode_size;
+	struct ext2_group_desc gd;
+	struct fs_ext2_block b;
+	const uint8_t *bitmap;
+	int r;
+
+	if ((r = fs_ext2_read_group_desc(fs, group, &gd)) < 0)
+		return r;
+	if ((r = fs_ext2_get_block(fs, gd.bg_inode_bitmap, &b)) < 0)
+		return r;
+	bitmap = b.data;
+
+	uint64_t table = (uint64_t)gd.bg_inode_table * fs->block_size;
+	fs_ext2_advise(fs, table, (uint64_t)ipg * fs->inode_size, MADV_WILLNEED);
+
+	for (uint32_t first = 0; first < ipg && r == 0; first += per_chunk) {
+		uint32_t n = ipg - first < per_chunk ? ipg - first : per_chunk;
+		uint64_t off = table + (uint64_t)first * fs->inode_size;
+		const char *data;
+
+		while (n > 0 && !bit_set(bitmap, first + n - 1))
+			n--;
+		if (n == 0)
+			continue;
+
+		if (fs->map != NULL) {
+			if (off + (uint64_t)n * fs->inode_size > fs->map_size) {
+				r = -EIO;
+				break;
+			}
+			data = fs->map + off;
+		} else {
+			if (*buf == NULL)
+				*buf = fs_xmalloc(SCAN_CHUNK);
+			if ((r = fs_ext2_read_image(fs, *buf, (size_t)n * fs->inode_size, off)) < 0)
+				break;
+			data = *buf;
+		}
+
+		for (uint32_t i = 0; i < n && r == 0; ++i) {
+			uint64_t ino = (uint64_t)group * ipg + first + i + 1;
+
+			if (ino > fs->sb.s_inodes_count)
+				break;
+			if (bit_set(bitmap, first + i))
+				r = s->fn(s->arg, ino, (const void *)(data + (size_t)i * fs->inode_size));
+		}
+	}
+
+	fs_ext2_put_block(fs, &b);
+	return r;
+}
+
+static void scan_job(void *arg, unsigned int worker, size_t group)
+{
+	struct scan *s = arg;
+	int r, expected = 0;
+
+	if (atomic_load_explicit(&s->ret, memory_order_relaxed) != 0)
+		return;
+	if ((r = scan_group(s, group, &s->bufs[worker])) != 0)
+		atomic_compare_exchange_strong(&s->ret, &expected, r);
+}
+
+int ext2_scan_inodes(struct ext2_fs *fs, unsigned int nr_workers, ext2_inode_fn fn, void *arg)
+{
+	struct scan s = {.fs = fs, .fn = fn, .arg = arg};
+
+	if (nr_workers == 0)
+		nr_workers = fs_pool_default_workers();
+
+	s.bufs = fs_xzalloc(nr_workers * sizeof(*s.bufs));
+	fs_pool_run(nr_workers, fs->ext2.nr_groups, 1, scan_job, &s);
+
+	for (unsigned int i = 0; i < nr_workers; ++i)
+		fs_xfree(s.bufs[i]);
+	fs_xfree(s.bufs);
+	return atomic_load(&s.ret);
 }
@@ -2,6 +2,7 @@
 
 struct ext2_fs;
 struct ext2_blkiter;
+struct ext2_inode;
 
 /**
    Allocate and initialise the reader of an ext2 file system. An image
@@ -14,6 +15,14 @@ struct ext2_blkiter;
  */
 int ext2_fs_init(struct ext2_fs **fs, int fd);
 
+/**
+   Like ext2_fs_init(), but map the whole image read-only: metadata is
+   parsed where it lies in the mapping instead of being copied into a
+   cache. Fails with -ENODEV (or another errno code) if @fd cannot be
+   mapped.
+ */
+int ext2_fs_init_mmap(struct ext2_fs **fs, int fd);
+
 /**
    Free resources associated with an ext2 reader @fs.
 
@@ -49,9 +58,42 @@ int ext2_blkiter_init(struct ext2_blkiter **i, struct ext2_fs *fs, int ino);
  */
 int ext2_blkiter_next(struct ext2_blkiter *i, int *blkno);
 
+/**
+   Advance the iterator over a run of data blocks at once: @len blocks that
+   follow each other both in the file and on disk, from block @start on, or
+   a hole of @len blocks, for which @start is 0. Indirect blocks are not
+   reported, and the runs of a sparse inode cover its holes too.
+
+   Return values are the same as for ext2_blkiter_next().
+ */
+int ext2_blkiter_next_run(struct ext2_blkiter *i, int *start, int *len);
+
 /**
    Free resources associated with an iterator @i.
 
    Note: ext2_blkiter_free(NULL) is a no-op.
  */
 void ext2_blkiter_free(struct ext2_blkiter *i);
+
+/**
+   Called by ext2_scan_inodes() with every inode in use, @ino being its
+   number. @inode is only good until the call returns. A non-zero return
+   value stops the scan.
+ */
+typedef int (*ext2_inode_fn)(void *arg, int ino, const struct ext2_inode *inode);
+
+/**
+   Call @fn for every inode marked as used in the inode bitmaps of @fs,
+   reserved inodes included. Block groups are scanned by @nr_workers
+   threads (0 means one per CPU), a group per thread at a time: its inode
+   bitmap is read first, then its inode table in large sequential reads
+   that skip the unused parts. @fn is thus called from several threads at
+   once, in increasing inode order within a group only.
+
+   Return values:
+   * 0 if successful,
+   * the first non-zero value returned by @fn,
+   * a (negative) errno code if an IO error occurred,
+   * -EPROTO if a group descriptor is corrupted.
+ */
+int ext2_scan_inodes(struct ext2_fs *fs, unsigned int nr_workers, ext2_inode_fn fn, void *arg);
@@ -0,0 +1,335 @@
+#include <fs_bcache.h>
+#include <fs_malloc.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Initial read-ahead window, in blocks, after two consecutive misses. */
+#define RA_MIN 4
+
+enum buf_state
+{
+	/* not in the hash table: holds no block */
+	BUF_FREE,
+	/* in the hash table, and being read by the thread that missed it */
+	BUF_LOADING,
+	BUF_VALID,
+	/* valid, read ahead, and not looked up yet */
+	BUF_READAHEAD,
+	/* a buffer of its own given out when every cached one is pinned */
+	BUF_PRIVATE,
+};
+
+struct fs_bcache
+{
+	int fd;
+	size_t block_size;
+	size_t nr_blocks;
+
+	pthread_mutex_t lock;
+	/* broadcast whenever buffers leave BUF_LOADING */
+	pthread_cond_t loaded;
+
+	struct fs_bcache_buf **hash;
+	size_t hash_mask;
+	unsigned int hash_shift;
+
+	/* Unpinned buffers: the most recently used one follows @lru, and
+	   the next one to recycle precedes it. Free buffers go last. */
+	struct fs_bcache_buf lru;
+
+	/* the block after the last read, and the current read-ahead window */
+	uint64_t ra_next;
+	unsigned int ra_window;
+	unsigned int ra_max;
+
+	struct fs_bcache_stats stats;
+
+	struct fs_bcache_buf *bufs;
+	char *data;
+};
+
+static size_t hash_slot(const struct fs_bcache *c, uint64_t blkno)
+{
+	/* Fibonacci hashing: neighbouring blocks land far apart */
+	return (blkno * 0x9E3779B97F4A7C15ull) >> c->hash_shift & c->hash_mask;
+}
+
+static struct fs_bcache_buf* hash_find(struct fs_bcache *c, uint64_t blkno)
+{
+	struct fs_bcache_buf *b = c->hash[hash_slot(c, blkno)];
+	while (b != NULL && b->blkno != blkno)
+		b = b->hash_next;
+	return b;
+}
+
+static void hash_insert(struct fs_bcache *c, struct fs_bcache_buf *b)
+{
+	struct fs_bcache_buf **head = &c->hash[hash_slot(c, b->blkno)];
+	b->hash_next = *head;
+	*head = b;
+}
+
+static void hash_remove(struct fs_bcache *c, struct fs_bcache_buf *b)
+{
+	struct fs_bcache_buf **p = &c->hash[hash_slot(c, b->blkno)];
+	while (*p != b)
+		p = &(*p)->hash_next;
+	*p = b->hash_next;
+}
+
+static void lru_unlink(struct fs_bcache_buf *b)
+{
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_insert(struct fs_bcache_buf *after, struct fs_bcache_buf *b)
+{
+	b->lru_prev = after;
+	b->lru_next = after->lru_next;
+	after->lru_next->lru_prev = b;
+	after->lru_next = b;
+}
+
+/* Drop a reference to @b; the last one puts it back on the LRU list. */
+static void release(struct fs_bcache *c, struct fs_bcache_buf *b)
+{
+	if (--b->refs > 0)
+		return;
+
+	if (b->state == BUF_PRIVATE)
+		fs_xfree(b);
+	else if (b->state == BUF_FREE)
+		lru_insert(c->lru.lru_prev, b);
+	else
+		lru_insert(&c->lru, b);
+}
+
+/* Take the least recently used unpinned buffer out of the cache. */
+static struct fs_bcache_buf* recycle(struct fs_bcache *c)
+{
+	struct fs_bcache_buf *b = c->lru.lru_prev;
+
+	if (b == &c->lru)
+		return NULL;
+
+	lru_unlink(b);
+	if (b->state != BUF_FREE)
+		hash_remove(c, b);
+	b->state = BUF_FREE;
+	return b;
+}
+
+struct fs_bcache* fs_bcache_alloc(int fd, size_t block_size, size_t nr_blocks)
+{
+	struct fs_bcache *c = fs_xzalloc(sizeof(*c));
+	size_t hash_size = 1;
+	unsigned int bits = 0;
+
+	if (nr_blocks == 0)
+		nr_blocks = 1;
+	while (hash_size < 2 * nr_blocks) {
+		hash_size <<= 1;
+		bits++;
+	}
+
+	c->fd = fd;
+	c->block_size = block_size;
+	c->nr_blocks = nr_blocks;
+	c->hash = fs_xzalloc(hash_size * sizeof(*c->hash));
+	c->hash_mask = hash_size - 1;
+	c->hash_shift = 64 - (bits ? bits : 1);
+	c->ra_max = nr_blocks / 4 < FS_BCACHE_RA_MAX ? nr_blocks / 4 : FS_BCACHE_RA_MAX;
+	c->ra_next = UINT64_MAX;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->loaded, NULL);
+
+	c->lru.lru_prev = c->lru.lru_next = &c->lru;
+	c->bufs = fs_xzalloc(nr_blocks * sizeof(*c->bufs));
+	c->data = fs_xmalloc(nr_blocks * block_size);
+	for (size_t i = 0; i < nr_blocks; ++i) {
+		c->bufs[i].data = c->data + i * block_size;
+		c->bufs[i].state = BUF_FREE;
+		lru_insert(&c->lru, &c->bufs[i]);
+	}
+
+	return c;
+}
+
+void fs_bcache_free(struct fs_bcache *c)
+{
+	if (c == NULL)
+		return;
+
+	pthread_cond_destroy(&c->loaded);
+	pthread_mutex_destroy(&c->lock);
+	fs_xfree(c->data);
+	fs_xfree(c->bufs);
+	fs_xfree(c->hash);
+	fs_xfree(c);
+}
+
+/*
+   Read @n consecutive blocks, starting at the block of bufs[0], into @bufs.
+   Return the number of bytes read, or -errno if nothing could be read.
+ */
+static ssize_t read_blocks(struct fs_bcache *c, struct fs_bcache_buf **bufs, unsigned int n)
+{
+	size_t bs = c->block_size, total = n * bs, done = 0;
+	off_t off = bufs[0]->blkno * bs;
+	struct iovec iov[FS_BCACHE_RA_MAX];
+
+	while (done < total) {
+		unsigned int first = done / bs, nr_iov = 0;
+		for (unsigned int i = first; i < n; ++i) {
+			size_t skip = i == first ? done % bs : 0;
+			iov[nr_iov].iov_base = (char *)bufs[i]->data + skip;
+			iov[nr_iov].iov_len = bs - skip;
+			nr_iov++;
+		}
+
+		ssize_t r = preadv(c->fd, iov, nr_iov, off + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && done == 0)
+			return -errno;
+		if (r <= 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/*
+   Read block @blkno and, if misses are sequential, a few blocks after it.
+   Called with the lock held; drops it for the read.
+ */
+static int fill(struct fs_bcache *c, uint64_t blkno, struct fs_bcache_buf **buf)
+{
+	struct fs_bcache_buf *bufs[FS_BCACHE_RA_MAX];
+	unsigned int window = 1, n = 0;
+	int err = 0;
+
+	if (blkno == c->ra_next && c->ra_max > 0) {
+		c->ra_window = c->ra_window ? 2 * c->ra_window : RA_MIN;
+		if (c->ra_window > c->ra_max)
+			c->ra_window = c->ra_max;
+		window = c->ra_window;
+	} else {
+		c->ra_window = 0;
+	}
+
+	/* stop the window at the first block that is already cached */
+	for (; n < window; ++n) {
+		struct fs_bcache_buf *b;
+		if (n > 0 && hash_find(c, blkno + n) != NULL)
+			break;
+		if ((b = recycle(c)) == NULL)
+			break;
+		b->blkno = blkno + n;
+		b->state = BUF_LOADING;
+		b->refs = n == 0;
+		b->err = 0;
+		hash_insert(c, b);
+		bufs[n] = b;
+	}
+
+	if (n == 0) {
+		struct fs_bcache_buf *b = fs_xzalloc(sizeof(*b) + c->block_size);
+		b->data = b + 1;
+		b->blkno = blkno;
+		b->state = BUF_PRIVATE;
+		b->refs = 1;
+		bufs[n++] = b;
+	}
+
+	c->ra_next = blkno + n;
+	c->stats.misses++;
+	c->stats.readahead += n - 1;
+	c->stats.reads++;
+	pthread_mutex_unlock(&c->lock);
+
+	ssize_t r = read_blocks(c, bufs, n);
+
+	pthread_mutex_lock(&c->lock);
+	for (unsigned int i = 0; i < n; ++i) {
+		struct fs_bcache_buf *b = bufs[i];
+
+		if (r >= (ssize_t)((i + 1) * c->block_size)) {
+			if (b->state != BUF_PRIVATE)
+				b->state = i == 0 ? BUF_VALID : BUF_READAHEAD;
+		} else {
+			b->err = r < 0 ? (int)r : -EIO;
+			if (b->state != BUF_PRIVATE) {
+				hash_remove(c, b);
+				b->state = BUF_FREE;
+			}
+		}
+
+		/* blocks read ahead are only pinned by those who waited for them */
+		if (i > 0 && b->refs == 0)
+			lru_insert(b->state == BUF_FREE ? c->lru.lru_prev : &c->lru, b);
+	}
+	pthread_cond_broadcast(&c->loaded);
+
+	if ((err = bufs[0]->err) < 0)
+		release(c, bufs[0]);
+	else
+		*buf = bufs[0];
+	return err;
+}
+
+int fs_bcache_get(struct fs_bcache *c, uint64_t blkno, struct fs_bcache_buf **buf)
+{
+	struct fs_bcache_buf *b;
+	int err = 0;
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((b = hash_find(c, blkno)) == NULL) {
+		err = fill(c, blkno, buf);
+		pthread_mutex_unlock(&c->lock);
+		return err;
+	}
+
+	/* a block being read ahead is in the hash table, but not on the LRU list */
+	if (b->refs++ == 0 && b->state != BUF_LOADING)
+		lru_unlink(b);
+	while (b->state == BUF_LOADING)
+		pthread_cond_wait(&c->loaded, &c->lock);
+
+	if (b->state == BUF_READAHEAD) {
+		b->state = BUF_VALID;
+		c->stats.readahead_hits++;
+	}
+
+	if (b->err < 0) {
+		err = b->err;
+		release(c, b);
+	} else {
+		c->stats.hits++;
+		*buf = b;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	return err;
+}
+
+void fs_bcache_put(struct fs_bcache *c, struct fs_bcache_buf *buf)
+{
+	pthread_mutex_lock(&c->lock);
+	release(c, buf);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void fs_bcache_stats(struct fs_bcache *c, struct fs_bcache_stats *stats)
+{
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   A cache of fixed-size blocks of a file (an ext2 image), read with
+   pread(). It holds a fixed number of buffers, indexed by a hash table and
+   recycled in LRU order. A buffer handed out by fs_bcache_get() is pinned
+   until it is given back with fs_bcache_put(); only unpinned buffers are
+   recycled. If every buffer is pinned, fs_bcache_get() falls back to a
+   buffer of its own that is not cached.
+
+   Misses on consecutive blocks start read-ahead: the next miss reads a
+   window of blocks with one preadv(), and the window doubles with every
+   sequential miss up to FS_BCACHE_RA_MAX blocks (or a quarter of the cache).
+
+   The cache is safe to use from several threads.
+ */
+struct fs_bcache;
+
+#define FS_BCACHE_RA_MAX 64
+
+struct fs_bcache_buf
+{
+	const void *data;
+	uint64_t blkno;
+
+	/* private to fs_bcache */
+	struct fs_bcache_buf *hash_next;
+	struct fs_bcache_buf *lru_prev;
+	struct fs_bcache_buf *lru_next;
+	unsigned int refs;
+	int state;
+	int err;
+};
+
+struct fs_bcache_stats
+{
+	/* lookups served from memory, and lookups that had to read */
+	unsigned long hits;
+	unsigned long misses;
+	/* blocks read ahead of a miss, and how many of them were used */
+	unsigned long readahead;
+	unsigned long readahead_hits;
+	/* preadv() calls issued */
+	unsigned long reads;
+};
+
+/* Set up a cache of @nr_blocks blocks of @block_size bytes of @fd. */
+struct fs_bcache* fs_bcache_alloc(int fd, size_t block_size, size_t nr_blocks);
+
+/* Release @c. No buffer may be pinned. */
+void fs_bcache_free(struct fs_bcache *c);
+
+/*
+   Pin block @blkno, reading it if it is not cached, and return its buffer
+   in @buf. Return 0, or -errno if the block could not be read (-EIO if it
+   is past the end of the file).
+ */
+int fs_bcache_get(struct fs_bcache *c, uint64_t blkno, struct fs_bcache_buf **buf);
+
+/* Unpin a buffer returned by fs_bcache_get(). */
+void fs_bcache_put(struct fs_bcache *c, struct fs_bcache_buf *buf);
+
+/* Copy the counters of @c into @stats. */
+void fs_bcache_stats(struct fs_bcache *c, struct fs_bcache_stats *stats);
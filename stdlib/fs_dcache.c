@@ -0,0 +1,339 @@
+#include <fs_dcache.h>
+#include <fs_malloc.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Parts of a cache; a power of two. */
+#define DCACHE_SHARDS 16
+
+/* Slots of an empty directory index; always a power of two. */
+#define DIR_MIN_SLOTS 16
+
+/* A slot of a directory index; @ino == 0 marks a free slot. */
+struct slot
+{
+	uint32_t hash;
+	uint32_t ino;
+	uint32_t name;
+	uint32_t len;
+};
+
+struct fs_dcache_dir
+{
+	uint32_t ino;
+	size_t nr_entries;
+
+	/* open addressing with linear probing, at most half full */
+	struct slot *slots;
+	size_t mask;
+
+	/* the names, back to back */
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+
+	struct fs_dcache_dir *hash_next;
+	struct fs_dcache_dir *lru_prev;
+	struct fs_dcache_dir *lru_next;
+};
+
+/* A part of the cache, with a lock of its own. */
+struct shard
+{
+	pthread_mutex_t lock;
+
+	/* directories by inode number, chained */
+	struct fs_dcache_dir **hash;
+	size_t hash_mask;
+	size_t nr_dirs;
+
+	/* the most recently used directory follows @lru */
+	struct fs_dcache_dir lru;
+	size_t nr_entries;
+	size_t max_entries;
+
+	struct fs_dcache_stats stats;
+} __attribute__((aligned(64)));
+
+/* Directories are spread over the shards by inode number, so that lookups
+   in different directories seldom wait for each other. */
+struct fs_dcache
+{
+	struct shard shards[DCACHE_SHARDS];
+};
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static uint64_t ino_hash(uint32_t ino)
+{
+	return (ino * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+static struct shard* shard_of(struct fs_dcache *c, uint32_t ino)
+{
+	return &c->shards[ino_hash(ino) % DCACHE_SHARDS];
+}
+
+static size_t dir_slot(const struct shard *c, uint32_t ino)
+{
+	return ino_hash(ino) / DCACHE_SHARDS & c->hash_mask;
+}
+
+static void lru_unlink(struct fs_dcache_dir *d)
+{
+	d->lru_prev->lru_next = d->lru_next;
+	d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_insert(struct fs_dcache_dir *after, struct fs_dcache_dir *d)
+{
+	d->lru_prev = after;
+	d->lru_next = after->lru_next;
+	after->lru_next->lru_prev = d;
+	after->lru_next = d;
+}
+
+struct fs_dcache* fs_dcache_alloc(size_t max_entries)
+{
+	struct fs_dcache *c;
+
+	if (max_entries == 0)
+		max_entries = FS_DCACHE_DEFAULT_ENTRIES;
+
+	/* fs_xmalloc() does not promise the alignment of the shards */
+	c = fs_xaligned_alloc(64, sizeof(*c));
+	memset(c, 0, sizeof(*c));
+
+	for (unsigned int i = 0; i < DCACHE_SHARDS; ++i) {
+		struct shard *sh = &c->shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->hash_mask = 15;
+		sh->hash = fs_xzalloc((sh->hash_mask + 1) * sizeof(*sh->hash));
+		sh->lru.lru_prev = sh->lru.lru_next = &sh->lru;
+		sh->max_entries = (max_entries + DCACHE_SHARDS - 1) / DCACHE_SHARDS;
+	}
+	return c;
+}
+
+void fs_dcache_free(struct fs_dcache *c)
+{
+	if (c == NULL)
+		return;
+
+	for (unsigned int i = 0; i < DCACHE_SHARDS; ++i) {
+		struct shard *sh = &c->shards[i];
+
+		while (sh->lru.lru_next != &sh->lru) {
+			struct fs_dcache_dir *d = sh->lru.lru_next;
+			lru_unlink(d);
+			fs_dcache_dir_free(d);
+		}
+		pthread_mutex_destroy(&sh->lock);
+		fs_xfree(sh->hash);
+	}
+	fs_xfree(c);
+}
+
+struct fs_dcache_dir* fs_dcache_dir_new(void)
+{
+	struct fs_dcache_dir *d = fs_xzalloc(sizeof(*d));
+
+	d->mask = DIR_MIN_SLOTS - 1;
+	d->slots = fs_xzalloc(DIR_MIN_SLOTS * sizeof(*d->slots));
+	return d;
+}
+
+void fs_dcache_dir_free(struct fs_dcache_dir *d)
+{
+	if (d == NULL)
+		return;
+
+	fs_xfree(d->slots);
+	fs_xfree(d->names);
+	fs_xfree(d);
+}
+
+static void dir_place(struct slot *slots, size_t mask, const struct slot *s)
+{
+	size_t i = s->hash & mask;
+	while (slots[i].ino != 0)
+		i = (i + 1) & mask;
+	slots[i] = *s;
+}
+
+void fs_dcache_dir_add(struct fs_dcache_dir *d, const char *name, size_t len, uint32_t ino)
+{
+	struct slot s = {.hash = name_hash(name, len), .ino = ino, .len = len};
+
+	if (2 * (d->nr_entries + 1) > d->mask + 1) {
+		size_t mask = 2 * d->mask + 1;
+		struct slot *slots = fs_xzalloc((mask + 1) * sizeof(*slots));
+
+		for (size_t i = 0; i <= d->mask; ++i)
+			if (d->slots[i].ino != 0)
+				dir_place(slots, mask, &d->slots[i]);
+		fs_xfree(d->slots);
+		d->slots = slots;
+		d->mask = mask;
+	}
+
+	if (d->names_cap - d->names_len < len) {
+		d->names_cap = d->names_cap ? 2 * d->names_cap : 256;
+		while (d->names_cap - d->names_len < len)
+			d->names_cap *= 2;
+		d->names = fs_xrealloc(d->names, d->names_cap);
+	}
+	memcpy(d->names + d->names_len, name, len);
+	s.name = d->names_len;
+	d->names_len += len;
+
+	dir_place(d->slots, d->mask, &s);
+	d->nr_entries++;
+}
+
+int fs_dcache_dir_lookup(const struct fs_dcache_dir *d, const char *name, size_t len,
+			 uint32_t *ino)
+{
+	uint32_t hash = name_hash(name, len);
+
+	for (size_t i = hash & d->mask; d->slots[i].ino != 0; i = (i + 1) & d->mask) {
+		const struct slot *s = &d->slots[i];
+
+		if (s->hash == hash && s->len == len && memcmp(d->names + s->name, name, len) == 0) {
+			*ino = s->ino;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static struct fs_dcache_dir* dir_find(struct shard *c, uint32_t ino)
+{
+	struct fs_dcache_dir *d = c->hash[dir_slot(c, ino)];
+	while (d != NULL && d->ino != ino)
+		d = d->hash_next;
+	return d;
+}
+
+static void dir_remove(struct shard *c, struct fs_dcache_dir *d)
+{
+	struct fs_dcache_dir **p = &c->hash[dir_slot(c, d->ino)];
+	while (*p != d)
+		p = &(*p)->hash_next;
+	*p = d->hash_next;
+
+	lru_unlink(d);
+	c->nr_dirs--;
+	c->nr_entries -= d->nr_entries;
+}
+
+static void grow_hash(struct shard *c)
+{
+	struct fs_dcache_dir **old = c->hash;
+	size_t old_size = c->hash_mask + 1;
+
+	c->hash_mask = 2 * old_size - 1;
+	c->hash = fs_xzalloc(2 * old_size * sizeof(*c->hash));
+	for (size_t i = 0; i < old_size; ++i) {
+		while (old[i] != NULL) {
+			struct fs_dcache_dir *d = old[i];
+			struct fs_dcache_dir **head = &c->hash[dir_slot(c, d->ino)];
+
+			old[i] = d->hash_next;
+			d->hash_next = *head;
+			*head = d;
+		}
+	}
+	fs_xfree(old);
+}
+
+int fs_dcache_lookup(struct fs_dcache *dc, uint32_t dir, const char *name, size_t len,
+		     uint32_t *ino)
+{
+	struct shard *c = shard_of(dc, dir);
+	struct fs_dcache_dir *d;
+	int r;
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((d = dir_find(c, dir)) == NULL) {
+		c->stats.misses++;
+		pthread_mutex_unlock(&c->lock);
+		return 1;
+	}
+
+	lru_unlink(d);
+	lru_insert(&c->lru, d);
+	if ((r = fs_dcache_dir_lookup(d, name, len, ino)) == 0)
+		c->stats.hits++;
+	else
+		c->stats.negative_hits++;
+
+	pthread_mutex_unlock(&c->lock);
+	return r;
+}
+
+void fs_dcache_insert(struct fs_dcache *dc, uint32_t dir, struct fs_dcache_dir *d)
+{
+	struct shard *c = shard_of(dc, dir);
+	struct fs_dcache_dir *victims = NULL;
+
+	pthread_mutex_lock(&c->lock);
+
+	if (dir_find(c, dir) != NULL) {
+		pthread_mutex_unlock(&c->lock);
+		fs_dcache_dir_free(d);
+		return;
+	}
+
+	d->ino = dir;
+	if (c->nr_dirs >= c->hash_mask + 1)
+		grow_hash(c);
+	d->hash_next = c->hash[dir_slot(c, dir)];
+	c->hash[dir_slot(c, dir)] = d;
+	lru_insert(&c->lru, d);
+	c->nr_dirs++;
+	c->nr_entries += d->nr_entries;
+
+	/* the new directory stays even if it alone is over the limit */
+	while (c->nr_entries > c->max_entries && c->lru.lru_prev != d) {
+		struct fs_dcache_dir *v = c->lru.lru_prev;
+		dir_remove(c, v);
+		v->hash_next = victims;
+		victims = v;
+		c->stats.evictions++;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	while (victims != NULL) {
+		struct fs_dcache_dir *v = victims;
+		victims = v->hash_next;
+		fs_dcache_dir_free(v);
+	}
+}
+
+void fs_dcache_stats(struct fs_dcache *c, struct fs_dcache_stats *stats)
+{
+	*stats = (struct fs_dcache_stats){0};
+	for (unsigned int i = 0; i < DCACHE_SHARDS; ++i) {
+		struct shard *sh = &c->shards[i];
+
+		pthread_mutex_lock(&sh->lock);
+		stats->hits += sh->stats.hits;
+		stats->negative_hits += sh->stats.negative_hits;
+		stats->misses += sh->stats.misses;
+		stats->evictions += sh->stats.evictions;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
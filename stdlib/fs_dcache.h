@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   A cache of directory entries: (directory inode, name) -> child inode.
+   A directory is cached whole, as a hash index of all its entries built
+   the first time it is looked up in, so a name that is not in the index
+   is known not to exist without reading the directory again. Directories
+   are evicted in LRU order once the cache holds more than a set number of
+   entries. The index is for read-only images: nothing invalidates it.
+
+   The cache is safe to use from several threads. It is split by directory
+   into a few parts, each with a lock, an LRU list and a share of the
+   entries of its own, so that lookups in different directories seldom
+   wait for each other. Indexes are built by the caller outside of the
+   cache locks, with fs_dcache_dir_new() and fs_dcache_dir_add(), and
+   handed over with fs_dcache_insert().
+ */
+struct fs_dcache;
+struct fs_dcache_dir;
+
+/* Entries kept when fs_dcache_alloc() is asked for 0. */
+#define FS_DCACHE_DEFAULT_ENTRIES (1024 * 1024)
+
+struct fs_dcache_stats
+{
+	/* lookups answered with an inode, and with -ENOENT */
+	unsigned long hits;
+	unsigned long negative_hits;
+	/* lookups in a directory that was not indexed */
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/* Set up a cache of about @max_entries entries (0 picks a default). */
+struct fs_dcache* fs_dcache_alloc(size_t max_entries);
+void fs_dcache_free(struct fs_dcache *c);
+
+/*
+   Look @name (of @len bytes) up in directory @dir. Return 0 with the child
+   in @ino, -ENOENT if @dir is indexed and has no such entry, or 1 if @dir
+   is not indexed.
+ */
+int fs_dcache_lookup(struct fs_dcache *c, uint32_t dir, const char *name, size_t len,
+		     uint32_t *ino);
+
+/* An empty index of a directory, to be filled with fs_dcache_dir_add(). */
+struct fs_dcache_dir* fs_dcache_dir_new(void);
+void fs_dcache_dir_add(struct fs_dcache_dir *d, const char *name, size_t len, uint32_t ino);
+
+/* fs_dcache_lookup() in an index that is not in a cache. */
+int fs_dcache_dir_lookup(const struct fs_dcache_dir *d, const char *name, size_t len,
+			 uint32_t *ino);
+
+/* Free an index that was not inserted. */
+void fs_dcache_dir_free(struct fs_dcache_dir *d);
+
+/*
+   Hand the index @d of directory @dir over to @c. If another thread got
+   there first, @d is freed instead. Either way @d must not be used after.
+ */
+void fs_dcache_insert(struct fs_dcache *c, uint32_t dir, struct fs_dcache_dir *d);
+
+/* Add the counters of @c up into @stats. */
+void fs_dcache_stats(struct fs_dcache *c, struct fs_dcache_stats *stats);
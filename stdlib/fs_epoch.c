@@ -0,0 +1,188 @@
+#include <fs_epoch.h>
+#include <fs_malloc.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Objects a thread retires between two attempts to free some. */
+#define RETIRE_BATCH 64
+
+/* Domains a thread remembers its record in. */
+#define THREAD_CACHE 4
+
+struct retired
+{
+	void *p;
+	uint64_t epoch;
+};
+
+/* A thread in a domain, recognized by its pthread_t: a thread started
+   after another one exited may take its record over. */
+struct record
+{
+	/* the epoch the thread entered in, shifted left, and bit 0 set while
+	   it is inside */
+	_Atomic uint64_t state;
+	unsigned int nesting;
+	pthread_t owner;
+
+	struct retired *retired;
+	size_t nr_retired;
+	size_t cap;
+	/* free some once there are this many */
+	size_t next_scan;
+
+	struct record *next;
+};
+
+struct fs_epoch
+{
+	_Atomic uint64_t epoch;
+	uint64_t id;
+	pthread_mutex_t lock;
+	/* records are added at the head, under the lock, and kept until the
+	   domain is freed, so walking them needs no lock */
+	_Atomic(struct record *) records;
+};
+
+/* Ids are never reused, so that a thread cannot mistake a new domain for
+   one it cached and that was freed since. */
+static atomic_uint_fast64_t next_id = 1;
+
+static __thread struct
+{
+	uint64_t id;
+	struct record *r;
+} cache[THREAD_CACHE];
+
+struct fs_epoch* fs_epoch_alloc(void)
+{
+	struct fs_epoch *e = fs_xzalloc(sizeof(*e));
+
+	atomic_init(&e->epoch, 1);
+	atomic_init(&e->records, NULL);
+	e->id = atomic_fetch_add(&next_id, 1);
+	pthread_mutex_init(&e->lock, NULL);
+	return e;
+}
+
+void fs_epoch_free(struct fs_epoch *e)
+{
+	struct record *r, *next;
+
+	if (e == NULL)
+		return;
+
+	for (r = atomic_load(&e->records); r != NULL; r = next) {
+		next = r->next;
+		for (size_t i = 0; i < r->nr_retired; ++i)
+			free(r->retired[i].p);
+		fs_xfree(r->retired);
+		fs_xfree(r);
+	}
+	pthread_mutex_destroy(&e->lock);
+	fs_xfree(e);
+}
+
+/* The record of the calling thread in @e, made on its first call. */
+static struct record* self(struct fs_epoch *e)
+{
+	unsigned int slot = e->id % THREAD_CACHE;
+	pthread_t me = pthread_self();
+	struct record *r;
+
+	if (cache[slot].id == e->id)
+		return cache[slot].r;
+
+	pthread_mutex_lock(&e->lock);
+	for (r = atomic_load(&e->records); r != NULL; r = r->next)
+		if (pthread_equal(r->owner, me))
+			break;
+	if (r == NULL) {
+		r = fs_xzalloc(sizeof(*r));
+		atomic_init(&r->state, 0);
+		r->owner = me;
+		r->next_scan = RETIRE_BATCH;
+		r->next = atomic_load(&e->records);
+		atomic_store(&e->records, r);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	cache[slot].id = e->id;
+	cache[slot].r = r;
+	return r;
+}
+
+void fs_epoch_enter(struct fs_epoch *e)
+{
+	struct record *r = self(e);
+
+	if (r->nesting++ > 0)
+		return;
+
+	/* the epoch may move on before the store: the record then holds the
+	   next one back, which is only more cautious */
+	atomic_store(&r->state, atomic_load(&e->epoch) << 1 | 1);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+void fs_epoch_exit(struct fs_epoch *e)
+{
+	struct record *r = self(e);
+
+	if (--r->nesting == 0)
+		atomic_store_explicit(&r->state, 0, memory_order_release);
+}
+
+/* Move the epoch on, if every thread inside has seen the current one. */
+static void try_advance(struct fs_epoch *e)
+{
+	uint64_t epoch = atomic_load(&e->epoch);
+
+	for (struct record *r = atomic_load(&e->records); r != NULL; r = r->next) {
+		uint64_t state = atomic_load(&r->state);
+		if ((state & 1) && state >> 1 != epoch)
+			return;
+	}
+	atomic_compare_exchange_strong(&e->epoch, &epoch, epoch + 1);
+}
+
+/*
+   Free what @r retired two epochs ago or earlier: a thread that could
+   still read it entered before the epoch after it began, and the epoch
+   cannot move past that one while the thread is inside.
+ */
+static void reclaim(struct fs_epoch *e, struct record *r)
+{
+	uint64_t epoch = atomic_load(&e->epoch);
+	size_t kept = 0;
+
+	for (size_t i = 0; i < r->nr_retired; ++i) {
+		if (r->retired[i].epoch + 2 <= epoch)
+			free(r->retired[i].p);
+		else
+			r->retired[kept++] = r->retired[i];
+	}
+	r->nr_retired = kept;
+	r->next_scan = kept + RETIRE_BATCH;
+}
+
+void fs_epoch_retire(struct fs_epoch *e, void *p)
+{
+	struct record *r = self(e);
+
+	if (r->nr_retired == r->cap) {
+		r->cap = r->cap ? 2 * r->cap : RETIRE_BATCH;
+		r->retired = fs_xrealloc(r->retired, r->cap * sizeof(*r->retired));
+	}
+	r->retired[r->nr_retired].p = p;
+	r->retired[r->nr_retired].epoch = atomic_load(&e->epoch);
+	r->nr_retired++;
+
+	if (r->nr_retired >= r->next_scan) {
+		try_advance(e);
+		reclaim(e, r);
+	}
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+   Epoch-based reclamation, for structures that threads read without locks.
+   A thread reads between fs_epoch_enter() and fs_epoch_exit(); an object
+   unlinked from the structure is handed to fs_epoch_retire(), and freed
+   once every thread that was reading when it was retired has left. Threads
+   join a domain the first time they enter it.
+ */
+struct fs_epoch;
+
+struct fs_epoch* fs_epoch_alloc(void);
+/* Free @e and every object still retired in it: no thread may be in it. */
+void fs_epoch_free(struct fs_epoch *e);
+
+/* Calls nest; only the outermost pair matters. */
+void fs_epoch_enter(struct fs_epoch *e);
+void fs_epoch_exit(struct fs_epoch *e);
+
+/* Free @p, from malloc() or posix_memalign(), once no thread can still be
+   reading it. Call it between fs_epoch_enter() and fs_epoch_exit(). */
+void fs_epoch_retire(struct fs_epoch *e, void *p);
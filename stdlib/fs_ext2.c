@@ -0,0 +1,1038 @@
+#include <fs_ext2.h>
+#include <fs_malloc.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Blocks cached when the caller does not say: 4MiB of 4k blocks. */
+#define EXT2_CACHE_BLOCKS 1024
+
+/* Block sizes go from 1k (a log of 0) to 64k. */
+#define EXT2_MAX_LOG_BLOCK_SIZE 6
+
+/* Bytes fs_ext2_dump() reads from the image at once when it is not mapped. */
+#define EXT2_DUMP_CHUNK (1 << 20)
+
+static int read_super(int fd, struct ext2_super_block *sb)
+{
+	ssize_t r;
+
+	do {
+		r = pread(fd, sb, sizeof(*sb), EXT2_SUPERBLOCK_OFFSET);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return -errno;
+	if (r != sizeof(*sb))
+		return -EPROTO;
+	return 0;
+}
+
+int fs_ext2_read_group_desc(struct fs_ext2 *fs, uint32_t group, struct ext2_group_desc *gd)
+{
+	unsigned int per_block = fs->block_size / sizeof(*gd);
+	uint32_t blkno = fs->sb.s_first_data_block + 1 + group / per_block;
+	struct fs_ext2_block b;
+	int r;
+
+	if ((r = fs_ext2_get_block(fs, blkno, &b)) < 0)
+		return r;
+	memcpy(gd, (const struct ext2_group_desc *)b.data + group % per_block, sizeof(*gd));
+	fs_ext2_put_block(fs, &b);
+
+	uint64_t table_blocks = ((uint64_t)fs->sb.s_inodes_per_group * fs->inode_size +
+				 fs->block_size - 1) / fs->block_size;
+	if (gd->bg_block_bitmap >= fs->sb.s_blocks_count ||
+	    gd->bg_inode_bitmap >= fs->sb.s_blocks_count ||
+	    gd->bg_inode_table == 0 ||
+	    gd->bg_inode_table + table_blocks > fs->sb.s_blocks_count)
+		return -EPROTO;
+	return 0;
+}
+
+/* Check the superblock in @fs->sb, and derive the geometry from it. */
+static int check_super(struct fs_ext2 *fs)
+{
+	struct ext2_super_block *sb = &fs->sb;
+
+	if (sb->s_magic != EXT2_SUPER_MAGIC ||
+	    sb->s_log_block_size > EXT2_MAX_LOG_BLOCK_SIZE ||
+	    sb->s_blocks_per_group == 0 || sb->s_inodes_per_group == 0 ||
+	    sb->s_blocks_count <= sb->s_first_data_block)
+		return -EPROTO;
+
+	fs->block_size = 1024u << sb->s_log_block_size;
+	fs->addr_per_block = fs->block_size / sizeof(uint32_t);
+	fs->inode_size = sb->s_rev_level == EXT2_GOOD_OLD_REV ?
+		EXT2_GOOD_OLD_INODE_SIZE : sb->s_inode_size;
+	fs->nr_groups = (sb->s_blocks_count - sb->s_first_data_block +
+			 sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+
+	if (fs->inode_size < EXT2_GOOD_OLD_INODE_SIZE || fs->inode_size > fs->block_size ||
+	    (fs->inode_size & (fs->inode_size - 1)) != 0 ||
+	    sb->s_inodes_per_group > 8 * fs->block_size ||
+	    sb->s_inodes_count > (uint64_t)fs->nr_groups * sb->s_inodes_per_group)
+		return -EPROTO;
+	return 0;
+}
+
+static int check_groups(struct fs_ext2 *fs)
+{
+	for (uint32_t g = 0; g < fs->nr_groups; ++g) {
+		struct ext2_group_desc gd;
+		int r = fs_ext2_read_group_desc(fs, g, &gd);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+/* Read the superblock, and set a cache up unless @cache_blocks is -1. */
+static int open_pread(struct fs_ext2 *fs, int fd, ssize_t cache_blocks)
+{
+	int r;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->fd = fd;
+
+	if ((r = read_super(fd, &fs->sb)) < 0)
+		return r;
+	if ((r = check_super(fs)) < 0)
+		return r;
+
+	if (cache_blocks >= 0)
+		fs->cache = fs_bcache_alloc(fd, fs->block_size,
+					    cache_blocks ? (size_t)cache_blocks : EXT2_CACHE_BLOCKS);
+
+	if ((r = check_groups(fs)) < 0)
+		fs_ext2_close(fs);
+	return r;
+}
+
+int fs_ext2_open(struct fs_ext2 *fs, int fd, size_t cache_blocks)
+{
+	return open_pread(fs, fd, cache_blocks);
+}
+
+int fs_ext2_open_direct(struct fs_ext2 *fs, int fd)
+{
+	return open_pread(fs, fd, -1);
+}
+
+int fs_ext2_open_mmap(struct fs_ext2 *fs, int fd)
+{
+	struct stat st;
+	void *map;
+	int r;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->fd = fd;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+	if (!S_ISREG(st.st_mode))
+		return -ENODEV;
+	if (st.st_size < EXT2_SUPERBLOCK_OFFSET + (off_t)sizeof(fs->sb))
+		return -EPROTO;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+	fs->map = map;
+	fs->map_size = st.st_size;
+
+	memcpy(&fs->sb, fs->map + EXT2_SUPERBLOCK_OFFSET, sizeof(fs->sb));
+	if ((r = check_super(fs)) < 0) {
+		fs_ext2_close(fs);
+		return r;
+	}
+
+	/* the group descriptors are read right away, and over and over */
+	uint64_t gd_off = (uint64_t)(fs->sb.s_first_data_block + 1) * fs->block_size;
+	size_t gd_len = fs->nr_groups * sizeof(struct ext2_group_desc);
+	if (gd_off < fs->map_size)
+		fs_ext2_advise(fs, gd_off, gd_len, MADV_WILLNEED);
+
+	if ((r = check_groups(fs)) < 0)
+		fs_ext2_close(fs);
+	return r;
+}
+
+void fs_ext2_close(struct fs_ext2 *fs)
+{
+	if (fs->map != NULL)
+		munmap((void *)fs->map, fs->map_size);
+	fs->map = NULL;
+	fs_bcache_free(fs->cache);
+	fs->cache = NULL;
+}
+
+/*
+   Block buffers of images opened with fs_ext2_open_direct(). Each thread
+   keeps the buffers it released on a list of its own to take them from
+   there next time, and frees them when it exits.
+ */
+struct fs_ext2_scratch
+{
+	struct fs_ext2_scratch *next;
+	size_t size;
+	_Alignas(16) char data[];
+};
+
+static __thread struct fs_ext2_scratch *scratch_list;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_exit(void *x)
+{
+	(void) x;
+	while (scratch_list != NULL) {
+		struct fs_ext2_scratch *s = scratch_list;
+		scratch_list = s->next;
+		fs_xfree(s);
+	}
+}
+
+static void scratch_init(void)
+{
+	pthread_key_create(&scratch_key, scratch_exit);
+}
+
+static struct fs_ext2_scratch* scratch_get(size_t size)
+{
+	struct fs_ext2_scratch *s = scratch_list;
+
+	if (s != NULL && s->size >= size) {
+		scratch_list = s->next;
+		return s;
+	}
+
+	/* the key only gets scratch_exit() called when the thread exits */
+	pthread_once(&scratch_once, scratch_init);
+	pthread_setspecific(scratch_key, &scratch_list);
+
+	s = fs_xmalloc(sizeof(*s) + size);
+	s->size = size;
+	return s;
+}
+
+static void scratch_put(struct fs_ext2_scratch *s)
+{
+	s->next = scratch_list;
+	scratch_list = s;
+}
+
+int fs_ext2_get_block(struct fs_ext2 *fs, uint32_t blkno, struct fs_ext2_block *b)
+{
+	int r;
+
+	b->buf = NULL;
+	b->scratch = NULL;
+	if (fs->map != NULL) {
+		if ((uint64_t)(blkno + 1ull) * fs->block_size > fs->map_size)
+			return -EIO;
+		b->data = fs->map + (uint64_t)blkno * fs->block_size;
+		return 0;
+	}
+
+	if (fs->cache == NULL) {
+		struct fs_ext2_scratch *s = scratch_get(fs->block_size);
+		if ((r = fs_ext2_read_image(fs, s->data, fs->block_size,
+					    (uint64_t)blkno * fs->block_size)) < 0) {
+			scratch_put(s);
+			return r;
+		}
+		b->data = s->data;
+		b->scratch = s;
+		return 0;
+	}
+
+	if ((r = fs_bcache_get(fs->cache, blkno, &b->buf)) < 0)
+		return r;
+	b->data = b->buf->data;
+	return 0;
+}
+
+void fs_ext2_put_block(struct fs_ext2 *fs, struct fs_ext2_block *b)
+{
+	if (b->buf != NULL)
+		fs_bcache_put(fs->cache, b->buf);
+	if (b->scratch != NULL)
+		scratch_put(b->scratch);
+	b->buf = NULL;
+	b->scratch = NULL;
+}
+
+void fs_ext2_advise(struct fs_ext2 *fs, uint64_t off, uint64_t len, int advice)
+{
+	uint64_t start = off & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+
+	if (fs->map == NULL || off >= fs->map_size)
+		return;
+	if (len > fs->map_size - off)
+		len = fs->map_size - off;
+	madvise((void *)(fs->map + start), len + (off - start), advice);
+}
+
+int fs_ext2_read_inode(struct fs_ext2 *fs, uint32_t ino, struct ext2_inode *inode)
+{
+	struct ext2_group_desc gd;
+	struct fs_ext2_block b;
+	int r;
+
+	if (ino == 0 || ino > fs->sb.s_inodes_count)
+		return -EINVAL;
+	if (fs->icache != NULL && fs_icache_get(fs->icache, ino, inode))
+		return 0;
+
+	uint32_t group = (ino - 1) / fs->sb.s_inodes_per_group;
+	uint64_t off = (uint64_t)((ino - 1) % fs->sb.s_inodes_per_group) * fs->inode_size;
+
+	if ((r = fs_ext2_read_group_desc(fs, group, &gd)) < 0)
+		return r;
+	if ((r = fs_ext2_get_block(fs, gd.bg_inode_table + off / fs->block_size, &b)) < 0)
+		return r;
+	memcpy(inode, (const char *)b.data + off % fs->block_size, sizeof(*inode));
+	fs_ext2_put_block(fs, &b);
+
+	if (fs->icache != NULL)
+		fs_icache_put(fs->icache, ino, inode);
+	return 0;
+}
+
+int fs_ext2_inode_in_use(struct fs_ext2 *fs, uint32_t ino)
+{
+	struct ext2_group_desc gd;
+	struct fs_ext2_block b;
+	int r;
+
+	if (ino == 0 || ino > fs->sb.s_inodes_count)
+		return -EINVAL;
+
+	uint32_t group = (ino - 1) / fs->sb.s_inodes_per_group;
+	uint32_t bit = (ino - 1) % fs->sb.s_inodes_per_group;
+
+	if ((r = fs_ext2_read_group_desc(fs, group, &gd)) < 0)
+		return r;
+	if ((r = fs_ext2_get_block(fs, gd.bg_inode_bitmap, &b)) < 0)
+		return r;
+	r = ((const uint8_t *)b.data)[bit / 8] >> (bit % 8) & 1;
+	fs_ext2_put_block(fs, &b);
+	return r;
+}
+
+/* Return in @out entry @idx of indirect block @blkno, or 0 if @blkno is a hole. */
+static int indirect(struct fs_ext2 *fs, uint32_t blkno, uint32_t idx, uint32_t *out)
+{
+	struct fs_ext2_block b;
+	int r;
+
+	if (blkno == 0) {
+		*out = 0;
+		return 0;
+	}
+	if (blkno >= fs->sb.s_blocks_count)
+		return -EPROTO;
+
+	if ((r = fs_ext2_get_block(fs, blkno, &b)) < 0)
+		return r;
+	*out = ((const uint32_t *)b.data)[idx];
+	fs_ext2_put_block(fs, &b);
+	return 0;
+}
+
+int fs_ext2_bmap(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		 uint32_t lblk, uint32_t *pblk)
+{
+	uint64_t apb = fs->addr_per_block, x = lblk;
+	uint32_t dind, ind;
+	int r = 0;
+
+	if (x < EXT2_NDIR_BLOCKS) {
+		*pblk = inode->i_block[x];
+	} else if ((x -= EXT2_NDIR_BLOCKS) < apb) {
+		r = indirect(fs, inode->i_block[EXT2_IND_BLOCK], x, pblk);
+	} else if ((x -= apb) < apb * apb) {
+		if ((r = indirect(fs, inode->i_block[EXT2_DIND_BLOCK], x / apb, &ind)) == 0)
+			r = indirect(fs, ind, x % apb, pblk);
+	} else if ((x -= apb * apb) < apb * apb * apb) {
+		if ((r = indirect(fs, inode->i_block[EXT2_TIND_BLOCK], x / apb / apb, &dind)) == 0 &&
+		    (r = indirect(fs, dind, x / apb % apb, &ind)) == 0)
+			r = indirect(fs, ind, x % apb, pblk);
+	} else {
+		return -EFBIG;
+	}
+
+	if (r == 0 && *pblk >= fs->sb.s_blocks_count)
+		r = -EPROTO;
+	return r;
+}
+
+int fs_ext2_ind_block(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		      uint32_t k, uint32_t *blkno)
+{
+	uint64_t apb = fs->addr_per_block, x = k;
+	uint32_t dind;
+	int r = 0;
+
+	if (x == 0) {
+		*blkno = inode->i_block[EXT2_IND_BLOCK];
+	} else if ((x -= 1) < apb) {
+		r = indirect(fs, inode->i_block[EXT2_DIND_BLOCK], x, blkno);
+	} else if ((x -= apb) < apb * apb) {
+		if ((r = indirect(fs, inode->i_block[EXT2_TIND_BLOCK], x / apb, &dind)) == 0)
+			r = indirect(fs, dind, x % apb, blkno);
+	} else {
+		return -EFBIG;
+	}
+
+	if (r == 0 && *blkno >= fs->sb.s_blocks_count)
+		r = -EPROTO;
+	return r;
+}
+
+/* Point @map at entry @idx of indirect block @blkno on, as map_slice() does. */
+static int slice_of(struct fs_ext2 *fs, uint32_t blkno, uint32_t idx,
+		    struct fs_ext2_block *b, const uint32_t **map, uint32_t *count)
+{
+	int r;
+
+	*count = fs->addr_per_block - idx;
+	if (blkno == 0)
+		return 0;
+	if (blkno >= fs->sb.s_blocks_count)
+		return -EPROTO;
+	if ((r = fs_ext2_get_block(fs, blkno, b)) < 0)
+		return r;
+	*map = (const uint32_t *)b->data + idx;
+	return 0;
+}
+
+/*
+   Point @map at the block map entries of @inode from @lblk to the end of the
+   array that holds them, and return their number in @count. A missing
+   indirect block leaves @map NULL: all of the blocks under it are holes,
+   and @count covers them all. Release @b with fs_ext2_put_block() once done
+   with @map.
+ */
+static int map_slice(struct fs_ext2 *fs, const struct ext2_inode *inode, uint32_t lblk,
+		     struct fs_ext2_block *b, const uint32_t **map, uint32_t *count)
+{
+	uint64_t apb = fs->addr_per_block, x = lblk;
+	uint32_t dind, ind;
+	int r;
+
+	b->data = NULL;
+	b->buf = NULL;
+	b->scratch = NULL;
+	*map = NULL;
+
+	if (x < EXT2_NDIR_BLOCKS) {
+		*map = inode->i_block + x;
+		*count = EXT2_NDIR_BLOCKS - x;
+		return 0;
+	}
+	if ((x -= EXT2_NDIR_BLOCKS) < apb)
+		return slice_of(fs, inode->i_block[EXT2_IND_BLOCK], x, b, map, count);
+
+	if ((x -= apb) < apb * apb) {
+		dind = inode->i_block[EXT2_DIND_BLOCK];
+	} else if ((x -= apb * apb) < apb * apb * apb) {
+		uint32_t tind = inode->i_block[EXT2_TIND_BLOCK];
+		if (tind == 0) {
+			uint64_t left = apb * apb * apb - x;
+			*count = left < UINT32_MAX ? left : UINT32_MAX;
+			return 0;
+		}
+		if ((r = indirect(fs, tind, x / apb / apb, &dind)) < 0)
+			return r;
+		x %= apb * apb;
+	} else {
+		return -EFBIG;
+	}
+
+	/* a missing double-indirect block is one hole, not apb of them */
+	if (dind == 0) {
+		*count = apb * apb - x;
+		return 0;
+	}
+	if ((r = indirect(fs, dind, x / apb, &ind)) < 0)
+		return r;
+	return slice_of(fs, ind, x % apb, b, map, count);
+}
+
+int fs_ext2_bmap_run(struct fs_ext2 *fs, const struct ext2_inode *inode, uint32_t lblk,
+		     uint32_t max, uint32_t *pblk, uint32_t *len)
+{
+	uint32_t first = 0, n = 0;
+	int r = 0;
+
+	while (n < max) {
+		struct fs_ext2_block b;
+		const uint32_t *map;
+		uint32_t count, k;
+
+		/* a run that got somewhere is returned, and the error comes next time */
+		if ((r = map_slice(fs, inode, lblk + n, &b, &map, &count)) < 0)
+			break;
+		if (count > max - n)
+			count = max - n;
+
+		for (k = 0; k < count; ++k) {
+			uint32_t x = map != NULL ? map[k] : 0;
+			if (x >= fs->sb.s_blocks_count) {
+				r = -EPROTO;
+				break;
+			}
+			if (n == 0)
+				first = x;
+			else if (x != (first != 0 ? first + n : 0))
+				break;
+			n++;
+		}
+
+		fs_ext2_put_block(fs, &b);
+		if (r < 0 || k < count)
+			break;
+	}
+
+	if (n == 0 && r < 0)
+		return r;
+	*pblk = first;
+	*len = n;
+	return 0;
+}
+
+int fs_ext2_dir_open(struct fs_ext2 *fs, const struct ext2_inode *dir, struct fs_ext2_dir *d)
+{
+	if ((dir->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+		return -ENOTDIR;
+
+	memset(d, 0, sizeof(*d));
+	d->fs = fs;
+	d->inode = *dir;
+	return 0;
+}
+
+static void dir_release(struct fs_ext2_dir *d)
+{
+	if (d->b.data != NULL)
+		fs_ext2_put_block(d->fs, &d->b);
+	d->b.data = NULL;
+}
+
+/*
+   Hold the block @d->pos is in, skipping holes. Return 1, 0 at the end of
+   the directory, or -errno.
+ */
+static int dir_load(struct fs_ext2_dir *d)
+{
+	struct fs_ext2 *fs = d->fs;
+	uint64_t size = ext2_inode_size(&d->inode);
+	int r;
+
+	while (d->pos < size) {
+		uint32_t lblk = d->pos / fs->block_size;
+		uint32_t pblk;
+
+		if (d->b.data != NULL && d->lblk == lblk)
+			return 1;
+		dir_release(d);
+
+		if ((r = fs_ext2_bmap(fs, &d->inode, lblk, &pblk)) < 0)
+			return r;
+		if (pblk == 0) {
+			d->pos = (uint64_t)(lblk + 1) * fs->block_size;
+			continue;
+		}
+		if ((r = fs_ext2_get_block(fs, pblk, &d->b)) < 0)
+			return r;
+		d->lblk = lblk;
+		return 1;
+	}
+
+	dir_release(d);
+	return 0;
+}
+
+static int dir_entry_ok(const struct fs_ext2 *fs, const struct ext2_dir_entry_2 *de,
+			unsigned int off)
+{
+	return off + 8 <= fs->block_size && de->rec_len >= 8 && de->rec_len % 4 == 0 &&
+	       off + de->rec_len <= fs->block_size && de->name_len + 8u <= de->rec_len;
+}
+
+int fs_ext2_dir_next(struct fs_ext2_dir *d, const struct ext2_dir_entry_2 **de, uint64_t *off)
+{
+	struct fs_ext2 *fs = d->fs;
+	int r;
+
+	while ((r = dir_load(d)) > 0) {
+		const char *block = d->b.data;
+		unsigned int o = d->pos % fs->block_size;
+		const struct ext2_dir_entry_2 *e;
+
+		/* entries are only known to start where a walk from the start
+		   of the block lands */
+		if (d->resync) {
+			unsigned int x = 0;
+
+			while (x < o) {
+				e = (const void *)(block + x);
+				if (!dir_entry_ok(fs, e, x))
+					return -EPROTO;
+				x += e->rec_len;
+			}
+			d->pos += x - o;
+			d->resync = 0;
+			continue;
+		}
+
+		e = (const void *)(block + o);
+		if (!dir_entry_ok(fs, e, o))
+			return -EPROTO;
+
+		*off = d->pos;
+		d->pos += e->rec_len;
+		if (e->inode != 0) {
+			*de = e;
+			return 1;
+		}
+	}
+
+	return r;
+}
+
+uint64_t fs_ext2_dir_tell(const struct fs_ext2_dir *d)
+{
+	return d->pos;
+}
+
+void fs_ext2_dir_seek(struct fs_ext2_dir *d, uint64_t off)
+{
+	d->pos = off;
+	d->resync = off % d->fs->block_size != 0;
+}
+
+void fs_ext2_dir_close(struct fs_ext2_dir *d)
+{
+	dir_release(d);
+}
+
+int fs_ext2_dir_iterate(struct fs_ext2 *fs, const struct ext2_inode *dir,
+			fs_ext2_dir_fn fn, void *arg)
+{
+	const struct ext2_dir_entry_2 *de;
+	struct fs_ext2_dir d;
+	uint64_t off;
+	int r;
+
+	if ((r = fs_ext2_dir_open(fs, dir, &d)) < 0)
+		return r;
+
+	while ((r = fs_ext2_dir_next(&d, &de, &off)) > 0)
+		if ((r = fn(arg, de, off)) != 0)
+			break;
+
+	fs_ext2_dir_close(&d);
+	return r;
+}
+
+struct lookup
+{
+	const char *name;
+	size_t len;
+	uint32_t ino;
+};
+
+static int lookup_entry(void *arg, const struct ext2_dir_entry_2 *de, uint64_t off)
+{
+	struct lookup *l = arg;
+	(void) off;
+
+	if (de->name_len != l->len || memcmp(de->name, l->name, l->len) != 0)
+		return 0;
+	l->ino = de->inode;
+	return 1;
+}
+
+int fs_ext2_lookup(struct fs_ext2 *fs, const struct ext2_inode *dir,
+		   const char *name, size_t len, uint32_t *ino)
+{
+	struct lookup l = {.name = name, .len = len};
+	int r;
+
+	if ((dir->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+		return -ENOTDIR;
+
+	if ((r = fs_ext2_dir_iterate(fs, dir, lookup_entry, &l)) < 0)
+		return r;
+	if (r == 0)
+		return -ENOENT;
+
+	*ino = l.ino;
+	return 0;
+}
+
+static int index_entry(void *arg, const struct ext2_dir_entry_2 *de, uint64_t off)
+{
+	(void) off;
+	fs_dcache_dir_add(arg, de->name, de->name_len, de->inode);
+	return 0;
+}
+
+/* fs_ext2_lookup() through fs->dcache, indexing directory @dir_ino on a miss. */
+static int lookup_cached(struct fs_ext2 *fs, uint32_t dir_ino, const struct ext2_inode *dir,
+			 const char *name, size_t len, uint32_t *ino)
+{
+	struct fs_dcache_dir *d;
+	int r;
+
+	if ((dir->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+		return -ENOTDIR;
+	if ((r = fs_dcache_lookup(fs->dcache, dir_ino, name, len, ino)) <= 0)
+		return r;
+
+	d = fs_dcache_dir_new();
+	if ((r = fs_ext2_dir_iterate(fs, dir, index_entry, d)) < 0) {
+		fs_dcache_dir_free(d);
+		return r;
+	}
+	r = fs_dcache_dir_lookup(d, name, len, ino);
+	fs_dcache_insert(fs->dcache, dir_ino, d);
+	return r;
+}
+
+int fs_ext2_namei(struct fs_ext2 *fs, const char *path, uint32_t *ino, struct ext2_inode *inode)
+{
+	int r;
+
+	*ino = EXT2_ROOT_INO;
+	if ((r = fs_ext2_read_inode(fs, *ino, inode)) < 0)
+		return r;
+
+	while (*path != '\0') {
+		size_t len = strcspn(path, "/");
+
+		if (len == 0) {
+			path++;
+			continue;
+		}
+		if (len > EXT2_NAME_LEN)
+			return -ENAMETOOLONG;
+
+		if (fs->dcache != NULL)
+			r = lookup_cached(fs, *ino, inode, path, len, ino);
+		else
+			r = fs_ext2_lookup(fs, inode, path, len, ino);
+		if (r < 0)
+			return r;
+		if ((r = fs_ext2_read_inode(fs, *ino, inode)) < 0)
+			return r;
+		path += len;
+
+		/* "file/" names a directory that is not there */
+		if (*path == '/' && (inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR)
+			return -ENOTDIR;
+	}
+
+	return 0;
+}
+
+int fs_ext2_index_build(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			struct fs_ext2_index *index)
+{
+	uint64_t size = ext2_inode_size(inode);
+	size_t cap = 0;
+	uint32_t n;
+	int r;
+
+	memset(index, 0, sizeof(*index));
+	index->nr_blocks = (size + fs->block_size - 1) / fs->block_size;
+
+	for (uint32_t lblk = 0; lblk < index->nr_blocks; lblk += n) {
+		uint32_t pblk;
+
+		if ((r = fs_ext2_bmap_run(fs, inode, lblk, index->nr_blocks - lblk, &pblk, &n)) < 0) {
+			fs_ext2_index_free(index);
+			return r;
+		}
+		if (pblk == 0)
+			continue;
+
+		if (index->nr_runs == cap) {
+			cap = cap ? 2 * cap : 16;
+			index->runs = fs_xrealloc(index->runs, cap * sizeof(*index->runs));
+		}
+		index->runs[index->nr_runs++] = (struct fs_ext2_run){lblk, pblk, n};
+	}
+
+	/* trim the slack, as the index may live as long as the inode is open */
+	if (index->nr_runs > 0)
+		index->runs = fs_xrealloc(index->runs, index->nr_runs * sizeof(*index->runs));
+	return 0;
+}
+
+void fs_ext2_index_free(struct fs_ext2_index *index)
+{
+	fs_xfree(index->runs);
+	index->runs = NULL;
+	index->nr_runs = 0;
+}
+
+void fs_ext2_index_map(const struct fs_ext2_index *index, uint32_t lblk, uint32_t max,
+		       uint32_t *pblk, uint32_t *len)
+{
+	size_t lo = 0, hi = index->nr_runs;
+	uint32_t end;
+
+	/* the first run that starts past @lblk */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index->runs[mid].lblk <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	const struct fs_ext2_run *prev = lo > 0 ? &index->runs[lo - 1] : NULL;
+	if (prev != NULL && lblk - prev->lblk < prev->len) {
+		*pblk = prev->pblk + (lblk - prev->lblk);
+		end = prev->lblk + prev->len;
+	} else if (lo < index->nr_runs) {
+		*pblk = 0;
+		end = index->runs[lo].lblk;
+	} else {
+		*pblk = 0;
+		*len = max;
+		return;
+	}
+
+	*len = end - lblk < max ? end - lblk : max;
+}
+
+int fs_ext2_read_image(struct fs_ext2 *fs, void *buf, size_t len, uint64_t off)
+{
+	if (fs->map != NULL) {
+		if (off > fs->map_size || len > fs->map_size - off)
+			return -EIO;
+		memcpy(buf, fs->map + off, len);
+		return 0;
+	}
+
+	while (len > 0) {
+		ssize_t n = pread(fs->fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* fs_ext2_read() a run of blocks at a time, mapped by @index if it is not NULL. */
+static ssize_t read_runs(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			 const struct fs_ext2_index *index, void *buf, size_t size, uint64_t off)
+{
+	uint64_t end = ext2_inode_size(inode);
+	uint32_t bs = fs->block_size;
+	size_t done = 0;
+	int r;
+
+	if (off >= end)
+		return 0;
+	if (size > end - off)
+		size = end - off;
+
+	while (done < size) {
+		uint64_t pos = off + done;
+		uint32_t skip = pos % bs;
+		uint64_t want = (skip + (size - done) + bs - 1) / bs;
+		uint32_t max = want < UINT32_MAX ? want : UINT32_MAX;
+		uint32_t pblk, n;
+		size_t len;
+
+		if (index != NULL)
+			fs_ext2_index_map(index, pos / bs, max, &pblk, &n);
+		else if ((r = fs_ext2_bmap_run(fs, inode, pos / bs, max, &pblk, &n)) < 0)
+			return r;
+
+		len = (uint64_t)n * bs - skip < size - done ? (uint64_t)n * bs - skip : size - done;
+		if (pblk == 0)
+			memset((char *)buf + done, 0, len);
+		else if ((r = fs_ext2_read_image(fs, (char *)buf + done, len,
+						  (uint64_t)pblk * bs + skip)) < 0)
+			return r;
+		done += len;
+	}
+
+	return done;
+}
+
+ssize_t fs_ext2_read(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		     void *buf, size_t size, uint64_t off)
+{
+	return read_runs(fs, inode, NULL, buf, size, off);
+}
+
+ssize_t fs_ext2_read_indexed(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			     const struct fs_ext2_index *index, void *buf, size_t size,
+			     uint64_t off)
+{
+	return read_runs(fs, inode, index, buf, size, off);
+}
+
+bool fs_ext2_fast_symlink(const struct fs_ext2 *fs, const struct ext2_inode *inode)
+{
+	/* i_blocks counts 512-byte sectors */
+	uint32_t ea_blocks = inode->i_file_acl != 0 ? fs->block_size >> 9 : 0;
+
+	return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK &&
+		inode->i_blocks - ea_blocks == 0;
+}
+
+ssize_t fs_ext2_readlink(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			 char *buf, size_t size)
+{
+	uint64_t len = ext2_inode_size(inode);
+	bool fast = fs_ext2_fast_symlink(fs, inode);
+	ssize_t r;
+
+	if ((inode->i_mode & EXT2_S_IFMT) != EXT2_S_IFLNK)
+		return -EINVAL;
+	if (fast && len > sizeof(inode->i_block))
+		return -EPROTO;
+	if (len > size)
+		len = size;
+
+	if (fast) {
+		memcpy(buf, inode->i_block, len);
+		return len;
+	}
+
+	if ((r = fs_ext2_read(fs, inode, buf, len, 0)) >= 0 && (uint64_t)r != len)
+		r = -EIO;
+	return r;
+}
+
+/* Large enough for the biggest ext2 block. */
+static const char zeroes[64 * 1024];
+
+int fs_ext2_write_all(int fd, const void *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+int fs_ext2_write_zeroes(int fd, uint64_t len)
+{
+	int r = 0;
+
+	while (len > 0 && r == 0) {
+		size_t n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+		r = fs_ext2_write_all(fd, zeroes, n);
+		len -= n;
+	}
+	return r;
+}
+
+/* Send @len bytes of the image at @off to @sink, a chunk at a time through @buf. */
+static int dump_range(struct fs_ext2 *fs, uint64_t off, uint64_t len, char *buf,
+		      const struct fs_ext2_sink *sink)
+{
+	int r = 0;
+
+	while (len > 0 && r == 0) {
+		size_t want = len < EXT2_DUMP_CHUNK ? len : EXT2_DUMP_CHUNK;
+		ssize_t n = pread(fs->fd, buf, want, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		r = sink->data(sink->arg, buf, n);
+		off += n;
+		len -= n;
+	}
+	return r;
+}
+
+int fs_ext2_dump(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		 const struct fs_ext2_sink *sink, char **buf)
+{
+	uint64_t size = ext2_inode_size(inode);
+	uint32_t nr_blocks = (size + fs->block_size - 1) / fs->block_size;
+	uint32_t n;
+	int r = 0;
+
+	for (uint32_t lblk = 0; lblk < nr_blocks && r == 0; lblk += n) {
+		uint64_t rest = size - (uint64_t)lblk * fs->block_size;
+		uint64_t off, len;
+		uint32_t pblk;
+
+		if ((r = fs_ext2_bmap_run(fs, inode, lblk, nr_blocks - lblk, &pblk, &n)) < 0)
+			break;
+		len = (uint64_t)n * fs->block_size;
+		if (len > rest)
+			len = rest;
+		off = (uint64_t)pblk * fs->block_size;
+
+		if (pblk == 0) {
+			r = sink->hole(sink->arg, len);
+		} else if (fs->map != NULL) {
+			if (off + len > fs->map_size)
+				return -EIO;
+			fs_ext2_advise(fs, off, len, MADV_WILLNEED);
+			r = sink->data(sink->arg, fs->map + off, len);
+		} else {
+			if (*buf == NULL)
+				*buf = fs_xmalloc(EXT2_DUMP_CHUNK);
+			r = dump_range(fs, off, len, *buf, sink);
+		}
+	}
+
+	return r;
+}
+
+static int fd_data(void *arg, const void *buf, size_t len)
+{
+	return fs_ext2_write_all(*(int *)arg, buf, len);
+}
+
+static int fd_hole(void *arg, uint64_t len)
+{
+	return fs_ext2_write_zeroes(*(int *)arg, len);
+}
+
+void fs_ext2_fd_sink(struct fs_ext2_sink *sink, int *fd)
+{
+	sink->data = fd_data;
+	sink->hole = fd_hole;
+	sink->arg = fd;
+}
+
+int fs_ext2_dump_fd(struct fs_ext2 *fs, const struct ext2_inode *inode, int fd, char **buf)
+{
+	struct fs_ext2_sink sink;
+
+	fs_ext2_fd_sink(&sink, &fd);
+	return fs_ext2_dump(fs, inode, &sink, buf);
+}
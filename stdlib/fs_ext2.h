@@ -0,0 +1,425 @@
+#pragma once
+
+#include <fs_bcache.h>
+#include <fs_dcache.h>
+#include <fs_icache.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+   The on-disk format of ext2, as far as the exercises need it, and a
+   reader of ext2 images that fetches all of its metadata (and, when asked
+   to, data) through a block cache. All fields are little-endian.
+ */
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_ROOT_INO 2
+
+#define EXT2_NDIR_BLOCKS 12
+#define EXT2_IND_BLOCK EXT2_NDIR_BLOCKS
+#define EXT2_DIND_BLOCK (EXT2_IND_BLOCK + 1)
+#define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
+#define EXT2_N_BLOCKS (EXT2_TIND_BLOCK + 1)
+
+#define EXT2_NAME_LEN 255
+
+#define EXT2_GOOD_OLD_REV 0
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+#define EXT2_S_IFMT 0xF000
+#define EXT2_S_IFLNK 0xA000
+#define EXT2_S_IFREG 0x8000
+#define EXT2_S_IFDIR 0x4000
+
+#define EXT2_FT_UNKNOWN 0
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR 2
+#define EXT2_FT_SYMLINK 7
+
+struct ext2_super_block
+{
+	uint32_t s_inodes_count;
+	uint32_t s_blocks_count;
+	uint32_t s_r_blocks_count;
+	uint32_t s_free_blocks_count;
+	uint32_t s_free_inodes_count;
+	uint32_t s_first_data_block;
+	uint32_t s_log_block_size;
+	uint32_t s_log_frag_size;
+	uint32_t s_blocks_per_group;
+	uint32_t s_frags_per_group;
+	uint32_t s_inodes_per_group;
+	uint32_t s_mtime;
+	uint32_t s_wtime;
+	uint16_t s_mnt_count;
+	uint16_t s_max_mnt_count;
+	uint16_t s_magic;
+	uint16_t s_state;
+	uint16_t s_errors;
+	uint16_t s_minor_rev_level;
+	uint32_t s_lastcheck;
+	uint32_t s_checkinterval;
+	uint32_t s_creator_os;
+	uint32_t s_rev_level;
+	uint16_t s_def_resuid;
+	uint16_t s_def_resgid;
+	/* EXT2_DYNAMIC_REV */
+	uint32_t s_first_ino;
+	uint16_t s_inode_size;
+	uint16_t s_block_group_nr;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t s_uuid[16];
+	char s_volume_name[16];
+	char s_last_mounted[64];
+	uint32_t s_algorithm_usage_bitmap;
+	uint8_t s_padding[820];
+};
+
+struct ext2_group_desc
+{
+	uint32_t bg_block_bitmap;
+	uint32_t bg_inode_bitmap;
+	uint32_t bg_inode_table;
+	uint16_t bg_free_blocks_count;
+	uint16_t bg_free_inodes_count;
+	uint16_t bg_used_dirs_count;
+	uint16_t bg_pad;
+	uint32_t bg_reserved[3];
+};
+
+struct ext2_inode
+{
+	uint16_t i_mode;
+	uint16_t i_uid;
+	uint32_t i_size;
+	uint32_t i_atime;
+	uint32_t i_ctime;
+	uint32_t i_mtime;
+	uint32_t i_dtime;
+	uint16_t i_gid;
+	uint16_t i_links_count;
+	uint32_t i_blocks;
+	uint32_t i_flags;
+	uint32_t i_osd1;
+	uint32_t i_block[EXT2_N_BLOCKS];
+	uint32_t i_generation;
+	uint32_t i_file_acl;
+	uint32_t i_size_high;
+	uint32_t i_faddr;
+	uint8_t i_osd2[12];
+};
+
+struct ext2_dir_entry_2
+{
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+
+_Static_assert(sizeof(struct ext2_super_block) == 1024, "bad ext2_super_block");
+_Static_assert(sizeof(struct ext2_group_desc) == 32, "bad ext2_group_desc");
+_Static_assert(sizeof(struct ext2_inode) == 128, "bad ext2_inode");
+
+/* The size of a regular file; directories keep ACLs in i_size_high. */
+static inline uint64_t ext2_inode_size(const struct ext2_inode *inode)
+{
+	if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG)
+		return (uint64_t)inode->i_size_high << 32 | inode->i_size;
+	return inode->i_size;
+}
+
+/*
+   A reader of an ext2 image open at @fd. The superblock is read once, and
+   everything else goes through @cache, comes straight from @map if the
+   image is mapped, or is read when needed if there is neither.
+
+   Path lookups go through @dcache, and inodes through @icache, if the
+   caller sets them up after opening. They are not released by
+   fs_ext2_close(), so that they may outlive @fs and serve the next reader
+   of the same image.
+ */
+struct fs_ext2
+{
+	int fd;
+	struct ext2_super_block sb;
+	unsigned int block_size;
+	unsigned int inode_size;
+	unsigned int nr_groups;
+	/* block numbers per indirect block */
+	unsigned int addr_per_block;
+	struct fs_bcache *cache;
+	const char *map;
+	size_t map_size;
+	struct fs_dcache *dcache;
+	struct fs_icache *icache;
+};
+
+/* A block of the image: a pointer into the mapping, a pinned cache buffer,
+   or a scratch buffer of the thread. */
+struct fs_ext2_block
+{
+	const void *data;
+	struct fs_bcache_buf *buf;
+	struct fs_ext2_scratch *scratch;
+};
+
+/*
+   Read and check the superblock of the image at @fd, and set a cache of
+   @cache_blocks blocks (0 picks a default) up for it. @fd stays owned by
+   the caller.
+
+   Return 0, -errno if the superblock cannot be read, or -EPROTO if it
+   makes no sense.
+ */
+int fs_ext2_open(struct fs_ext2 *fs, int fd, size_t cache_blocks);
+
+/*
+   Like fs_ext2_open(), but map the whole image read-only instead of
+   caching blocks, so that blocks are used where they lie in the page cache.
+   Return -errno (-ENODEV and the like) if @fd cannot be mapped.
+ */
+int fs_ext2_open_mmap(struct fs_ext2 *fs, int fd);
+
+/*
+   Like fs_ext2_open(), but without a cache: every block is pread() into a
+   scratch buffer of the calling thread when it is asked for. Threads share
+   nothing but @fd, so none of them waits for another; the page cache of
+   the image is all the caching there is.
+ */
+int fs_ext2_open_direct(struct fs_ext2 *fs, int fd);
+
+/* Release the cache or the mapping of @fs. */
+void fs_ext2_close(struct fs_ext2 *fs);
+
+/*
+   Get block @blkno into @b, and release it with fs_ext2_put_block(). Return
+   0, -EIO if the block is past the end of the image, or -errno.
+ */
+int fs_ext2_get_block(struct fs_ext2 *fs, uint32_t blkno, struct fs_ext2_block *b);
+void fs_ext2_put_block(struct fs_ext2 *fs, struct fs_ext2_block *b);
+
+/* madvise() bytes [@off, @off + @len) of the image if it is mapped. */
+void fs_ext2_advise(struct fs_ext2 *fs, uint64_t off, uint64_t len, int advice);
+
+/*
+   Copy @len bytes of the image at @off into @buf, from the mapping or with
+   pread(), bypassing the cache. Return 0, -EIO past the end of the image,
+   or -errno.
+ */
+int fs_ext2_read_image(struct fs_ext2 *fs, void *buf, size_t len, uint64_t off);
+
+/*
+   Copy the descriptor of block group @group into @gd. Return 0, -EPROTO if
+   it points outside of the image, or -errno.
+ */
+int fs_ext2_read_group_desc(struct fs_ext2 *fs, uint32_t group, struct ext2_group_desc *gd);
+
+/*
+   Copy inode @ino into @inode. Return 0, -EINVAL if @ino is out of range,
+   -EPROTO if its group descriptor is corrupted, and -errno on IO errors.
+ */
+int fs_ext2_read_inode(struct fs_ext2 *fs, uint32_t ino, struct ext2_inode *inode);
+
+/*
+   Return 1 if inode @ino is marked as used in the inode bitmap of its
+   group, 0 if it is not, and -errno on errors.
+ */
+int fs_ext2_inode_in_use(struct fs_ext2 *fs, uint32_t ino);
+
+/*
+   Map logical block @lblk of @inode to a block of the image in @pblk, which
+   is 0 in a hole. Return -EFBIG past the reach of the triple-indirect
+   block, and -EPROTO if the block map points outside of the image.
+ */
+int fs_ext2_bmap(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		 uint32_t lblk, uint32_t *pblk);
+
+/*
+   Return in @blkno the @k-th indirect block of @inode, the one that maps
+   logical blocks from EXT2_NDIR_BLOCKS + @k * addr_per_block on: the
+   single-indirect block for @k == 0, then the children of the double- and
+   of the triple-indirect blocks, in order. @blkno is 0 if it is missing.
+   Return 0, -EFBIG past the last one, or the errors of fs_ext2_bmap().
+ */
+int fs_ext2_ind_block(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		      uint32_t k, uint32_t *blkno);
+
+/*
+   Map up to @max logical blocks of @inode from @lblk at once: return in
+   @len how many of them are either physically contiguous, starting at block
+   @pblk, or all holes, in which case @pblk is 0. @len is 0 only if @max is.
+   Return 0 or the errors of fs_ext2_bmap().
+ */
+int fs_ext2_bmap_run(struct fs_ext2 *fs, const struct ext2_inode *inode, uint32_t lblk,
+		     uint32_t max, uint32_t *pblk, uint32_t *len);
+
+/*
+   A cursor over the entries of a directory, that holds one block of it at a
+   time. Positions are byte offsets in the directory, which stay valid for
+   as long as the image does not change.
+ */
+struct fs_ext2_dir
+{
+	struct fs_ext2 *fs;
+	struct ext2_inode inode;
+	/* the offset of the next entry to look at */
+	uint64_t pos;
+	/* @pos came from fs_ext2_dir_seek(), and may not be on an entry */
+	int resync;
+	/* logical block @lblk, while @b.data is not NULL */
+	uint32_t lblk;
+	struct fs_ext2_block b;
+};
+
+/* Point @d at the first entry of directory @dir. Return 0 or -ENOTDIR. */
+int fs_ext2_dir_open(struct fs_ext2 *fs, const struct ext2_inode *dir, struct fs_ext2_dir *d);
+
+/*
+   Return in @de the next used entry of @d and in @off its offset, and
+   advance past it. @de points into the block held by @d, and is good until
+   the next call. Return 1, 0 at the end of the directory, -EPROTO on a
+   corrupted entry, or -errno.
+ */
+int fs_ext2_dir_next(struct fs_ext2_dir *d, const struct ext2_dir_entry_2 **de, uint64_t *off);
+
+/* Return the offset to seek to in order to resume after the last entry. */
+uint64_t fs_ext2_dir_tell(const struct fs_ext2_dir *d);
+
+/*
+   Resume at offset @off, as returned by fs_ext2_dir_tell(). An offset that
+   falls inside of an entry resumes at the next one, and one past the end
+   ends the iteration.
+ */
+void fs_ext2_dir_seek(struct fs_ext2_dir *d, uint64_t off);
+
+/* Release the block held by @d. */
+void fs_ext2_dir_close(struct fs_ext2_dir *d);
+
+/*
+   Called by fs_ext2_dir_iterate() with every entry of a directory; @off is
+   the byte offset of the entry in the directory. A non-zero return value
+   stops the iteration and is returned from fs_ext2_dir_iterate().
+ */
+typedef int (*fs_ext2_dir_fn)(void *arg, const struct ext2_dir_entry_2 *de, uint64_t off);
+
+/*
+   Call @fn for every used entry of directory @dir. Return 0, the first
+   non-zero value of @fn, -ENOTDIR, or -errno (-EPROTO on a corrupted
+   entry).
+ */
+int fs_ext2_dir_iterate(struct fs_ext2 *fs, const struct ext2_inode *dir,
+			fs_ext2_dir_fn fn, void *arg);
+
+/*
+   Find @name (of @len bytes) in directory @dir, and return its inode number
+   in @ino. Return 0, -ENOENT if there is no such entry, -ENOTDIR if @dir is
+   not a directory, and -errno on other errors.
+ */
+int fs_ext2_lookup(struct fs_ext2 *fs, const struct ext2_inode *dir,
+		   const char *name, size_t len, uint32_t *ino);
+
+/*
+   Resolve @path, relative to the root directory whether it starts with '/'
+   or not, into its inode number @ino and a copy of the inode in @inode.
+   With a dcache, every directory on the way is indexed whole the first time
+   it is walked through, and is not read again. Return 0, -ENOENT, -ENOTDIR, -ENAMETOOLONG, or -errno on other errors.
+ */
+int fs_ext2_namei(struct fs_ext2 *fs, const char *path, uint32_t *ino, struct ext2_inode *inode);
+
+/*
+   Read up to @size bytes of @inode at @off into @buf; holes read as zeroes.
+   Return the number of bytes read (0 at or past the end of the file), or
+   -errno.
+ */
+ssize_t fs_ext2_read(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		     void *buf, size_t size, uint64_t off);
+
+/* A run of @len blocks from logical block @lblk on, that lie from @pblk on. */
+struct fs_ext2_run
+{
+	uint32_t lblk;
+	uint32_t pblk;
+	uint32_t len;
+};
+
+/*
+   The block map of an inode, built once: its runs of physically contiguous
+   blocks, sorted by logical block, with holes in the gaps between them. It
+   maps blocks in O(log @nr_runs) without reading indirect blocks.
+ */
+struct fs_ext2_index
+{
+	struct fs_ext2_run *runs;
+	size_t nr_runs;
+	uint32_t nr_blocks;
+};
+
+/* Walk the block map of @inode into @index. Return 0, or the errors of
+   fs_ext2_bmap(). */
+int fs_ext2_index_build(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			struct fs_ext2_index *index);
+void fs_ext2_index_free(struct fs_ext2_index *index);
+
+/* fs_ext2_bmap_run() through @index; blocks past the last run are holes. */
+void fs_ext2_index_map(const struct fs_ext2_index *index, uint32_t lblk, uint32_t max,
+		       uint32_t *pblk, uint32_t *len);
+
+/* fs_ext2_read() with blocks mapped by @index, built for @inode. */
+ssize_t fs_ext2_read_indexed(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			     const struct fs_ext2_index *index, void *buf, size_t size,
+			     uint64_t off);
+
+/*
+   Whether @inode is a fast symlink, one that keeps its target in i_block:
+   as in Linux, a symlink that owns no block but its extended attribute one.
+ */
+bool fs_ext2_fast_symlink(const struct fs_ext2 *fs, const struct ext2_inode *inode);
+
+/*
+   Read up to @size bytes of the target of the symlink @inode into @buf, with
+   no '\0' after them. Return the number of bytes read, -EINVAL if @inode is
+   not a symlink, -EPROTO if a fast one is longer than i_block, or the errors
+   of fs_ext2_read().
+ */
+ssize_t fs_ext2_readlink(struct fs_ext2 *fs, const struct ext2_inode *inode,
+			 char *buf, size_t size);
+
+/* write() all of @buf to @fd, or @len zeroes. Return 0 or -errno. */
+int fs_ext2_write_all(int fd, const void *buf, size_t len);
+int fs_ext2_write_zeroes(int fd, uint64_t len);
+
+/*
+   Where fs_ext2_dump() sends a file, in order: its data to @data, and the
+   length of each hole to @hole. A non-zero return value stops the dump and
+   is returned from fs_ext2_dump().
+ */
+struct fs_ext2_sink
+{
+	int (*data)(void *arg, const void *buf, size_t len);
+	int (*hole)(void *arg, uint64_t len);
+	void *arg;
+};
+
+/*
+   Send @inode to @sink a run of blocks at a time: blocks that follow each
+   other on disk go out at once straight from the mapping of the image, or
+   in a few large reads through *@buf when it is not mapped. *@buf is
+   allocated on first use, and is the caller's to fs_xfree(), so that it
+   may serve several dumps. Return 0, the errors of fs_ext2_bmap() and
+   @sink, or -errno.
+ */
+int fs_ext2_dump(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		 const struct fs_ext2_sink *sink, char **buf);
+
+/* Set @sink up to write() to *@fd, holes as zeroes. */
+void fs_ext2_fd_sink(struct fs_ext2_sink *sink, int *fd);
+
+/* fs_ext2_dump() to @fd, holes written as zeroes. */
+int fs_ext2_dump_fd(struct fs_ext2 *fs, const struct ext2_inode *inode, int fd, char **buf);
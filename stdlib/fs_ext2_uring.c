@@ -0,0 +1,389 @@
+#include <fs_ext2_uring.h>
+
+/* The rest of stdlib is built into every exercise, and this file only into
+   those that link with liburing. */
+#ifdef FS_EXT2_URING
+
+#include <fs_malloc.h>
+
+#include <liburing.h>
+#include <errno.h>
+#include <stdbool.h>
+
+/* The most bytes one read on the ring asks for. */
+#define EXT2_URING_READ_SIZE (256 * 1024)
+/* Indirect blocks read ahead of the one the block map walk is in. */
+#define EXT2_URING_IND_AHEAD 4
+
+/* fs_ext2_dump() for a kernel that has no io_uring for us. */
+static int dump_sync(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		     const struct fs_ext2_sink *sink)
+{
+	char *buf = NULL;
+	int r = fs_ext2_dump(fs, inode, sink, &buf);
+
+	fs_xfree(buf);
+	return r;
+}
+
+/* The entries of the ring, and the user_data of a request: the index of a
+   piece, or of an indirect block. */
+#define UDATA(idx, ind) ((uint64_t)(idx) << 1 | (ind))
+#define UDATA_IDX(x) ((unsigned int)((x) >> 1))
+#define UDATA_IND(x) ((x) & 1)
+
+/*
+ * A piece of the file on its way to @sink: a run of blocks that follow each
+ * other on disk, read into @buf, or a hole (@off is 0), which is never read.
+ * Pieces are written in file order, each once it is @ready.
+ */
+struct piece
+{
+	char *buf;
+	uint64_t off;
+	uint32_t len;
+	uint32_t done;
+	bool ready;
+};
+
+/*
+ * The @k-th indirect block of a file maps the @k-th addr_per_block blocks
+ * past the direct ones: it is the single-indirect block for k == 0, and
+ * entry k - 1 of the double-indirect block after that. A missing one maps a
+ * hole.
+ */
+struct ind
+{
+	uint32_t *map;
+	uint32_t k;
+	uint32_t blkno;
+	bool hole;
+	bool ready;
+};
+
+/*
+ * Walks the block map ahead of the data: the indirect blocks a few ranges
+ * ahead of the walk are read on the ring, and each run of blocks found is
+ * read into a piece, up to @depth of them in flight, while complete ones are
+ * written out in order.
+ */
+struct dumper
+{
+	struct io_uring ring;
+	struct fs_ext2 *fs;
+	const struct ext2_inode *inode;
+	const struct fs_ext2_sink *sink;
+	uint64_t size;
+	uint32_t nr_blocks;
+	/* the next block to map */
+	uint32_t lblk;
+
+	struct ind inds[EXT2_URING_IND_AHEAD];
+	uint32_t nr_inds;
+	uint32_t next_ind;
+
+	struct piece *pieces;
+	unsigned int depth;
+	/* the next piece to write, and the next one to fill */
+	uint64_t head;
+	uint64_t tail;
+
+	unsigned int inflight;
+	char *buffers;
+	int err;
+};
+
+static void set_err(struct dumper *d, int err)
+{
+	if (!d->err)
+		d->err = err;
+}
+
+static void read_ind(struct dumper *d, unsigned int i)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&d->ring);
+	struct ind *ind = &d->inds[i];
+
+	io_uring_prep_read(sqe, d->fs->fd, ind->map, d->fs->block_size,
+			   (uint64_t)ind->blkno * d->fs->block_size);
+	io_uring_sqe_set_data64(sqe, UDATA(i, 1));
+	d->inflight++;
+}
+
+static void read_piece(struct dumper *d, unsigned int i)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&d->ring);
+	struct piece *p = &d->pieces[i];
+
+	io_uring_prep_read(sqe, d->fs->fd, p->buf + p->done, p->len - p->done, p->off + p->done);
+	io_uring_sqe_set_data64(sqe, UDATA(i, 0));
+	d->inflight++;
+}
+
+/* Start reading the indirect blocks up to EXT2_URING_IND_AHEAD past the walk. */
+static void prefetch(struct dumper *d)
+{
+	uint32_t cur = d->lblk < EXT2_NDIR_BLOCKS ? 0 :
+		(d->lblk - EXT2_NDIR_BLOCKS) / d->fs->addr_per_block;
+	int r;
+
+	while (!d->err && d->next_ind < d->nr_inds && d->next_ind < cur + EXT2_URING_IND_AHEAD) {
+		uint32_t k = d->next_ind++;
+		struct ind *ind = &d->inds[k % EXT2_URING_IND_AHEAD];
+
+		/* the double- and triple-indirect blocks above it come from
+		   the cache: there is one of them per addr_per_block of these */
+		ind->k = k;
+		if ((r = fs_ext2_ind_block(d->fs, d->inode, k, &ind->blkno)) < 0) {
+			set_err(d, r);
+			return;
+		}
+
+		ind->ready = ind->hole = ind->blkno == 0;
+		if (!ind->hole)
+			read_ind(d, k % EXT2_URING_IND_AHEAD);
+	}
+}
+
+/*
+   Point @map at the block map entries from the walk on, and return their
+   number in @count; @map is NULL in a hole. Return false if the indirect
+   block they are in has not been read yet.
+ */
+static bool entries(struct dumper *d, const uint32_t **map, uint32_t *count)
+{
+	uint32_t apb = d->fs->addr_per_block;
+	uint32_t x = d->lblk;
+
+	if (x < EXT2_NDIR_BLOCKS) {
+		*map = d->inode->i_block + x;
+		*count = EXT2_NDIR_BLOCKS - x;
+		return true;
+	}
+	x -= EXT2_NDIR_BLOCKS;
+
+	struct ind *ind = &d->inds[x / apb % EXT2_URING_IND_AHEAD];
+	if (ind->k != x / apb || !ind->ready)
+		return false;
+	*map = ind->hole ? NULL : ind->map + x % apb;
+	*count = apb - x % apb;
+	return true;
+}
+
+/* Turn the block map into pieces, as far as the depth and the indirect
+   blocks read so far allow. */
+static void fill(struct dumper *d)
+{
+	uint32_t bs = d->fs->block_size;
+	uint32_t max_run = EXT2_URING_READ_SIZE / bs;
+
+	while (!d->err && d->lblk < d->nr_blocks && d->tail - d->head < d->depth) {
+		unsigned int i = d->tail % d->depth;
+		struct piece *p = &d->pieces[i];
+		const uint32_t *map;
+		uint32_t count, first, n = 1;
+
+		if (!entries(d, &map, &count))
+			return;
+		if (count > d->nr_blocks - d->lblk)
+			count = d->nr_blocks - d->lblk;
+
+		/* holes are not read, so they are as long as they get */
+		first = map != NULL ? map[0] : 0;
+		while (n < count && (first == 0 || n < max_run) &&
+		       (map != NULL ? map[n] : 0) == (first != 0 ? first + n : 0))
+			n++;
+		if (first != 0 && (uint64_t)first + n > d->fs->sb.s_blocks_count) {
+			set_err(d, -EPROTO);
+			return;
+		}
+
+		uint64_t rest = d->size - (uint64_t)d->lblk * bs;
+		p->off = (uint64_t)first * bs;
+		p->len = (uint64_t)n * bs < rest ? (uint64_t)n * bs : rest;
+		p->done = 0;
+		p->ready = first == 0;
+		if (!p->ready)
+			read_piece(d, i);
+
+		d->lblk += n;
+		d->tail++;
+	}
+}
+
+/* Write out the pieces that are ready, in order. */
+static void flush(struct dumper *d)
+{
+	while (!d->err && d->head < d->tail) {
+		struct piece *p = &d->pieces[d->head % d->depth];
+		int r;
+
+		if (!p->ready)
+			return;
+		if (p->off == 0)
+			r = d->sink->hole(d->sink->arg, p->len);
+		else
+			r = d->sink->data(d->sink->arg, p->buf, p->len);
+		if (r < 0)
+			set_err(d, r);
+		d->head++;
+	}
+}
+
+static void complete(struct dumper *d, struct io_uring_cqe *cqe)
+{
+	uint64_t data = io_uring_cqe_get_data64(cqe);
+	unsigned int i = UDATA_IDX(data);
+	int res = cqe->res;
+
+	d->inflight--;
+	if (d->err)
+		return;
+
+	if (UDATA_IND(data)) {
+		if (res == -EAGAIN || res == -EINTR)
+			read_ind(d, i);
+		else if (res < 0)
+			set_err(d, res);
+		else if ((uint32_t)res < d->fs->block_size)
+			set_err(d, -EIO);
+		else
+			d->inds[i].ready = true;
+		return;
+	}
+
+	struct piece *p = &d->pieces[i];
+	if (res == -EAGAIN || res == -EINTR) {
+		read_piece(d, i);
+	} else if (res < 0) {
+		set_err(d, res);
+	} else if (res == 0) {
+		/* the image ends before the block map says it does */
+		set_err(d, -EIO);
+	} else if ((p->done += res) < p->len) {
+		read_piece(d, i);
+	} else {
+		p->ready = true;
+	}
+}
+
+int fs_ext2_dump_uring(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		       const struct fs_ext2_sink *sink, unsigned int depth)
+{
+	uint32_t apb = fs->addr_per_block;
+	struct dumper d = {
+		.fs = fs,
+		.inode = inode,
+		.sink = sink,
+		.size = ext2_inode_size(inode),
+		.depth = depth,
+	};
+	int r;
+
+	d.nr_blocks = (d.size + fs->block_size - 1) / fs->block_size;
+	if (d.nr_blocks > EXT2_NDIR_BLOCKS)
+		d.nr_inds = (d.nr_blocks - EXT2_NDIR_BLOCKS + apb - 1) / apb;
+	if (d.nr_inds > 1 + apb + (uint64_t)apb * apb)
+		return -EFBIG;
+
+	if ((r = io_uring_queue_init(depth + EXT2_URING_IND_AHEAD, &d.ring, 0)) < 0) {
+		/* no io_uring in this kernel, or not for us */
+		if (r == -ENOSYS || r == -EPERM)
+			return dump_sync(fs, inode, sink);
+		return r;
+	}
+
+	d.pieces = fs_xzalloc(depth * sizeof(*d.pieces));
+	d.buffers = fs_xmalloc((size_t)depth * EXT2_URING_READ_SIZE + EXT2_URING_IND_AHEAD * fs->block_size);
+	for (unsigned int i = 0; i < depth; ++i)
+		d.pieces[i].buf = d.buffers + (size_t)i * EXT2_URING_READ_SIZE;
+	for (unsigned int i = 0; i < EXT2_URING_IND_AHEAD; ++i)
+		d.inds[i].map = (uint32_t *)(d.buffers + (size_t)depth * EXT2_URING_READ_SIZE +
+					     i * fs->block_size);
+
+	for (;;) {
+		struct io_uring_cqe *cqe;
+		unsigned int head, n = 0;
+		uint64_t old_head, old_tail;
+
+		/* writing pieces out makes room for more, and holes are ready
+		   as soon as they are found */
+		do {
+			old_head = d.head;
+			old_tail = d.tail;
+			prefetch(&d);
+			fill(&d);
+			flush(&d);
+		} while (!d.err && (d.head != old_head || d.tail != old_tail));
+
+		if (d.err || (d.head == d.tail && d.lblk >= d.nr_blocks))
+			break;
+
+		r = io_uring_submit_and_wait(&d.ring, 1);
+		if (r < 0 && r != -EINTR && r != -EAGAIN) {
+			set_err(&d, r);
+			break;
+		}
+
+		io_uring_for_each_cqe(&d.ring, head, cqe) {
+			complete(&d, cqe);
+			n++;
+		}
+		io_uring_cq_advance(&d.ring, n);
+	}
+
+	/* nothing may land in the buffers once they are freed: wait for the
+	   reads the kernel has, and drop those still in the submission queue */
+	unsigned int pending = d.inflight - io_uring_sq_ready(&d.ring);
+	bool lost = false;
+
+	while (pending > 0) {
+		struct io_uring_cqe *cqe;
+		r = io_uring_wait_cqe(&d.ring, &cqe);
+		if (r == -EINTR || r == -EAGAIN)
+			continue;
+		if (r < 0) {
+			set_err(&d, r);
+			lost = true;
+			break;
+		}
+		pending--;
+		io_uring_cqe_seen(&d.ring, cqe);
+	}
+
+	io_uring_queue_exit(&d.ring);
+	/* the kernel may still read into them if we lost track of a request */
+	if (!lost)
+		fs_xfree(d.buffers);
+	fs_xfree(d.pieces);
+	return d.err;
+}
+
+int fs_ext2_dump_image(int img, uint32_t inode_nr, const struct fs_ext2_sink *sink,
+		       unsigned int depth)
+{
+	struct fs_ext2 fs;
+	struct ext2_inode inode;
+	char *buf = NULL;
+	int r;
+
+	/* The synchronous path writes straight from a mapping of the image;
+	   reads on the ring land in buffers, and the cache covers metadata. */
+	if (depth > 0)
+		r = fs_ext2_open(&fs, img, 0);
+	else if ((r = fs_ext2_open_mmap(&fs, img)) < 0)
+		r = fs_ext2_open(&fs, img, 0);
+	if (r < 0)
+		return r;
+
+	r = fs_ext2_read_inode(&fs, inode_nr, &inode);
+	if (r == 0)
+		r = depth > 0 ? fs_ext2_dump_uring(&fs, &inode, sink, depth) :
+			fs_ext2_dump(&fs, &inode, sink, &buf);
+
+	fs_xfree(buf);
+	fs_ext2_close(&fs);
+	return r;
+}
+
+#endif
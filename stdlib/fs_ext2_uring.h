@@ -0,0 +1,29 @@
+#pragma once
+
+#include <fs_ext2.h>
+
+/* Reads kept in flight when the caller does not pick a depth. */
+#define FS_EXT2_URING_DEPTH 64
+
+/*
+   fs_ext2_dump() on an io_uring: the block map is walked ahead of the data,
+   its indirect blocks are read a few ahead of the walk, and every run of
+   blocks found is read on the ring, up to @depth of them in flight. Pieces
+   go to @sink in file order as they complete; holes are never read. Without
+   io_uring in the kernel, this falls back to fs_ext2_dump().
+
+   Only built with FS_EXT2_URING defined, by the exercises that link with
+   liburing. Return 0, -EFBIG, -EPROTO on a corrupted block map, the errors
+   of @sink, or -errno.
+ */
+int fs_ext2_dump_uring(struct fs_ext2 *fs, const struct ext2_inode *inode,
+		       const struct fs_ext2_sink *sink, unsigned int depth);
+
+/*
+   Open the image @img, read inode @inode_nr and dump it to @sink: with
+   fs_ext2_dump_uring() for a @depth above 0, and otherwise with
+   fs_ext2_dump() straight from a mapping of the image, or through reads
+   where it cannot be mapped. Return what those return, or -errno.
+ */
+int fs_ext2_dump_image(int img, uint32_t inode_nr, const struct fs_ext2_sink *sink,
+		       unsigned int depth);
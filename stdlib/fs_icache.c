@@ -0,0 +1,108 @@
+#include <fs_icache.h>
+#include <fs_ext2.h>
+#include <fs_malloc.h>
+
+#include <pthread.h>
+
+/* Locks of a cache; a power of two. */
+#define ICACHE_LOCKS 64
+
+/* A slot of the cache; @ino == 0 marks an empty one. */
+struct slot
+{
+	uint32_t ino;
+	struct ext2_inode inode;
+};
+
+/* A lock and the counters it guards, a cache line apart from the next. */
+struct shard
+{
+	pthread_mutex_t lock;
+	struct fs_icache_stats stats;
+} __attribute__((aligned(64)));
+
+struct fs_icache
+{
+	struct shard shards[ICACHE_LOCKS];
+	struct slot *slots;
+	size_t mask;
+};
+
+struct fs_icache* fs_icache_alloc(size_t nr_inodes)
+{
+	struct fs_icache *c;
+	size_t n = ICACHE_LOCKS;
+
+	if (nr_inodes == 0)
+		nr_inodes = FS_ICACHE_DEFAULT_INODES;
+	while (n < nr_inodes)
+		n <<= 1;
+
+	/* fs_xmalloc() does not promise the alignment of the shards */
+	c = fs_xaligned_alloc(64, sizeof(*c));
+	for (unsigned int i = 0; i < ICACHE_LOCKS; ++i) {
+		pthread_mutex_init(&c->shards[i].lock, NULL);
+		c->shards[i].stats = (struct fs_icache_stats){0};
+	}
+	c->slots = fs_xzalloc(n * sizeof(*c->slots));
+	c->mask = n - 1;
+	return c;
+}
+
+void fs_icache_free(struct fs_icache *c)
+{
+	if (c == NULL)
+		return;
+
+	for (unsigned int i = 0; i < ICACHE_LOCKS; ++i)
+		pthread_mutex_destroy(&c->shards[i].lock);
+	fs_xfree(c->slots);
+	fs_xfree(c);
+}
+
+static size_t slot_of(const struct fs_icache *c, uint32_t ino)
+{
+	/* neighbouring inodes take neighbouring slots, under different locks */
+	return ino & c->mask;
+}
+
+int fs_icache_get(struct fs_icache *c, uint32_t ino, struct ext2_inode *inode)
+{
+	size_t i = slot_of(c, ino);
+	struct shard *sh = &c->shards[i % ICACHE_LOCKS];
+	int hit;
+
+	pthread_mutex_lock(&sh->lock);
+	if ((hit = c->slots[i].ino == ino)) {
+		*inode = c->slots[i].inode;
+		sh->stats.hits++;
+	} else {
+		sh->stats.misses++;
+	}
+	pthread_mutex_unlock(&sh->lock);
+	return hit;
+}
+
+void fs_icache_put(struct fs_icache *c, uint32_t ino, const struct ext2_inode *inode)
+{
+	size_t i = slot_of(c, ino);
+	struct shard *sh = &c->shards[i % ICACHE_LOCKS];
+
+	pthread_mutex_lock(&sh->lock);
+	c->slots[i].ino = ino;
+	c->slots[i].inode = *inode;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void fs_icache_stats(struct fs_icache *c, struct fs_icache_stats *stats)
+{
+	*stats = (struct fs_icache_stats){0};
+	for (unsigned int i = 0; i < ICACHE_LOCKS; ++i) {
+		struct shard *sh = &c->shards[i];
+
+		pthread_mutex_lock(&sh->lock);
+		stats->hits += sh->stats.hits;
+		stats->misses += sh->stats.misses;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   A cache of ext2 inodes by number, for read-only images. It is direct
+   mapped: an inode has one slot it can be in, and takes it over from
+   whatever inode was there. Slots are guarded by a few dozen locks, picked
+   by slot, so that threads looking up different inodes seldom wait for
+   each other.
+ */
+struct fs_icache;
+struct ext2_inode;
+
+/* Inodes kept when fs_icache_alloc() is asked for 0. */
+#define FS_ICACHE_DEFAULT_INODES (64 * 1024)
+
+struct fs_icache_stats
+{
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Set up a cache of at least @nr_inodes inodes (0 picks a default). */
+struct fs_icache* fs_icache_alloc(size_t nr_inodes);
+void fs_icache_free(struct fs_icache *c);
+
+/* Copy inode @ino into @inode and return 1 if it is cached, or return 0. */
+int fs_icache_get(struct fs_icache *c, uint32_t ino, struct ext2_inode *inode);
+
+/* Cache a copy of @inode as inode @ino. */
+void fs_icache_put(struct fs_icache *c, uint32_t ino, const struct ext2_inode *inode);
+
+/* Add the counters of @c up into @stats. */
+void fs_icache_stats(struct fs_icache *c, struct fs_icache_stats *stats);
@@ -19,6 +19,14 @@ void* fs_xzalloc(size_t size)
 	return x;
 }
 
+void* fs_xaligned_alloc(size_t align, size_t size)
+{
+	void *x;
+	if (posix_memalign(&x, align, size) != 0)
+		errx(1, "posix_memalign() failed");
+	return x;
+}
+
 void* fs_xrealloc(void *x, size_t size)
 {
 	x = realloc(x, size);
@@ -9,6 +9,10 @@ void* fs_xmalloc(size_t size) __attribute__((malloc));
    and panics if an allocation fails. */
 void* fs_xzalloc(size_t size) __attribute__((malloc));
 
+/* A version of malloc() that returns memory aligned to @align, a power of
+   two and a multiple of sizeof(void *), and panics if an allocation fails. */
+void* fs_xaligned_alloc(size_t align, size_t size) __attribute__((malloc));
+
 /* A version of realloc() that panics if an allocation fails. */
 void* fs_xrealloc(void *x, size_t size);
 
@@ -0,0 +1,83 @@
+#include <fs_mpsc.h>
+
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* This is Dmitry Vyukov's intrusive MPSC queue: producers swap themselves
+   into @head and then link the previous head to them; the consumer walks
+   from @tail. A producer preempted between the two steps makes the queue
+   look empty for a moment, which fs_mpsc_pop() reports as NULL. */
+
+void fs_mpsc_init(struct fs_mpsc *q)
+{
+	atomic_store(&q->stub.next, NULL);
+	atomic_store(&q->head, &q->stub);
+	q->tail = &q->stub;
+	atomic_store(&q->seq, 0);
+	atomic_store(&q->sleeping, 0);
+}
+
+static void link_node(struct fs_mpsc *q, struct fs_mpsc_node *n)
+{
+	atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+	struct fs_mpsc_node *prev = atomic_exchange(&q->head, n);
+	atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+void fs_mpsc_push(struct fs_mpsc *q, struct fs_mpsc_node *n)
+{
+	link_node(q, n);
+
+	/* Pairs with fs_mpsc_pop_wait(): either the consumer sees the new
+	   @seq and does not sleep, or we see @sleeping and wake it up. */
+	atomic_fetch_add(&q->seq, 1);
+	if (atomic_load(&q->sleeping))
+		syscall(SYS_futex, &q->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+struct fs_mpsc_node* fs_mpsc_pop(struct fs_mpsc *q)
+{
+	struct fs_mpsc_node *tail = q->tail;
+	struct fs_mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != atomic_load(&q->head))
+		return NULL;
+
+	link_node(q, &q->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+struct fs_mpsc_node* fs_mpsc_pop_wait(struct fs_mpsc *q)
+{
+	for (;;) {
+		unsigned int seq = atomic_load(&q->seq);
+		struct fs_mpsc_node *n = fs_mpsc_pop(q);
+		if (n != NULL)
+			return n;
+
+		atomic_store(&q->sleeping, 1);
+		syscall(SYS_futex, &q->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+		atomic_store(&q->sleeping, 0);
+	}
+}
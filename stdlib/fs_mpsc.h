@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdatomic.h>
+
+/*
+   An intrusive lock-free multi-producer single-consumer queue. Any number of
+   threads may fs_mpsc_push() concurrently; only one thread may pop. Embed
+   struct fs_mpsc_node into the items to queue.
+ */
+struct fs_mpsc_node
+{
+	struct fs_mpsc_node *_Atomic next;
+};
+
+struct fs_mpsc
+{
+	struct fs_mpsc_node *_Atomic head;
+	struct fs_mpsc_node *tail;
+	struct fs_mpsc_node stub;
+
+	atomic_uint seq;
+	atomic_int sleeping;
+};
+
+void fs_mpsc_init(struct fs_mpsc *q);
+
+/* Enqueue @n. Never blocks, and wakes up the consumer if it is waiting. */
+void fs_mpsc_push(struct fs_mpsc *q, struct fs_mpsc_node *n);
+
+/* Dequeue the oldest node, or return NULL if there is nothing to pop right now. */
+struct fs_mpsc_node* fs_mpsc_pop(struct fs_mpsc *q);
+
+/* Dequeue the oldest node, sleeping until one is pushed if the queue is empty. */
+struct fs_mpsc_node* fs_mpsc_pop_wait(struct fs_mpsc *q);
@@ -0,0 +1,149 @@
+#include <fs_pool.h>
+#include <fs_malloc.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <err.h>
+
+/* A worker owns batches [lo, hi), packed into one word so that the owner
+   (taking from @lo) and thieves (taking from @hi) can race with a CAS. */
+#define RANGE(lo, hi) ((uint64_t)(hi) << 32 | (uint32_t)(lo))
+#define RANGE_LO(r) ((uint32_t)(r))
+#define RANGE_HI(r) ((uint32_t)((r) >> 32))
+
+struct fs_pool_worker
+{
+	_Atomic uint64_t range;
+	struct fs_pool *pool;
+	unsigned int id;
+	pthread_t thread;
+};
+
+struct fs_pool
+{
+	size_t n;
+	size_t batch;
+	fs_pool_fn fn;
+	void *arg;
+
+	unsigned int nr_workers;
+	struct fs_pool_worker workers[];
+};
+
+unsigned int fs_pool_default_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+}
+
+static bool take_own(struct fs_pool_worker *w, uint32_t *batch)
+{
+	uint64_t r = atomic_load(&w->range);
+	while (RANGE_LO(r) < RANGE_HI(r)) {
+		if (atomic_compare_exchange_weak(&w->range, &r,
+						 RANGE(RANGE_LO(r) + 1, RANGE_HI(r)))) {
+			*batch = RANGE_LO(r);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool steal(struct fs_pool_worker *w)
+{
+	struct fs_pool *p = w->pool;
+
+	for (unsigned int k = 1; k < p->nr_workers; ++k) {
+		struct fs_pool_worker *v = &p->workers[(w->id + k) % p->nr_workers];
+		uint64_t r = atomic_load(&v->range);
+
+		while (RANGE_LO(r) < RANGE_HI(r)) {
+			uint32_t lo = RANGE_LO(r), hi = RANGE_HI(r);
+			uint32_t mid = hi - (hi - lo + 1) / 2;
+
+			if (atomic_compare_exchange_weak(&v->range, &r, RANGE(lo, mid))) {
+				/* Our range is empty, and thieves leave empty
+				   ranges alone, so a plain store is enough. */
+				atomic_store(&w->range, RANGE(mid, hi));
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void* worker_main(void *x)
+{
+	struct fs_pool_worker *w = x;
+	struct fs_pool *p = w->pool;
+
+	do {
+		uint32_t batch;
+		while (take_own(w, &batch)) {
+			size_t lo = (size_t)batch * p->batch;
+			size_t hi = lo + p->batch < p->n ? lo + p->batch : p->n;
+			for (size_t idx = lo; idx < hi; ++idx)
+				p->fn(p->arg, w->id, idx);
+		}
+	} while (steal(w));
+
+	return NULL;
+}
+
+struct fs_pool* fs_pool_start(unsigned int nr_workers, size_t n, size_t batch,
+			      fs_pool_fn fn, void *arg)
+{
+	if (nr_workers == 0)
+		nr_workers = fs_pool_default_workers();
+	if (batch == 0)
+		batch = 1;
+
+	size_t nr_batches = (n + batch - 1) / batch;
+	if (nr_batches > UINT32_MAX)
+		errx(1, "fs_pool: too many batches");
+
+	struct fs_pool *p = fs_xzalloc(sizeof(*p) + nr_workers * sizeof(p->workers[0]));
+	p->n = n;
+	p->batch = batch;
+	p->fn = fn;
+	p->arg = arg;
+	p->nr_workers = nr_workers;
+
+	for (unsigned int i = 0; i < nr_workers; ++i) {
+		struct fs_pool_worker *w = &p->workers[i];
+		size_t lo = nr_batches * i / nr_workers;
+		size_t hi = nr_batches * (i + 1) / nr_workers;
+
+		w->pool = p;
+		w->id = i;
+		atomic_store(&w->range, RANGE(lo, hi));
+	}
+
+	for (unsigned int i = 0; i < nr_workers; ++i) {
+		if (pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]))
+			errx(1, "pthread_create() failed");
+	}
+
+	return p;
+}
+
+unsigned int fs_pool_workers(const struct fs_pool *p)
+{
+	return p->nr_workers;
+}
+
+void fs_pool_wait(struct fs_pool *p)
+{
+	for (unsigned int i = 0; i < p->nr_workers; ++i)
+		pthread_join(p->workers[i].thread, NULL);
+	fs_xfree(p);
+}
+
+void fs_pool_run(unsigned int nr_workers, size_t n, size_t batch,
+		 fs_pool_fn fn, void *arg)
+{
+	fs_pool_wait(fs_pool_start(nr_workers, n, batch, fn, arg));
+}
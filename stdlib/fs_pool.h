@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+   A fixed pool of worker threads that runs fn(arg, worker, idx) once for
+   every idx in [0, n). The indices are cut into batches of @batch, and each
+   worker starts with an equal share of the batches. A worker that runs out
+   of its own batches steals half of what is left from another one, so a few
+   slow items do not hold up the rest.
+
+   @worker is in [0, nr_workers) and is stable for a thread, so callers may
+   keep per-worker scratch state indexed by it.
+ */
+struct fs_pool;
+
+typedef void (*fs_pool_fn)(void *arg, unsigned int worker, size_t idx);
+
+/* Return the number of workers to use when a caller asks for 0. */
+unsigned int fs_pool_default_workers(void);
+
+/* Start @nr_workers threads (0 means one per online CPU) over [0, @n), and
+   return without waiting for them. */
+struct fs_pool* fs_pool_start(unsigned int nr_workers, size_t n, size_t batch,
+			      fs_pool_fn fn, void *arg);
+
+/* Return the number of workers @p runs with. */
+unsigned int fs_pool_workers(const struct fs_pool *p);
+
+/* Wait until every index was processed, and release @p. */
+void fs_pool_wait(struct fs_pool *p);
+
+/* fs_pool_start() followed by fs_pool_wait(). */
+void fs_pool_run(unsigned int nr_workers, size_t n, size_t batch,
+		 fs_pool_fn fn, void *arg);
@@ -0,0 +1,70 @@
+#include <fs_proc.h>
+#include <fs_malloc.h>
+
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* getdents64() buffer for /proc; large enough to drain tens of thousands of
+   PIDs in a handful of syscalls. */
+#define DENTS_SIZE (64 * 1024)
+
+pid_t fs_proc_parse_pid(const char *name)
+{
+	pid_t pid = 0;
+
+	if (*name == '\0')
+		return 0;
+	for (; *name; ++name) {
+		if (*name < '0' || *name > '9')
+			return 0;
+		pid = pid * 10 + (*name - '0');
+	}
+	return pid;
+}
+
+static int compare_pids(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+	return (x > y) - (x < y);
+}
+
+int fs_proc_list_pids(int procfd, pid_t **pids, size_t *nr_pids)
+{
+	char *dents = fs_xmalloc(DENTS_SIZE);
+	size_t n = 0, cap = 1024;
+	pid_t *v = fs_xmalloc(cap * sizeof(*v));
+	int r = 0;
+
+	for (;;) {
+		ssize_t len = getdents64(procfd, dents, DENTS_SIZE);
+		if (len < 0) {
+			r = -errno;
+			break;
+		}
+		if (len == 0)
+			break;
+
+		for (ssize_t off = 0; off < len;) {
+			struct dirent64 *d = (struct dirent64 *)(dents + off);
+			off += d->d_reclen;
+
+			pid_t pid = fs_proc_parse_pid(d->d_name);
+			if (d->d_type != DT_DIR || pid <= 0)
+				continue;
+
+			if (n == cap) {
+				cap *= 2;
+				v = fs_xrealloc(v, cap * sizeof(*v));
+			}
+			v[n++] = pid;
+		}
+	}
+
+	fs_xfree(dents);
+	qsort(v, n, sizeof(*v), compare_pids);
+	*pids = v;
+	*nr_pids = n;
+	return r;
+}
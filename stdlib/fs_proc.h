@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* The PID a /proc entry named @name is for, or 0 if it is not a process. */
+pid_t fs_proc_parse_pid(const char *name);
+
+/* Collect the PIDs of all processes in the /proc directory @procfd into
+   *@pids, sorted, to be released with fs_xfree(). Return 0, or -errno if
+   the listing broke off; *@pids then holds the PIDs read until then. */
+int fs_proc_list_pids(int procfd, pid_t **pids, size_t *nr_pids);
@@ -0,0 +1,134 @@
+#include <fs_slab.h>
+#include <fs_malloc.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <err.h>
+#include <sys/mman.h>
+
+/* Smallest block, and the size of a huge page. */
+#define SLAB_BLOCK (1 << 20)
+#define SLAB_HUGE_PAGE (2 << 20)
+
+/* The least number of objects in a block. */
+#define SLAB_MIN_OBJECTS 16
+
+struct free_obj
+{
+	struct free_obj *next;
+};
+
+struct fs_slab
+{
+	size_t size;
+	size_t block_size;
+	bool huge;
+	/* MAP_HUGETLB failed once: do not ask again */
+	bool no_hugetlb;
+
+	struct free_obj *free;
+	/* the rest of the last block */
+	char *next;
+	char *end;
+
+	void **blocks;
+	size_t nr_blocks;
+	size_t in_use;
+};
+
+struct fs_slab* fs_slab_alloc(size_t size, size_t align, unsigned int flags)
+{
+	struct fs_slab *s = fs_xzalloc(sizeof(*s));
+
+	if (align < sizeof(struct free_obj))
+		align = sizeof(struct free_obj);
+	s->size = (size + align - 1) & ~(align - 1);
+	s->huge = flags & FS_SLAB_HUGE;
+	s->block_size = s->huge ? SLAB_HUGE_PAGE : SLAB_BLOCK;
+	while (s->block_size < SLAB_MIN_OBJECTS * s->size)
+		s->block_size <<= 1;
+	return s;
+}
+
+void fs_slab_free(struct fs_slab *s)
+{
+	if (s == NULL)
+		return;
+
+	for (size_t i = 0; i < s->nr_blocks; ++i)
+		munmap(s->blocks[i], s->block_size);
+	fs_xfree(s->blocks);
+	fs_xfree(s);
+}
+
+/* Map a block of transparent huge pages: they need a 2M-aligned range, so
+   map more than that and cut off both ends. */
+static void* map_thp(size_t size)
+{
+	char *p = mmap(NULL, size + SLAB_HUGE_PAGE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	char *start = (char *)(((uintptr_t)p + SLAB_HUGE_PAGE - 1) & ~(uintptr_t)(SLAB_HUGE_PAGE - 1));
+	if (start > p)
+		munmap(p, start - p);
+	munmap(start + size, p + SLAB_HUGE_PAGE - start);
+	madvise(start, size, MADV_HUGEPAGE);
+	return start;
+}
+
+static void* map_block(struct fs_slab *s)
+{
+	void *p;
+
+	if (!s->huge)
+		p = mmap(NULL, s->block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	else if (s->no_hugetlb ||
+		 (p = mmap(NULL, s->block_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) == MAP_FAILED) {
+		s->no_hugetlb = true;
+		p = map_thp(s->block_size);
+	}
+
+	if (p == MAP_FAILED)
+		err(1, "mmap() failed");
+	return p;
+}
+
+void* fs_slab_get(struct fs_slab *s)
+{
+	void *p;
+
+	s->in_use++;
+	if (s->free != NULL) {
+		p = s->free;
+		s->free = s->free->next;
+		return p;
+	}
+
+	if ((size_t)(s->end - s->next) < s->size) {
+		s->blocks = fs_xrealloc(s->blocks, (s->nr_blocks + 1) * sizeof(*s->blocks));
+		s->next = s->blocks[s->nr_blocks++] = map_block(s);
+		s->end = s->next + s->block_size / s->size * s->size;
+	}
+
+	p = s->next;
+	s->next += s->size;
+	return p;
+}
+
+void fs_slab_put(struct fs_slab *s, void *p)
+{
+	struct free_obj *o = p;
+
+	o->next = s->free;
+	s->free = o;
+	s->in_use--;
+}
+
+void fs_slab_stats(struct fs_slab *s, struct fs_slab_stats *stats)
+{
+	stats->mapped = s->nr_blocks * s->block_size;
+	stats->in_use = s->in_use;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+   An allocator of objects of a single size. Objects are cut from large
+   blocks one after the other, and those put back are kept on a list
+   threaded through them, to be handed out again first. fs_slab_free()
+   unmaps every block at once, whatever objects are still in use, so a
+   structure built from a slab needs no walk to be freed.
+ */
+struct fs_slab;
+
+/* Back the slab with 2M pages: reserved huge pages if there are any left,
+   and transparent huge pages otherwise. */
+#define FS_SLAB_HUGE 0x1
+
+struct fs_slab_stats
+{
+	/* bytes of blocks mapped */
+	size_t mapped;
+	/* objects handed out and not put back */
+	size_t in_use;
+};
+
+/* Set up a slab of objects of @size bytes, aligned to @align, a power of
+   two no larger than a page. @flags is a combination of FS_SLAB_*. */
+struct fs_slab* fs_slab_alloc(size_t size, size_t align, unsigned int flags);
+void fs_slab_free(struct fs_slab *s);
+
+void* fs_slab_get(struct fs_slab *s);
+void fs_slab_put(struct fs_slab *s, void *p);
+
+void fs_slab_stats(struct fs_slab *s, struct fs_slab_stats *stats);